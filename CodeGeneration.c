@@ -6,8 +6,11 @@
 #include "token.h"
 #include "data.h"
 #include "symbol.h"
+#include "bytecode.h"
+#include "aot.h"
 #include <string.h>
 #include <stdlib.h>
+#include <setjmp.h>
 
 /**
  * This pointer is set when by codeGenerator() func and used by printEmittedCode() func.
@@ -18,6 +21,31 @@
  * */
 FILE* _out;
 
+/**
+ * Set by codeGeneratorBytecode(). When set, printEmittedCodes() writes the
+ * emitted code as a bytecode file instead of text.
+ * */
+int _bytecodeOut;
+
+/**
+ * Set by codeGeneratorC(). When set, printEmittedCodes() writes the emitted
+ * code as a standalone C program (see aot.h) instead of text.
+ * */
+int _cOut;
+
+/**
+ * Set by codeGenerator() while it runs. emit() jumps back to it when an
+ * instruction cannot be emitted, so that the error is returned to the caller
+ * instead of ending the process.
+ * */
+jmp_buf _emitFailed;
+
+/**
+ * Returned by codeGenerator() when emit() failed. The reason is already
+ * printed on stderr, so it has no codeGeneratorErrMsg entry.
+ * */
+#define EMIT_FAILED -1
+
 /**
  * Token list iterator used by the code generator. It will be set once entered to
  * codeGenerator() and reset before exiting codeGenerator().
@@ -50,8 +78,16 @@ SymbolTable symbolTable;
 
 /**
  * The array of instructions that the generated(emitted) code will be held.
+ * Instructions are stored in the packed encoding of bytecode.h. The array is
+ * allocated by emit(), starting with MAX_CODE_LENGTH instructions and doubling
+ * whenever it is full, and is kept for the next program.
+ * */
+PackedInstruction* vmCode;
+
+/**
+ * The number of instructions vmCode has room for.
  * */
-Instruction vmCode[MAX_CODE_LENGTH];
+int vmCodeCapacity;
 
 /**
  * The next index in the array of instructions (vmCode) to be filled.
@@ -67,12 +103,17 @@ int currentReg;
  * Emits the instruction whose fields are given as parameters.
  * Internally, writes the instruction to vmCode[nextCodeIndex] and returns the
  * nextCodeIndex by post-incrementing it.
- * If MAX_CODE_LENGTH is reached, prints an error message on stderr and exits.
+ * If vmCode cannot grow (code addresses must fit the M field, see
+ * PACKED_MAX_CODE_LENGTH), or the fields do not fit the packed encoding,
+ * prints an error message on stderr and makes codeGenerator() return
+ * EMIT_FAILED.
  * */
 int emit(int OP, int R, int L, int M);
 
 /**
- * Prints the emitted code array (vmCode) to output file.
+ * Prints the emitted code array (vmCode) to output file, as text, as a
+ * bytecode file (see bytecode.h) when requested by codeGeneratorBytecode(),
+ * or as a C program when requested by codeGeneratorC().
  * 
  * This func is called in the given codeGenerator() function. You are not required
  * to have another call to this function in your code.
@@ -149,29 +190,59 @@ void nextToken()
  * */
 void printCGErr(int errCode, FILE* fp)
 {
-    if(!fp || !errCode) return;
+    if(!fp || !errCode || errCode == EMIT_FAILED) return;
 
     fprintf(fp, "CODE GENERATOR ERROR[%d]: %s.\n", errCode, codeGeneratorErrMsg[errCode]);
 }
 
 int emit(int OP, int R, int L, int M)
 {
-    if(nextCodeIndex == MAX_CODE_LENGTH)
+    if(nextCodeIndex == vmCodeCapacity)
     {
-        fprintf(stderr, "MAX_CODE_LENGTH(%d) reached. Emit is unsuccessful: terminating code generator..\n", MAX_CODE_LENGTH);
-        exit(0);
+        int capacity = vmCodeCapacity ? vmCodeCapacity * 2 : MAX_CODE_LENGTH;
+        if(capacity > PACKED_MAX_CODE_LENGTH)
+            capacity = PACKED_MAX_CODE_LENGTH;
+        PackedInstruction* grown = NULL;
+        if(capacity > vmCodeCapacity)
+            grown = realloc(vmCode, capacity * sizeof(PackedInstruction));
+        if(!grown)
+        {
+            fprintf(stderr, "Code memory cannot grow past %d instructions. Emit is unsuccessful: terminating code generator..\n", nextCodeIndex);
+            longjmp(_emitFailed, 1);
+        }
+        vmCode = grown;
+        vmCodeCapacity = capacity;
     }
     
-    vmCode[nextCodeIndex] = (Instruction){ .op = OP, .r = R, .l = L, .m = M};    
+    if(!canPackInstruction(OP, R, L, M))
+    {
+        fprintf(stderr, "Instruction (%d %d %d %d) cannot be encoded. Emit is unsuccessful: terminating code generator..\n", OP, R, L, M);
+        longjmp(_emitFailed, 1);
+    }
+
+    vmCode[nextCodeIndex] = packInstruction(OP, R, L, M);
 
     return nextCodeIndex++;
 }
 
 void printEmittedCodes()
 {
+    if(_bytecodeOut)
+    {
+        if(writeBytecode(_out, vmCode, nextCodeIndex, NULL, 0, NULL, 0) != 0)
+            fprintf(stderr, "Cannot write the bytecode file.\n");
+        return;
+    }
+    if(_cOut)
+    {
+        if(translateToC(_out, vmCode, nextCodeIndex) != 0)
+            fprintf(stderr, "Cannot write the C program.\n");
+        return;
+    }
+
     for(int i = 0; i < nextCodeIndex; i++)
     {
-        Instruction c = vmCode[i];
+        Instruction c = unpackInstruction(vmCode[i]);
         fprintf(_out, "%d %d %d %d\n", c.op, c.r, c.l, c.m);
     }
 }
@@ -402,7 +473,8 @@ void T5()
  * If encountered, returns the error code.
  * 
  * Returning 0 signals successful code generation.
- * Otherwise, returns a non-zero code generator error code.
+ * Otherwise, returns a non-zero code generator error code, or EMIT_FAILED if
+ * the code does not fit code memory or the packed encoding.
  * */
 int codeGenerator(TokenList tokenList, FILE* out)
 {
@@ -430,8 +502,13 @@ int codeGenerator(TokenList tokenList, FILE* out)
     // Initialize symbol table
     initSymbolTable(&symbolTable);
 
-    // Start parsing by parsing program as the grammar suggests.
-    int err = program();
+    // Start parsing by parsing program as the grammar suggests. An
+    // .. instruction that cannot be emitted ends it here.
+    int err;
+    if(setjmp(_emitFailed))
+        err = EMIT_FAILED;
+    else
+        err = program();
 
     // Print symbol table - if no error occured
     if(!err)
@@ -453,6 +530,32 @@ int codeGenerator(TokenList tokenList, FILE* out)
     // Return err code - which is 0 if parsing was successful
     return err;
 }
+
+/**
+ * Same as codeGenerator(), but writes the generated code as a bytecode file,
+ * which the virtual machine can map and run without parsing. The file pointer
+ * should be opened in binary mode.
+ * */
+int codeGeneratorBytecode(TokenList tokenList, FILE* out)
+{
+    _bytecodeOut = 1;
+    int err = codeGenerator(tokenList, out);
+    _bytecodeOut = 0;
+    return err;
+}
+
+/**
+ * Same as codeGenerator(), but translates the generated code into a standalone
+ * C program, to be compiled with the system C compiler and run natively.
+ * */
+int codeGeneratorC(TokenList tokenList, FILE* out)
+{
+    _cOut = 1;
+    int err = codeGenerator(tokenList, out);
+    _cOut = 0;
+    return err;
+}
+
 // Already implemented.
 int program()
 {
@@ -0,0 +1,241 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program translates virtual machine code into a standalone C program
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "vm.h"
+#include "verify.h"
+#include "aot.h"
+
+// C operators of the binary register instructions ADD (13) .. GEQ (24),
+// .. NULL for ODD, which only reads R
+static const char* binaryOperators[] =
+{
+    "+", "-", "*", "/", NULL, "%", "==", "!=", "<", "<=", ">", ">="
+};
+
+// Print the C expression of the base pointer for the lexicographic level L
+static void writeBase(FILE* out, int L)
+{
+    if(L == 0)
+        fprintf(out, "bp");
+    else
+        fprintf(out, "base(stack, bp, %d)", L);
+}
+
+// Print the checks checkInstruction() makes before the stack instructions of
+// .. programs that are not verified. LOD, STO and CAL leave the base pointer
+// .. of level L in b, inside the block they open.
+static void writeCheck(FILE* out, Instruction insi, int cells)
+{
+    switch(insi.op)
+    {
+      case 2: // RTN reads the dynamic link and the return address
+        fprintf(out, "if(bp < 0 || bp + 3 >= %d) goto illegal; ", cells);
+        break;
+      case 3: // LOD
+      case 4: // STO
+        fprintf(out, "int b; if(!checkedBase(stack, bp, %d, &b) || b + %d < 0 || b + %d >= %d) goto illegal; ",
+                insi.l, insi.m, insi.m, cells);
+        break;
+      case 5: // CAL writes four cells above SP
+        fprintf(out, "int b; if(!checkedBase(stack, bp, %d, &b) || sp < -1 || sp + 4 >= %d) goto illegal; ",
+                insi.l, cells);
+        break;
+      case 6: // INC keeps SP next to the stack
+        fprintf(out, "if(sp + %d < -1 || sp + %d >= %d) goto illegal; ", insi.m, insi.m, cells);
+        break;
+    }
+}
+
+// Print the C statements of one instruction. Fetching an instruction advances
+// .. PC first, so the return address stored by CAL is the next instruction.
+// If (checked) is set, the stack instructions are checked first (see writeCheck()).
+static void writeInstruction(FILE* out, Instruction insi, int pc, int checked, int cells)
+{
+    int block = checked && insi.op >= 3 && insi.op <= 5;
+    if(block)
+        fprintf(out, "{ ");
+    if(checked)
+        writeCheck(out, insi, cells);
+
+    switch(insi.op)
+    {
+      case 1: // LIT
+        fprintf(out, "RF[%d] = %d;", insi.r, insi.m);
+        break;
+      case 2: // RTN
+        fprintf(out, "sp = bp - 1; bp = stack[sp + 3]; pc = stack[sp + 4]; goto dispatch;");
+        break;
+      case 3: // LOD
+        fprintf(out, "RF[%d] = stack[", insi.r);
+        if(checked)
+            fprintf(out, "b");
+        else
+            writeBase(out, insi.l);
+        fprintf(out, " + %d];", insi.m);
+        break;
+      case 4: // STO stores the register index, like executeInstruction()
+        fprintf(out, "stack[");
+        if(checked)
+            fprintf(out, "b");
+        else
+            writeBase(out, insi.l);
+        fprintf(out, " + %d] = %d;", insi.m, insi.r);
+        break;
+      case 5: // CAL
+        fprintf(out, "stack[sp + 1] = 0; stack[sp + 2] = ");
+        if(checked)
+            fprintf(out, "b");
+        else
+            writeBase(out, insi.l);
+        fprintf(out, "; stack[sp + 3] = bp; stack[sp + 4] = %d; bp = sp + 1; ", pc + 1);
+        fprintf(out, "goto L%d;", insi.m);
+        break;
+      case 6: // INC
+        fprintf(out, "sp = sp + %d;", insi.m);
+        break;
+      case 7: // JMP
+        fprintf(out, "goto L%d;", insi.m);
+        break;
+      case 8: // JPC
+        fprintf(out, "if(RF[%d] == 0) ", insi.r);
+        fprintf(out, "goto L%d;", insi.m);
+        break;
+      case 9: // SIO write
+        fprintf(out, "printf(\"%%d \", RF[%d]);", insi.r);
+        break;
+      case 10: // SIO read
+        fprintf(out, "{ int value; if(scanf(\"%%d\", &value) != 1) value = 0; RF[%d] = value; }", insi.r);
+        break;
+      case 11: // SIO halt
+        fprintf(out, "return 0;");
+        break;
+      case 12: // NEG
+        fprintf(out, "RF[%d] = -RF[%d];", insi.r, insi.l);
+        break;
+      case 16: // DIV
+      case 18: // MOD, illegal by zero and for INT_MIN / -1 like in the engines
+        fprintf(out, "if(RF[%d] == 0 || (RF[%d] == -1 && RF[%d] == INT_MIN)) goto illegal; ",
+                insi.m, insi.m, insi.l);
+        fprintf(out, "RF[%d] = RF[%d] %s RF[%d];", insi.r, insi.l, binaryOperators[insi.op - 13], insi.m);
+        break;
+      case 17: // ODD
+        fprintf(out, "RF[%d] = RF[%d] %% 2;", insi.r, insi.r);
+        break;
+      default:
+        if(insi.op >= 13 && insi.op <= 24)
+            fprintf(out, "RF[%d] = RF[%d] %s RF[%d];", insi.r, insi.l, binaryOperators[insi.op - 13], insi.m);
+        else
+            fprintf(out, "goto illegal;");
+    }
+
+    if(block)
+        fprintf(out, " }");
+}
+
+int translateToC(FILE* out, const PackedInstruction* ins, int numOfIns)
+{
+    int registers = sizeof(((VirtualMachine*)0)->RF) / sizeof(int);
+    int stackSize = sizeof(((VirtualMachine*)0)->stack) / sizeof(int);
+
+    // Verified programs stay inside the machine; the others are checked where
+    // .. the checked path of the engines would check them (see verify.h)
+    int checked = !verifyProgram(ins, numOfIns, NULL);
+
+    // Bit 1 marks jump targets, bit 2 the addresses RTN may return to
+    char* labeled = calloc(numOfIns + 1, 1);
+    if(!labeled)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+
+    fprintf(out, "/* Translated from %d virtual machine instructions%s. */\n\n", numOfIns,
+            checked ? ", with checks" : "");
+    fprintf(out, "#include <stdio.h>\n#include <limits.h>\n\n");
+
+    if(checked)
+    {
+        // Static link walk of checkedBasePointer(), which stops outside the stack
+        fprintf(out, "static inline int checkedBase(const int* stack, int bp, int L, int* base)\n{\n");
+        fprintf(out, "    while(L > 0 && bp >= 0 && bp + 1 < %d)\n    {\n", stackSize);
+        fprintf(out, "        bp = stack[bp + 1];\n        L--;\n    }\n");
+        fprintf(out, "    *base = bp;\n    return L == 0 && bp >= 0 && bp < %d;\n}\n\n", stackSize);
+    }
+    else
+    {
+        // Static link walk for LOD, STO and CAL with a nonzero level
+        fprintf(out, "static inline int base(const int* stack, int bp, int L)\n{\n");
+        fprintf(out, "    while(L > 0)\n    {\n        bp = stack[bp + 1];\n        L--;\n    }\n");
+        fprintf(out, "    return bp;\n}\n\n");
+    }
+
+    // Same initial state as initVM(): everything zero except BP
+    fprintf(out, "int main(void)\n{\n");
+    fprintf(out, "    static int stack[%d];\n", stackSize);
+    fprintf(out, "    int RF[%d] = { 0 };\n", registers);
+    fprintf(out, "    int bp = 1, sp = 0;\n");
+    fprintf(out, "    (void)stack; (void)bp; (void)sp;\n\n");
+
+    // Only jump targets and the addresses RTN returns to get a label. In a
+    // .. verified program RTN only returns past a CAL, since the links of the
+    // .. frames stay intact; the others may return to any instruction.
+    int i;
+    int returns = 0;
+    for(i = 0; i < numOfIns; i++)
+        returns |= packedOp(ins[i]) == 2;
+    for(i = 0; i < numOfIns; i++)
+    {
+        Instruction insi = unpackInstruction(ins[i]);
+        if((insi.op == 5 || insi.op == 7 || insi.op == 8) && instructionFieldsValid(insi, numOfIns))
+            labeled[insi.m] |= 1;
+        if(returns && (checked || (insi.op == 5 && i + 1 < numOfIns)))
+            labeled[checked ? i : i + 1] |= 2;
+    }
+    if(returns)
+        fprintf(out, "    int pc;\n\n");
+
+    for(i = 0; i < numOfIns; i++)
+    {
+        Instruction insi = unpackInstruction(ins[i]);
+        if(labeled[i])
+            fprintf(out, "L%d: ", i);
+        else
+            fprintf(out, "    ");
+        // Like the engines, an instruction naming a register or a jump
+        // .. target outside the machine is illegal (see instructionFieldsValid())
+        if(instructionFieldsValid(insi, numOfIns))
+            writeInstruction(out, insi, i, checked, stackSize);
+        else
+            fprintf(out, "goto illegal;");
+        fprintf(out, "\n");
+    }
+
+    // Running past the end fetches an empty instruction
+    fprintf(out, "    goto illegal;\n\n");
+
+    // RTN returns to the address saved on the stack; any other address is
+    // .. past the program or not one the program can return to
+    if(returns)
+    {
+        fprintf(out, "dispatch:\n    switch(pc)\n    {\n");
+        for(i = 0; i < numOfIns; i++)
+            if(labeled[i] & 2)
+                fprintf(out, "      case %d: goto L%d;\n", i, i);
+        fprintf(out, "      default: goto illegal;\n");
+        fprintf(out, "    }\n\n");
+    }
+    free(labeled);
+
+    fprintf(out, "illegal:\n    fflush(stdout);\n");
+    fprintf(out, "    fprintf(stderr, \"Illegal instruction?\");\n");
+    fprintf(out, "    return 0;\n}\n");
+
+    if(ferror(out))
+        return -1;
+    return checked;
+}
@@ -0,0 +1,28 @@
+#ifndef __AOT_H__
+#define __AOT_H__
+
+#include <stdio.h>
+#include "bytecode.h"
+
+/**
+ * Ahead-of-time translator from VM code to C.
+ *
+ * The program is written as a standalone C file with a main() function. Each
+ * instruction becomes the equivalent C on local RF and stack arrays; JMP, JPC
+ * and CAL become gotos to labeled instructions and RTN jumps through a switch
+ * over the addresses it can return to. Compiled with the system C compiler, the program
+ * reads stdin and writes stdout exactly like runVM() does.
+ *
+ * Only verified programs (see verify.h) are translated without checks. The
+ * others check the stack instructions like the checked path of the engines,
+ * so a program overflowing the stack halts as an illegal instruction there too.
+ * */
+
+/**
+ * Writes the instructions as a C program.
+ * Returns 0 if the program is verified and translated without checks, 1 if
+ * it is translated with checks, and -1 if the C file cannot be written.
+ * */
+int translateToC(FILE* out, const PackedInstruction* ins, int numOfIns);
+
+#endif
@@ -0,0 +1,160 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program writes and loads binary bytecode files for the virtual machine
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bytecode.h"
+
+int writeBytecode(FILE* out, const PackedInstruction* code, int numOfIns,
+                  const int32_t* constants, int numOfConstants,
+                  const void* debug, uint32_t debugSize)
+{
+    BytecodeHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = BYTECODE_MAGIC;
+    header.formatVersion = BYTECODE_FORMAT_VERSION;
+    header.isaVersion = BYTECODE_ISA_VERSION;
+    header.numOfIns = numOfIns;
+    header.numOfConstants = numOfConstants;
+    header.debugSize = debugSize;
+
+    if(fwrite(&header, sizeof(header), 1, out) != 1)
+        return -1;
+
+    if(numOfIns && fwrite(code, sizeof(PackedInstruction), numOfIns, out) != (size_t)numOfIns)
+        return -1;
+
+    if(numOfConstants && fwrite(constants, sizeof(int32_t), numOfConstants, out) != (size_t)numOfConstants)
+        return -1;
+
+    if(debugSize && fwrite(debug, 1, debugSize, out) != debugSize)
+        return -1;
+
+    return 0;
+}
+
+int isBytecode(FILE* in)
+{
+    int c = getc(in);
+    if(c == EOF)
+        return 0;
+    ungetc(c, in);
+    return c == (BYTECODE_MAGIC & 0xff);
+}
+
+// Read the rest of a stream that cannot be mapped into a heap buffer
+static void* readWholeStream(FILE* in, size_t* size)
+{
+    size_t capacity = 4096;
+    size_t used = 0;
+    unsigned char* buffer = malloc(capacity);
+    size_t n;
+
+    while(buffer && (n = fread(buffer + used, 1, capacity - used, in)) > 0)
+    {
+        used += n;
+        if(used == capacity)
+        {
+            unsigned char* bigger = realloc(buffer, capacity * 2);
+            if(!bigger)
+            {
+                free(buffer);
+                return NULL;
+            }
+            buffer = bigger;
+            capacity *= 2;
+        }
+    }
+
+    *size = used;
+    return buffer;
+}
+
+// Point the section pointers of the image into its bytes, checking that every
+// .. section fits in the file. Returns 0 on success.
+static int locateSections(BytecodeImage* image)
+{
+    const unsigned char* bytes = image->base;
+    const BytecodeHeader* header = image->base;
+
+    if(image->size < sizeof(BytecodeHeader) || header->magic != BYTECODE_MAGIC)
+    {
+        fprintf(stderr, "Not a bytecode file.\n");
+        return -1;
+    }
+    if(header->formatVersion != BYTECODE_FORMAT_VERSION || header->isaVersion != BYTECODE_ISA_VERSION)
+    {
+        fprintf(stderr, "Unsupported bytecode version %d (ISA %d).\n", header->formatVersion, header->isaVersion);
+        return -1;
+    }
+
+    size_t codeOffset = sizeof(BytecodeHeader);
+    size_t constOffset = codeOffset + (size_t)header->numOfIns * sizeof(PackedInstruction);
+    size_t debugOffset = constOffset + (size_t)header->numOfConstants * sizeof(int32_t);
+    if(header->numOfIns > PACKED_MAX_CODE_LENGTH || debugOffset + header->debugSize > image->size)
+    {
+        fprintf(stderr, "Bytecode file is truncated or too large.\n");
+        return -1;
+    }
+
+    image->header = header;
+    image->code = (const PackedInstruction*)(bytes + codeOffset);
+    image->constants = (const int32_t*)(bytes + constOffset);
+    image->debug = bytes + debugOffset;
+    return 0;
+}
+
+void* mapStream(FILE* in, size_t* size, int* mapped)
+{
+    // Map regular files, read anything else
+    struct stat st;
+    *mapped = 0;
+    if(fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+        if(base != MAP_FAILED)
+        {
+            *size = st.st_size;
+            *mapped = 1;
+            return base;
+        }
+    }
+    return readWholeStream(in, size);
+}
+
+void unmapStream(void* base, size_t size, int mapped)
+{
+    if(mapped)
+        munmap(base, size);
+    else
+        free(base);
+}
+
+BytecodeImage* openBytecode(FILE* in)
+{
+    BytecodeImage* image = calloc(1, sizeof(BytecodeImage));
+    if(!image)
+        return NULL;
+
+    image->base = mapStream(in, &image->size, &image->mapped);
+    if(!image->base || locateSections(image) != 0)
+    {
+        closeBytecode(image);
+        return NULL;
+    }
+    return image;
+}
+
+void closeBytecode(BytecodeImage* image)
+{
+    if(!image)
+        return;
+    unmapStream(image->base, image->size, image->mapped);
+    free(image);
+}
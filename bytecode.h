@@ -0,0 +1,171 @@
+#ifndef __BYTECODE_H__
+#define __BYTECODE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "data.h"
+
+/**
+ * Binary bytecode container.
+ *
+ * Layout of a bytecode file:
+ *   BytecodeHeader
+ *   numOfIns       x PackedInstruction
+ *   numOfConstants x int32_t   (optional constant section)
+ *   debugSize      bytes       (optional debug section)
+ *
+ * Every section starts at a multiple of 4 bytes, so a mapped file can be
+ * executed in place. Values are stored in the byte order of the machine
+ * that wrote the file.
+ * */
+
+// "VMBC" when read as little-endian bytes
+#define BYTECODE_MAGIC 0x43424d56
+
+// Version of the container layout above
+#define BYTECODE_FORMAT_VERSION 1
+
+// Version of the instruction encoding and opcode numbering
+#define BYTECODE_ISA_VERSION 2
+
+/**
+ * Packed instruction encoding.
+ *
+ * An instruction is held in one 32-bit word:
+ *   bits  0..4   op
+ *   bits  5..8   r
+ *   bits  9..12  l
+ *   bits 13..31  m, signed
+ *
+ * M covers every PL/0 number literal (at most 5 digits) and every code
+ * address, register index and stack offset the code generator produces.
+ * */
+typedef uint32_t PackedInstruction;
+
+#define PACKED_OP_BITS 5
+#define PACKED_R_BITS  4
+#define PACKED_L_BITS  4
+#define PACKED_M_BITS  19
+
+#define PACKED_R_SHIFT PACKED_OP_BITS
+#define PACKED_L_SHIFT (PACKED_R_SHIFT + PACKED_R_BITS)
+#define PACKED_M_SHIFT (PACKED_L_SHIFT + PACKED_L_BITS)
+
+#define PACKED_M_MIN (-(1 << (PACKED_M_BITS - 1)))
+#define PACKED_M_MAX ((1 << (PACKED_M_BITS - 1)) - 1)
+
+// Longest code whose every address fits M. Code memory grows up to this many
+// .. instructions; MAX_CODE_LENGTH is only the size it starts with.
+#define PACKED_MAX_CODE_LENGTH (PACKED_M_MAX + 1)
+
+// Returns 1 if the fields fit the packed encoding
+static inline int canPackInstruction(int op, int r, int l, int m)
+{
+    return op >= 0 && op < (1 << PACKED_OP_BITS) &&
+           r >= 0 && r < (1 << PACKED_R_BITS) &&
+           l >= 0 && l < (1 << PACKED_L_BITS) &&
+           m >= PACKED_M_MIN && m <= PACKED_M_MAX;
+}
+
+// Packs the fields, which must satisfy canPackInstruction()
+static inline PackedInstruction packInstruction(int op, int r, int l, int m)
+{
+    return (PackedInstruction)op |
+           (PackedInstruction)r << PACKED_R_SHIFT |
+           (PackedInstruction)l << PACKED_L_SHIFT |
+           (PackedInstruction)m << PACKED_M_SHIFT;
+}
+
+static inline int packedOp(PackedInstruction ins)
+{
+    return ins & ((1 << PACKED_OP_BITS) - 1);
+}
+
+static inline int packedR(PackedInstruction ins)
+{
+    return (ins >> PACKED_R_SHIFT) & ((1 << PACKED_R_BITS) - 1);
+}
+
+static inline int packedL(PackedInstruction ins)
+{
+    return (ins >> PACKED_L_SHIFT) & ((1 << PACKED_L_BITS) - 1);
+}
+
+// M is sign-extended by the arithmetic shift
+static inline int packedM(PackedInstruction ins)
+{
+    return (int32_t)ins >> PACKED_M_SHIFT;
+}
+
+static inline Instruction unpackInstruction(PackedInstruction ins)
+{
+    return (Instruction){ .op = packedOp(ins), .r = packedR(ins), .l = packedL(ins), .m = packedM(ins) };
+}
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t formatVersion;
+    uint16_t isaVersion;
+    uint32_t numOfIns;
+    uint32_t numOfConstants;
+    uint32_t debugSize;
+    uint32_t reserved;       // written as 0
+} BytecodeHeader;
+
+/**
+ * A loaded bytecode file. The pointers point into the mapped file, or into
+ * a heap copy when the file could not be mapped (pipes, for example).
+ * */
+typedef struct
+{
+    void* base;             // start of the mapping or the heap copy
+    size_t size;
+    int mapped;             // 1 if base was returned by mmap()
+    const BytecodeHeader* header;
+    const PackedInstruction* code;
+    const int32_t* constants;
+    const unsigned char* debug;
+} BytecodeImage;
+
+/**
+ * Writes the instructions and the optional sections as a bytecode file.
+ * constants and debug may be NULL when their sizes are 0.
+ * Returns 0 on success, -1 if writing failed.
+ * */
+int writeBytecode(FILE* out, const PackedInstruction* code, int numOfIns,
+                  const int32_t* constants, int numOfConstants,
+                  const void* debug, uint32_t debugSize);
+
+/**
+ * Returns 1 if the next byte of the stream starts a bytecode file, without
+ * consuming it. Text code files start with a digit or a space.
+ * */
+int isBytecode(FILE* in);
+
+/**
+ * Loads a bytecode file from the start of the stream. Regular files are
+ * mapped read-only; other streams are read into memory.
+ * Returns NULL and prints the reason on stderr if the file is not valid.
+ * */
+BytecodeImage* openBytecode(FILE* in);
+
+/**
+ * Unmaps or frees the image.
+ * */
+void closeBytecode(BytecodeImage*);
+
+/**
+ * Returns the bytes of the stream: the whole file, mapped read-only, if it is
+ * a regular file, otherwise the rest of the stream read into memory. Stores
+ * the number of bytes in size, and 1 in mapped if they are mapped.
+ * Returns NULL if the file cannot be read.
+ * */
+void* mapStream(FILE* in, size_t* size, int* mapped);
+
+/**
+ * Releases the bytes returned by mapStream().
+ * */
+void unmapStream(void* base, size_t size, int mapped);
+
+#endif
@@ -0,0 +1,499 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program translates virtual machine code into x86-64 machine code
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "jit.h"
+#include "vm_engine.h"
+#include "verify.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+/**
+ * Host register use inside the generated code:
+ *   rbx  &vm->RF[0]
+ *   r12  &vm->stack[0]
+ *   r13d BP
+ *   r14d SP
+ *   r15  JitContext*
+ *   eax, ecx, edx, esi, edi are scratch
+ * All pinned registers are callee-saved, so calls to the C helpers keep them.
+ * */
+
+// State shared between runJIT() and the generated code
+typedef struct
+{
+    int* RF;
+    int* stack;
+    void** table;   // machine code address of every instruction
+    InputSource* in;
+    OutputSink* out;
+    int bp;
+    int sp;
+    int pc;
+    int ir;
+} JitContext;
+
+struct JitProgram
+{
+    void (*entry)(JitContext*);
+    unsigned char* code;
+    size_t size;
+    void** table;
+    int numOfIns;
+};
+
+// Growable buffer the machine code is assembled into
+typedef struct
+{
+    unsigned char* bytes;
+    size_t used;
+    size_t capacity;
+    int failed;         // 1 once the buffer could not grow; later bytes are dropped
+} CodeBuffer;
+
+// A rel32 field to be filled with the address of an instruction
+typedef struct
+{
+    size_t at;
+    int target;
+} JumpPatch;
+
+static void emitByte(CodeBuffer* b, unsigned char value)
+{
+    if(b->failed)
+        return;
+    if(b->used == b->capacity)
+    {
+        size_t capacity = b->capacity ? b->capacity * 2 : 4096;
+        unsigned char* bytes = realloc(b->bytes, capacity);
+        if(!bytes)
+        {
+            b->failed = 1;
+            return;
+        }
+        b->bytes = bytes;
+        b->capacity = capacity;
+    }
+    b->bytes[b->used++] = value;
+}
+
+static void emitBytes(CodeBuffer* b, const char* bytes, int count)
+{
+    int i;
+    for(i = 0; i < count; i++)
+        emitByte(b, (unsigned char)bytes[i]);
+}
+
+static void emit32(CodeBuffer* b, int32_t value)
+{
+    int i;
+    for(i = 0; i < 4; i++)
+        emitByte(b, (unsigned char)((uint32_t)value >> (8 * i)));
+}
+
+static void emit64(CodeBuffer* b, uint64_t value)
+{
+    int i;
+    for(i = 0; i < 8; i++)
+        emitByte(b, (unsigned char)(value >> (8 * i)));
+}
+
+static void patch32(CodeBuffer* b, size_t at, int32_t value)
+{
+    int i;
+    for(i = 0; i < 4; i++)
+        b->bytes[at + i] = (unsigned char)((uint32_t)value >> (8 * i));
+}
+
+// Context field offsets, all small enough for an 8-bit displacement
+#define CTX(field) ((char)offsetof(JitContext, field))
+
+// Scratch register numbers used in ModRM reg fields
+enum { EAX = 0, ECX = 1, EDX = 2, ESI = 6 };
+
+// mov reg, [rbx + 4*index]
+static void loadRF(CodeBuffer* b, int reg, int index)
+{
+    emitByte(b, 0x8B);
+    emitByte(b, 0x83 | reg << 3);
+    emit32(b, 4 * index);
+}
+
+// mov [rbx + 4*index], reg
+static void storeRF(CodeBuffer* b, int reg, int index)
+{
+    emitByte(b, 0x89);
+    emitByte(b, 0x83 | reg << 3);
+    emit32(b, 4 * index);
+}
+
+// eax = base pointer L levels down the static chain
+static void emitBase(CodeBuffer* b, int L)
+{
+    emitBytes(b, "\x44\x89\xE8", 3);                 // mov eax, r13d
+    while(L-- > 0)
+        emitBytes(b, "\x41\x8B\x44\x84\x04", 5);     // mov eax, [r12 + rax*4 + 4]
+}
+
+// Jump to the instruction whose index is in eax, or to illegal if it is past the program
+static void emitIndirectJump(CodeBuffer* b, int numOfIns, JumpPatch* illegal)
+{
+    emitByte(b, 0x3D);                               // cmp eax, numOfIns
+    emit32(b, numOfIns);
+    emitBytes(b, "\x0F\x83", 2);                     // jae illegal
+    illegal->at = b->used;
+    illegal->target = 0;
+    emit32(b, 0);
+    emitBytes(b, "\x49\x8B\x4F", 3);                 // mov rcx, [r15 + table]
+    emitByte(b, CTX(table));
+    emitBytes(b, "\xFF\x24\xC1", 3);                 // jmp [rcx + rax*8]
+}
+
+// call helper(r15, esi)
+static void emitCall(CodeBuffer* b, void* helper)
+{
+    emitBytes(b, "\x4C\x89\xFF", 3);                 // mov rdi, r15
+    emitBytes(b, "\x48\xB8", 2);                     // mov rax, helper
+    emit64(b, (uint64_t)(uintptr_t)helper);
+    emitBytes(b, "\xFF\xD0", 2);                     // call rax
+}
+
+// SIO callbacks, printing and reading exactly like the interpreter
+static void jitWrite(JitContext* ctx, int value)
+{
+    writeOutputNumber(ctx->out,value);
+}
+
+static int jitRead(JitContext* ctx)
+{
+    int value;
+    if(inputMayWait(ctx->in))
+        flushOutputSink(ctx->out);
+    readInputNumber(ctx->in,&value);
+    return value;
+}
+
+static void jitIllegal(JitContext* ctx)
+{
+    flushOutputSink(ctx->out);
+    fprintf(stderr, "Illegal instruction?");
+}
+
+JitProgram* compileJIT(const PackedInstruction* ins, int numOfIns)
+{
+    // Every register and jump target must exist, as the verifier checks them
+    int i;
+    if(numOfIns <= 0)
+        return NULL;
+    for(i = 0; i < numOfIns; i++)
+        if(!instructionFieldsValid(unpackInstruction(ins[i]), numOfIns))
+            return NULL;
+
+    CodeBuffer b = { NULL, 0, 0, 0 };
+    size_t* offsets = malloc(numOfIns * sizeof(size_t));
+    JumpPatch* jumps = malloc(numOfIns * sizeof(JumpPatch));
+    JumpPatch* illegals = malloc((numOfIns + 2) * sizeof(JumpPatch));
+    int nJumps = 0;
+    int nIllegals = 0;
+    JitProgram* jit = NULL;
+    if(!offsets || !jumps || !illegals)
+        goto done;
+
+    // Prologue: save callee-saved registers, keeping the stack 16-byte aligned
+    emitBytes(&b, "\x53\x55\x41\x54\x41\x55\x41\x56\x41\x57", 10);
+    emitBytes(&b, "\x48\x83\xEC\x08", 4);            // sub rsp, 8
+    emitBytes(&b, "\x49\x89\xFF", 3);                // mov r15, rdi
+    emitBytes(&b, "\x49\x8B\x5F", 3);                // mov rbx, [r15 + RF]
+    emitByte(&b, CTX(RF));
+    emitBytes(&b, "\x4D\x8B\x67", 3);                // mov r12, [r15 + stack]
+    emitByte(&b, CTX(stack));
+    emitBytes(&b, "\x45\x8B\x6F", 3);                // mov r13d, [r15 + bp]
+    emitByte(&b, CTX(bp));
+    emitBytes(&b, "\x45\x8B\x77", 3);                // mov r14d, [r15 + sp]
+    emitByte(&b, CTX(sp));
+    emitBytes(&b, "\x41\x8B\x47", 3);                // mov eax, [r15 + pc]
+    emitByte(&b, CTX(pc));
+    emitIndirectJump(&b, numOfIns, &illegals[nIllegals++]);
+
+    for(i = 0; i < numOfIns; i++)
+    {
+        Instruction insi = unpackInstruction(ins[i]);
+        offsets[i] = b.used;
+
+        switch(insi.op)
+        {
+          case 1: // LIT
+            emitBytes(&b, "\xC7\x83", 2);            // mov dword [rbx + 4r], m
+            emit32(&b, 4 * insi.r);
+            emit32(&b, insi.m);
+            break;
+          case 2: // RTN
+            emitBytes(&b, "\x44\x89\xE8", 3);        // mov eax, r13d
+            emitBytes(&b, "\x45\x8D\x75\xFF", 4);    // lea r14d, [r13 - 1]
+            emitBytes(&b, "\x45\x8B\x6C\x84\x08", 5);// mov r13d, [r12 + rax*4 + 8]
+            emitBytes(&b, "\x41\x8B\x44\x84\x0C", 5);// mov eax, [r12 + rax*4 + 12]
+            emitIndirectJump(&b, numOfIns, &illegals[nIllegals++]);
+            break;
+          case 3: // LOD
+            emitBase(&b, insi.l);
+            emitBytes(&b, "\x41\x8B\x8C\x84", 4);    // mov ecx, [r12 + rax*4 + 4m]
+            emit32(&b, 4 * insi.m);
+            storeRF(&b, ECX, insi.r);
+            break;
+          case 4: // STO
+            emitBase(&b, insi.l);
+            emitBytes(&b, "\x41\xC7\x84\x84", 4);    // mov dword [r12 + rax*4 + 4m], r
+            emit32(&b, 4 * insi.m);
+            emit32(&b, insi.r);
+            break;
+          case 5: // CAL
+            emitBase(&b, insi.l);
+            emitBytes(&b, "\x89\xC1", 2);            // mov ecx, eax
+            emitBytes(&b, "\x44\x89\xF0", 3);        // mov eax, r14d
+            emitBytes(&b, "\x41\xC7\x44\x84\x04", 5);// mov dword [r12 + rax*4 + 4], 0
+            emit32(&b, 0);
+            emitBytes(&b, "\x41\x89\x4C\x84\x08", 5);// mov [r12 + rax*4 + 8], ecx
+            emitBytes(&b, "\x45\x89\x6C\x84\x0C", 5);// mov [r12 + rax*4 + 12], r13d
+            emitBytes(&b, "\x41\xC7\x44\x84\x10", 5);// mov dword [r12 + rax*4 + 16], i + 1
+            emit32(&b, i + 1);
+            emitBytes(&b, "\x45\x8D\x6E\x01", 4);    // lea r13d, [r14 + 1]
+            emitByte(&b, 0xE9);                      // jmp m
+            jumps[nJumps++] = (JumpPatch){ b.used, insi.m };
+            emit32(&b, 0);
+            break;
+          case 6: // INC
+            emitBytes(&b, "\x41\x81\xC6", 3);        // add r14d, m
+            emit32(&b, insi.m);
+            break;
+          case 7: // JMP
+            emitByte(&b, 0xE9);
+            jumps[nJumps++] = (JumpPatch){ b.used, insi.m };
+            emit32(&b, 0);
+            break;
+          case 8: // JPC
+            emitBytes(&b, "\x83\xBB", 2);            // cmp dword [rbx + 4r], 0
+            emit32(&b, 4 * insi.r);
+            emitByte(&b, 0x00);
+            emitBytes(&b, "\x0F\x84", 2);            // je m
+            jumps[nJumps++] = (JumpPatch){ b.used, insi.m };
+            emit32(&b, 0);
+            break;
+          case 9: // SIO write
+            emitBytes(&b, "\x8B\xB3", 2);            // mov esi, [rbx + 4r]
+            emit32(&b, 4 * insi.r);
+            emitCall(&b, (void*)jitWrite);
+            break;
+          case 10: // SIO read
+            emitCall(&b, (void*)jitRead);
+            storeRF(&b, EAX, insi.r);
+            break;
+          case 11: // SIO halt
+            emitByte(&b, 0xB8);                      // mov eax, i
+            emit32(&b, i);
+            emitByte(&b, 0xE9);                      // jmp exit
+            illegals[nIllegals++] = (JumpPatch){ b.used, -1 };
+            emit32(&b, 0);
+            break;
+          case 12: // NEG
+            loadRF(&b, EAX, insi.l);
+            emitBytes(&b, "\xF7\xD8", 2);            // neg eax
+            storeRF(&b, EAX, insi.r);
+            break;
+          case 13: // ADD
+          case 14: // SUB
+          case 15: // MUL
+            loadRF(&b, EAX, insi.l);
+            if(insi.op == 13)
+                emitBytes(&b, "\x03\x83", 2);        // add eax, [rbx + 4m]
+            else if(insi.op == 14)
+                emitBytes(&b, "\x2B\x83", 2);        // sub eax, [rbx + 4m]
+            else
+                emitBytes(&b, "\x0F\xAF\x83", 3);    // imul eax, [rbx + 4m]
+            emit32(&b, 4 * insi.m);
+            storeRF(&b, EAX, insi.r);
+            break;
+          case 16: // DIV
+          case 18: // MOD, illegal where divisionDefined() does not hold
+          {
+            loadRF(&b, ECX, insi.m);
+            emitBytes(&b, "\x85\xC9", 2);            // test ecx, ecx
+            emitBytes(&b, "\x74\x11", 2);            // jz illegal below
+            emitBytes(&b, "\x83\xF9\xFF", 3);        // cmp ecx, -1
+            emitBytes(&b, "\x75\x16", 2);            // jne divide
+            emitBytes(&b, "\x81\xBB", 2);            // cmp dword [rbx + 4l], INT_MIN
+            emit32(&b, 4 * insi.l);
+            emit32(&b, INT32_MIN);
+            emitBytes(&b, "\x75\x0A", 2);            // jne divide
+            emitByte(&b, 0xB8);                      // illegal: mov eax, i
+            emit32(&b, i);
+            emitByte(&b, 0xE9);                      // jmp illegal
+            illegals[nIllegals++] = (JumpPatch){ b.used, 0 };
+            emit32(&b, 0);
+            loadRF(&b, EAX, insi.l);                 // divide:
+            emitByte(&b, 0x99);                      // cdq
+            emitBytes(&b, "\xF7\xF9", 2);            // idiv ecx
+            storeRF(&b, insi.op == 16 ? EAX : EDX, insi.r);
+            break;
+          }
+          case 17: // ODD
+            loadRF(&b, EAX, insi.r);
+            emitByte(&b, 0xB9);                      // mov ecx, 2
+            emit32(&b, 2);
+            emitByte(&b, 0x99);                      // cdq
+            emitBytes(&b, "\xF7\xF9", 2);            // idiv ecx
+            storeRF(&b, EDX, insi.r);
+            break;
+          case 19: case 20: case 21: case 22: case 23: case 24: // EQL .. GEQ
+          {
+            // sete, setne, setl, setle, setg, setge
+            static const unsigned char setcc[] = { 0x94, 0x95, 0x9C, 0x9E, 0x9F, 0x9D };
+            loadRF(&b, EAX, insi.l);
+            emitBytes(&b, "\x3B\x83", 2);            // cmp eax, [rbx + 4m]
+            emit32(&b, 4 * insi.m);
+            emitByte(&b, 0x0F);                      // setcc al
+            emitByte(&b, setcc[insi.op - 19]);
+            emitByte(&b, 0xC0);
+            emitBytes(&b, "\x0F\xB6\xC0", 3);        // movzx eax, al
+            storeRF(&b, EAX, insi.r);
+            break;
+          }
+          default: // illegal opcode
+            emitByte(&b, 0xB8);                      // mov eax, i
+            emit32(&b, i);
+            emitByte(&b, 0xE9);                      // jmp illegal
+            illegals[nIllegals++] = (JumpPatch){ b.used, 0 };
+            emit32(&b, 0);
+            break;
+        }
+    }
+
+    // Falling off the end of the program fetches an illegal instruction
+    emitByte(&b, 0xB8);                              // mov eax, numOfIns
+    emit32(&b, numOfIns);
+
+    // Illegal instruction at index eax: report it, then exit like HALT
+    size_t illegalAt = b.used;
+    emitBytes(&b, "\x41\x89\x47", 3);                // mov [r15 + ir], eax
+    emitByte(&b, CTX(ir));
+    emitCall(&b, (void*)jitIllegal);
+    emitBytes(&b, "\x41\x8B\x47", 3);                // mov eax, [r15 + ir]
+    emitByte(&b, CTX(ir));
+
+    // Exit with the index of the last instruction in eax
+    size_t exitAt = b.used;
+    emitBytes(&b, "\x41\x89\x47", 3);                // mov [r15 + ir], eax
+    emitByte(&b, CTX(ir));
+    emitBytes(&b, "\x45\x89\x6F", 3);                // mov [r15 + bp], r13d
+    emitByte(&b, CTX(bp));
+    emitBytes(&b, "\x45\x89\x77", 3);                // mov [r15 + sp], r14d
+    emitByte(&b, CTX(sp));
+    emitBytes(&b, "\x48\x83\xC4\x08", 4);            // add rsp, 8
+    emitBytes(&b, "\x41\x5F\x41\x5E\x41\x5D\x41\x5C\x5D\x5B\xC3", 11);
+
+    if(b.failed)
+        goto done;
+
+    // Resolve the jumps; rel32 is relative to the end of the field
+    int k;
+    for(k = 0; k < nJumps; k++)
+        patch32(&b, jumps[k].at, (int32_t)(offsets[jumps[k].target] - (jumps[k].at + 4)));
+    for(k = 0; k < nIllegals; k++)
+    {
+        size_t to = illegals[k].target < 0 ? exitAt : illegalAt;
+        patch32(&b, illegals[k].at, (int32_t)(to - (illegals[k].at + 4)));
+    }
+
+    // Copy into an executable mapping. Hosts that refuse to make it executable
+    // .. (W^X policies) get NULL, and the run falls back to the interpreter.
+    jit = calloc(1, sizeof(JitProgram));
+    if(!jit)
+        goto done;
+    jit->size = b.used;
+    jit->code = mmap(NULL, b.used, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    jit->table = malloc(numOfIns * sizeof(void*));
+    if(jit->code == MAP_FAILED || !jit->table)
+    {
+        if(jit->code != MAP_FAILED)
+            munmap(jit->code, jit->size);
+        free(jit->table);
+        free(jit);
+        jit = NULL;
+        goto done;
+    }
+    memcpy(jit->code, b.bytes, b.used);
+    if(mprotect(jit->code, b.used, PROT_READ | PROT_EXEC) != 0)
+    {
+        freeJIT(jit);
+        jit = NULL;
+        goto done;
+    }
+    jit->entry = (void (*)(JitContext*))(void*)jit->code;
+    jit->numOfIns = numOfIns;
+    for(i = 0; i < numOfIns; i++)
+        jit->table[i] = jit->code + offsets[i];
+
+done:
+    free(b.bytes);
+    free(offsets);
+    free(jumps);
+    free(illegals);
+    return jit;
+}
+
+int runJIT(const JitProgram* jit, VirtualMachine* vm, InputSource* vmIn, OutputSink* vmOut)
+{
+    JitContext ctx;
+    ctx.RF = vm->RF;
+    ctx.stack = vm->stack;
+    ctx.table = jit->table;
+    ctx.in = vmIn;
+    ctx.out = vmOut;
+    ctx.bp = vm->BP;
+    ctx.sp = vm->SP;
+    ctx.pc = vm->PC;
+    ctx.ir = vm->IR;
+
+    jit->entry(&ctx);
+
+    vm->IR = ctx.ir;
+    vm->PC = ctx.ir + 1;
+    vm->BP = ctx.bp;
+    vm->SP = ctx.sp;
+    return HALT;
+}
+
+void freeJIT(JitProgram* jit)
+{
+    if(!jit)
+        return;
+    munmap(jit->code, jit->size);
+    free(jit->table);
+    free(jit);
+}
+
+#else
+
+JitProgram* compileJIT(const PackedInstruction* ins, int numOfIns)
+{
+    return NULL;
+}
+
+int runJIT(const JitProgram* jit, VirtualMachine* vm, InputSource* vmIn, OutputSink* vmOut)
+{
+    return HALT;
+}
+
+void freeJIT(JitProgram* jit)
+{
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include <stdio.h>
+#include "vm.h"
+#include "bytecode.h"
+#include "vm_output.h"
+#include "vm_input.h"
+
+/**
+ * x86-64 JIT compiler for the virtual machine.
+ *
+ * The whole code memory is translated once into machine code in an
+ * executable mapping. RF and the stack stay in the VirtualMachine, addressed
+ * through pinned host registers; BP and SP live in host registers while
+ * running. SIO instructions call back into C and use the same input and
+ * output channels as the interpreter (see vm_input.h and vm_output.h).
+ *
+ * Only available on x86-64 Linux. Elsewhere, and for programs the compiler
+ * does not handle, compileJIT() returns NULL and the caller runs the
+ * interpreter instead.
+ * */
+
+typedef struct JitProgram JitProgram;
+
+/**
+ * Translates the instructions into machine code.
+ * Returns NULL if the program or the host is not supported.
+ * */
+JitProgram* compileJIT(const PackedInstruction* ins, int numOfIns);
+
+/**
+ * Runs the compiled program on the virtual machine from its current PC until
+ * it halts, leaving IR, PC, BP and SP as the interpreter would.
+ * Returns HALT.
+ * */
+int runJIT(const JitProgram*, VirtualMachine* vm, InputSource* vmIn, OutputSink* vmOut);
+
+/**
+ * Releases the machine code.
+ * */
+void freeJIT(JitProgram*);
+
+#endif
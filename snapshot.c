@@ -0,0 +1,143 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program saves and restores the state of the virtual machine
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "snapshot.h"
+#include "vm_engine.h"
+
+int writeSnapshot(FILE* out, const VirtualMachine* vm, const PackedInstruction* code, int numOfIns,
+                  uint64_t inputOffset, const void* output, uint32_t outputSize)
+{
+    // Cells above the highest non-zero one are restored as 0 anyway
+    int stackCells = VM_STACK_CELLS;
+    while(stackCells > 0 && vm->stack[stackCells - 1] == 0)
+        stackCells--;
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SNAPSHOT_MAGIC;
+    header.formatVersion = SNAPSHOT_FORMAT_VERSION;
+    header.isaVersion = BYTECODE_ISA_VERSION;
+    header.numOfIns = numOfIns;
+    header.numOfRegisters = VM_REGISTERS;
+    header.stackCells = stackCells;
+    header.outputSize = outputSize;
+    header.pc = vm->PC;
+    header.bp = vm->BP;
+    header.sp = vm->SP;
+    header.ir = vm->IR;
+    header.inputOffset = inputOffset;
+
+    if(fwrite(&header, sizeof(header), 1, out) != 1)
+        return -1;
+
+    if(numOfIns && fwrite(code, sizeof(PackedInstruction), numOfIns, out) != (size_t)numOfIns)
+        return -1;
+
+    if(fwrite(vm->RF, sizeof(int32_t), VM_REGISTERS, out) != VM_REGISTERS)
+        return -1;
+
+    if(stackCells && fwrite(vm->stack, sizeof(int32_t), stackCells, out) != (size_t)stackCells)
+        return -1;
+
+    if(outputSize && fwrite(output, 1, outputSize, out) != outputSize)
+        return -1;
+
+    return 0;
+}
+
+int isSnapshot(FILE* in)
+{
+    int c = getc(in);
+    if(c == EOF)
+        return 0;
+    ungetc(c, in);
+    return c == (SNAPSHOT_MAGIC & 0xff);
+}
+
+// Point the section pointers of the image into its bytes, checking that every
+// .. section fits in the file and in the machine. Returns 0 on success.
+static int locateSections(SnapshotImage* image)
+{
+    const unsigned char* bytes = image->base;
+    const SnapshotHeader* header = image->base;
+
+    if(image->size < sizeof(SnapshotHeader) || header->magic != SNAPSHOT_MAGIC)
+    {
+        fprintf(stderr, "Not a snapshot file.\n");
+        return -1;
+    }
+    if(header->formatVersion != SNAPSHOT_FORMAT_VERSION || header->isaVersion != BYTECODE_ISA_VERSION)
+    {
+        fprintf(stderr, "Unsupported snapshot version %d (ISA %d).\n", header->formatVersion, header->isaVersion);
+        return -1;
+    }
+
+    size_t codeOffset = sizeof(SnapshotHeader);
+    size_t registersOffset = codeOffset + (size_t)header->numOfIns * sizeof(PackedInstruction);
+    size_t stackOffset = registersOffset + (size_t)header->numOfRegisters * sizeof(int32_t);
+    size_t outputOffset = stackOffset + (size_t)header->stackCells * sizeof(int32_t);
+    if(header->numOfIns > PACKED_MAX_CODE_LENGTH || outputOffset + header->outputSize > image->size)
+    {
+        fprintf(stderr, "Snapshot file is truncated or too large.\n");
+        return -1;
+    }
+
+    // The engines index code memory with PC and IR, and the stack with SP and BP
+    if(header->numOfRegisters != VM_REGISTERS || header->stackCells > VM_STACK_CELLS ||
+       header->pc < 0 || header->pc > (int32_t)header->numOfIns ||
+       header->ir < 0 || header->ir > (int32_t)header->numOfIns ||
+       header->bp < 0 || header->bp >= (int32_t)VM_STACK_CELLS ||
+       header->sp < -1 || header->sp >= (int32_t)VM_STACK_CELLS)
+    {
+        fprintf(stderr, "Snapshot was taken on a different machine.\n");
+        return -1;
+    }
+
+    image->header = header;
+    image->code = (const PackedInstruction*)(bytes + codeOffset);
+    image->registers = (const int32_t*)(bytes + registersOffset);
+    image->stack = (const int32_t*)(bytes + stackOffset);
+    image->output = (const char*)(bytes + outputOffset);
+    return 0;
+}
+
+SnapshotImage* openSnapshot(FILE* in)
+{
+    SnapshotImage* image = calloc(1, sizeof(SnapshotImage));
+    if(!image)
+        return NULL;
+
+    image->base = mapStream(in, &image->size, &image->mapped);
+    if(!image->base || locateSections(image) != 0)
+    {
+        closeSnapshot(image);
+        return NULL;
+    }
+    return image;
+}
+
+void restoreSnapshot(const SnapshotImage* image, VirtualMachine* vm)
+{
+    const SnapshotHeader* header = image->header;
+    memcpy(vm->RF, image->registers, VM_REGISTERS * sizeof(int32_t));
+    memcpy(vm->stack, image->stack, header->stackCells * sizeof(int32_t));
+    memset(vm->stack + header->stackCells, 0, (VM_STACK_CELLS - header->stackCells) * sizeof(int32_t));
+    vm->PC = header->pc;
+    vm->BP = header->bp;
+    vm->SP = header->sp;
+    vm->IR = header->ir;
+}
+
+void closeSnapshot(SnapshotImage* image)
+{
+    if(!image)
+        return;
+    unmapStream(image->base, image->size, image->mapped);
+    free(image);
+}
@@ -0,0 +1,99 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "vm.h"
+#include "bytecode.h"
+
+/**
+ * Snapshot of a virtual machine, from which a run continues later.
+ *
+ * Layout of a snapshot file:
+ *   SnapshotHeader
+ *   numOfIns       x PackedInstruction
+ *   numOfRegisters x int32_t   (RF)
+ *   stackCells     x int32_t   (stack[0 .. stackCells - 1], the cells above are 0)
+ *   outputSize     bytes       (SIO output written before the snapshot)
+ *
+ * Like bytecode files (see bytecode.h), every section starts at a multiple of
+ * 4 bytes, values are stored in the byte order of the machine that wrote the
+ * file, and loading maps the file, so the code runs in place and only the
+ * stack in use is copied into the machine.
+ * checkpointVM() takes a snapshot just before the first SIO read; runVM() and
+ * simulateVM() resume from a snapshot given instead of a code file. A resumed
+ * run is given the whole SIO input and skips the inputOffset bytes read
+ * before the snapshot (see startMachine()).
+ * */
+
+// "SNAP" when read as little-endian bytes
+#define SNAPSHOT_MAGIC 0x50414e53
+
+// Version of the snapshot layout above
+#define SNAPSHOT_FORMAT_VERSION 1
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t formatVersion;
+    uint16_t isaVersion;        // BYTECODE_ISA_VERSION of the code
+    uint32_t numOfIns;
+    uint32_t numOfRegisters;
+    uint32_t stackCells;
+    uint32_t outputSize;
+    int32_t pc;
+    int32_t bp;
+    int32_t sp;
+    int32_t ir;
+    uint64_t inputOffset;       // bytes of SIO input read before the snapshot
+} SnapshotHeader;
+
+/**
+ * A loaded snapshot. The pointers point into the mapped file, or into a heap
+ * copy when the file could not be mapped.
+ * */
+typedef struct
+{
+    void* base;
+    size_t size;
+    int mapped;
+    const SnapshotHeader* header;
+    const PackedInstruction* code;
+    const int32_t* registers;
+    const int32_t* stack;
+    const char* output;
+} SnapshotImage;
+
+/**
+ * Writes the state of the machine running the code as a snapshot, with the
+ * SIO input position and the SIO output written so far. output may be NULL
+ * when outputSize is 0. Only the stack up to its highest non-zero cell is
+ * written.
+ * Returns 0 on success, -1 if writing failed.
+ * */
+int writeSnapshot(FILE* out, const VirtualMachine* vm, const PackedInstruction* code, int numOfIns,
+                  uint64_t inputOffset, const void* output, uint32_t outputSize);
+
+/**
+ * Returns 1 if the next byte of the stream starts a snapshot file, without
+ * consuming it.
+ * */
+int isSnapshot(FILE* in);
+
+/**
+ * Loads a snapshot file from the start of the stream.
+ * Returns NULL and prints the reason on stderr if the file is not valid.
+ * */
+SnapshotImage* openSnapshot(FILE* in);
+
+/**
+ * Puts the machine into the state saved in the snapshot.
+ * */
+void restoreSnapshot(const SnapshotImage* image, VirtualMachine* vm);
+
+/**
+ * Unmaps or frees the snapshot.
+ * */
+void closeSnapshot(SnapshotImage*);
+
+#endif
@@ -0,0 +1,95 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program renders a binary execution trace as the ***Execution*** text
+* .. printed by simulateVM()
+*
+* Usage: trace_render <trace file> [first step] [step count]
+* Build: link with vm.c, vm_trace.c, vm_output.c, vm_input.c, bytecode.c, jit.c,
+*        verify.c, snapshot.c and vm_perf.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "vm_trace.h"
+
+int main(int argc, char** argv)
+{
+    if(argc < 2 || argc > 4)
+    {
+        fprintf(stderr, "Usage: %s <trace file> [first step] [step count]\n", argv[0]);
+        return 1;
+    }
+
+    FILE* in = fopen(argv[1], "rb");
+    if(!in)
+    {
+        fprintf(stderr, "Cannot open %s.\n", argv[1]);
+        return 1;
+    }
+    if(readTraceHeader(in) != 0)
+    {
+        fprintf(stderr, "%s is not a version %d trace file.\n", argv[1], TRACE_VERSION);
+        fclose(in);
+        return 1;
+    }
+
+    // Rows outside [first, first + count) are replayed but not printed
+    long first = argc > 2 ? atol(argv[2]) : 0;
+    long count = argc > 3 ? atol(argv[3]) : -1;
+    int fullTrace = argc == 2;
+
+    // The machine is rebuilt from the records, BP starts at 1 like initVM()
+    VirtualMachine* vm = calloc(1, sizeof(VirtualMachine));
+    vm->BP = 1;
+    int stackSize = sizeof(vm->stack) / sizeof(vm->stack[0]);
+
+    // Rows are printed for consecutive steps, so the stack column is kept
+    // .. from one row to the next; the first row renders all of it
+    StackView* view = openStackView();
+
+    if(fullTrace)
+        dumpExecutionHeader(stdout);
+
+    TraceRecord record;
+    TraceDelta deltas[TRACE_MAX_DELTAS];
+    long step;
+    int status = 0;
+    for(step = 0; count < 0 || step < first + count; step++)
+    {
+        int read = readTraceStep(in, &record, deltas);
+        if(read == 0)
+            break;
+        if(read < 0)
+        {
+            fprintf(stderr, "Trace is corrupt at step %ld.\n", step);
+            status = 1;
+            break;
+        }
+
+        int i;
+        for(i = 0; i < record.nDeltas; i++)
+        {
+            if(deltas[i].index >= 0 && deltas[i].index < stackSize)
+                vm->stack[deltas[i].index] = deltas[i].value;
+        }
+        vm->IR = record.ir;
+        vm->PC = record.pc;
+        vm->BP = record.bp;
+        vm->SP = record.sp;
+
+        if(step >= first)
+        {
+            Instruction insi = { .op = record.op, .r = record.r, .l = record.l, .m = record.m };
+            traceStep(stdout, view, vm, insi);
+        }
+    }
+
+    if(fullTrace && status == 0)
+        printf("HLT\n");
+
+    closeStackView(view);
+    free(vm);
+    fclose(in);
+    return status;
+}
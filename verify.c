@@ -0,0 +1,435 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program checks that virtual machine code can run without checks
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "verify.h"
+#include "vm_engine.h"
+
+// Cells at the bottom of a procedure frame written by CAL: return value,
+// .. static link, dynamic link and return address
+#define FRAME_LINKS 4
+
+typedef struct
+{
+    const PackedInstruction* ins;
+    int numOfIns;
+    int* owner;         // procedure each instruction belongs to, -1 if not reached
+    int* offset;        // frame cells in use when the instruction runs
+    int* procedureAt;   // procedure entered at each address, -1 if none
+    int* worklist;
+    int* state;         // of the stack need of each procedure: 0 new, 1 open, 2 done
+    VerifyReport* report;
+} Verifier;
+
+// Record why the proof failed, unless it already failed. Returns 0.
+static int reject(Verifier* v, int pc, const char* error)
+{
+    if(v->report->verified)
+    {
+        v->report->verified = 0;
+        v->report->errorPC = pc;
+        v->report->error = error;
+    }
+    return 0;
+}
+
+// Cells of the frame of procedure p. The main block has no links: its frame
+// .. is the cells above BP 1 that its INCs reserve.
+static int frameCells(const Verifier* v, int p)
+{
+    int frame = v->report->procedures[p].frame;
+    return p == 0 || frame >= FRAME_LINKS ? frame : FRAME_LINKS;
+}
+
+// Procedure whose frame is L links down the static chain of procedure p
+static int ancestor(const Verifier* v, int p, int L)
+{
+    while(L-- > 0)
+        p = v->report->procedures[p].parent;
+    return p;
+}
+
+// Mark the instruction at pc as reached by procedure p with the frame size
+// .. off, and queue it. Returns 0 if it was reached differently before.
+static int reach(Verifier* v, int p, int pc, int off, int* queued)
+{
+    // Fetching past the program halts the machine
+    if(pc >= v->numOfIns)
+        return 1;
+    if(v->owner[pc] < 0)
+    {
+        v->owner[pc] = p;
+        v->offset[pc] = off;
+        v->worklist[(*queued)++] = pc;
+        return 1;
+    }
+    if(v->owner[pc] != p)
+        return reject(v, pc, "instruction shared by two procedures");
+    if(v->offset[pc] != off)
+        return reject(v, pc, "instruction reached with different frame sizes");
+    return 1;
+}
+
+// Find the procedure entered by a CAL at pc from procedure p, adding it if new.
+// Returns 0 if its lexical level does not agree with the other CALs to it.
+static int callProcedure(Verifier* v, int p, int pc, Instruction insi)
+{
+    VerifyReport* report = v->report;
+    int depth = report->procedures[p].depth;
+    if(insi.m == 0)
+        return reject(v, pc, "CAL to the main block");
+    if(insi.l > depth)
+        return reject(v, pc, "CAL level beyond the main block");
+
+    int parent = ancestor(v, p, insi.l);
+    int q = v->procedureAt[insi.m];
+    if(q < 0)
+    {
+        q = report->numOfProcedures++;
+        v->procedureAt[insi.m] = q;
+        report->procedures[q] = (ProcedureInfo){ insi.m, depth - insi.l + 1, parent, 0, -1 };
+    }
+    else if(report->procedures[q].parent != parent)
+    {
+        return reject(v, pc, "procedure called from different lexical levels");
+    }
+    return 1;
+}
+
+// Follow every path of procedure p from its entry, assigning its instructions
+// .. and their frame sizes, and discovering the procedures it calls
+static int scanProcedure(Verifier* v, int p)
+{
+    VerifyReport* report = v->report;
+    int entry = report->procedures[p].entry;
+    if(v->owner[entry] >= 0)
+        return reject(v, entry, "procedure entered by a jump");
+
+    int queued = 0;
+    reach(v, p, entry, 0, &queued);
+    while(queued > 0)
+    {
+        int pc = v->worklist[--queued];
+        int off = v->offset[pc];
+        Instruction insi = unpackInstruction(v->ins[pc]);
+        if(!instructionFieldsValid(insi, v->numOfIns))
+            return reject(v, pc, "register or code address out of range");
+
+        int ok = 1;
+        switch(insi.op)
+        {
+            case 2: // RTN
+                if(p == 0)
+                    return reject(v, pc, "RTN from the main block");
+                break;
+            case 3: // LOD
+            case 4: // STO
+                if(insi.l > report->procedures[p].depth)
+                    return reject(v, pc, "level beyond the main block");
+                ok = reach(v, p, pc + 1, off, &queued);
+                break;
+            case 5: // CAL
+                ok = callProcedure(v, p, pc, insi) && reach(v, p, pc + 1, off, &queued);
+                break;
+            case 6: // INC
+                if(off + insi.m < 0)
+                    return reject(v, pc, "INC below the frame");
+                if(off + insi.m >= (int)VM_STACK_CELLS)
+                    return reject(v, pc, "frame larger than the stack");
+                if(off + insi.m > report->procedures[p].frame)
+                    report->procedures[p].frame = off + insi.m;
+                ok = reach(v, p, pc + 1, off + insi.m, &queued);
+                break;
+            case 7: // JMP
+                ok = reach(v, p, insi.m, off, &queued);
+                break;
+            case 8: // JPC
+                ok = reach(v, p, insi.m, off, &queued) && reach(v, p, pc + 1, off, &queued);
+                break;
+            case 11: // SIO halt
+                break;
+            default:
+                // Illegal opcodes halt the machine
+                if(insi.op >= 1 && insi.op <= 24)
+                    ok = reach(v, p, pc + 1, off, &queued);
+                break;
+        }
+        if(!ok)
+            return 0;
+    }
+    return 1;
+}
+
+// Check the stack cells addressed by every instruction reached, now that the
+// .. frame size of every procedure is known
+static int checkFrames(Verifier* v)
+{
+    int pc;
+    for(pc = 0; pc < v->numOfIns; pc++)
+    {
+        int p = v->owner[pc];
+        if(p < 0)
+            continue;
+        Instruction insi = unpackInstruction(v->ins[pc]);
+        if(insi.op == 3 || insi.op == 4)
+        {
+            int target = ancestor(v, p, insi.l);
+            if(insi.m < 0 || insi.m >= frameCells(v, target))
+                return reject(v, pc, insi.op == 3 ? "LOD outside the frame" : "STO outside the frame");
+            if(insi.op == 4 && target != 0 && insi.m >= 1 && insi.m < FRAME_LINKS)
+                return reject(v, pc, "STO overwrites a frame link");
+        }
+        else if(insi.op == 5)
+        {
+            // The callee's frame starts above the caller's, which must not
+            // .. grow after the call
+            if(v->offset[pc] != v->report->procedures[p].frame)
+                return reject(v, pc, "CAL before the frame is complete");
+            if(p != 0 && v->offset[pc] < FRAME_LINKS)
+                return reject(v, pc, "CAL overwrites the links of the caller");
+        }
+    }
+    return 1;
+}
+
+// Returns the stack cells used by procedure p and the deepest chain of calls it
+// .. makes, or -1 if the chain is recursive
+static int stackNeed(Verifier* v, int p)
+{
+    ProcedureInfo* procedure = &v->report->procedures[p];
+    if(v->state[p] == 2)
+        return procedure->stackNeed;
+    if(v->state[p] == 1)
+        return -1;
+    v->state[p] = 1;
+
+    int need = frameCells(v, p);
+    int pc;
+    for(pc = 0; pc < v->numOfIns; pc++)
+    {
+        if(v->owner[pc] != p || packedOp(v->ins[pc]) != 5)
+            continue;
+        int callee = stackNeed(v, v->procedureAt[packedM(v->ins[pc])]);
+        if(callee < 0)
+        {
+            if(need >= 0)
+                reject(v, pc, "recursive calls");
+            need = -1;
+        }
+        else if(need >= 0 && v->offset[pc] + callee > need)
+        {
+            need = v->offset[pc] + callee;
+        }
+    }
+
+    v->state[p] = 2;
+    procedure->stackNeed = need;
+    return need;
+}
+
+// Allocate the tables of the proof of the program into v, and the procedures
+// .. of the report, which has one at every entry address at most.
+// Returns 0 if they cannot be allocated.
+static int openVerifier(Verifier* v, const PackedInstruction* ins, int numOfIns, VerifyReport* report)
+{
+    int size = numOfIns > 0 ? numOfIns : 1;
+    *v = (Verifier){ ins, numOfIns,
+                     malloc(size * sizeof(int)), malloc(size * sizeof(int)), malloc(size * sizeof(int)),
+                     malloc(size * sizeof(int)), calloc(size, sizeof(int)), report };
+    report->procedures = malloc(size * sizeof(ProcedureInfo));
+    return v->owner && v->offset && v->procedureAt && v->worklist && v->state && report->procedures;
+}
+
+static void closeVerifier(Verifier* v)
+{
+    free(v->owner);
+    free(v->offset);
+    free(v->procedureAt);
+    free(v->worklist);
+    free(v->state);
+}
+
+// Run the proof. Returns 1 if the program is verified.
+static int prove(Verifier* v)
+{
+    VerifyReport* report = v->report;
+    report->verified = 1;
+    report->guarded = 0;
+    report->errorPC = -1;
+    report->error = NULL;
+    report->numOfProcedures = 0;
+
+    int i;
+    for(i = 0; i < v->numOfIns; i++)
+    {
+        v->owner[i] = -1;
+        v->procedureAt[i] = -1;
+    }
+    if(v->numOfIns == 0)
+    {
+        report->guarded = 1;
+        return 1;
+    }
+
+    // The main block runs at level 0 with BP 1
+    report->numOfProcedures = 1;
+    report->procedures[0] = (ProcedureInfo){ 0, 0, -1, 0, -1 };
+    v->procedureAt[0] = 0;
+
+    int ok = 1;
+    int p;
+    for(p = 0; ok && p < report->numOfProcedures; p++)
+        ok = scanProcedure(v, p);
+    if(ok && checkFrames(v))
+    {
+        report->guarded = report->verified;
+
+        // The highest cell used is BP 1 plus the cells the main block needs, less one
+        int need = stackNeed(v, 0);
+        if(need >= (int)VM_STACK_CELLS)
+            reject(v, -1, "deepest calls overflow the stack");
+    }
+    return report->verified;
+}
+
+// Returns 1 if the machine is in a state the verified program reaches from
+// .. the start: the frames on the stack, from BP down the dynamic links, are
+// .. activations of the procedures of the proof, each called by a CAL of the
+// .. frame below it, with the frame sizes and static links of the proof.
+static int stateReachable(Verifier* v, const VirtualMachine* vm)
+{
+    const int cells = VM_STACK_CELLS;
+    const VerifyReport* report = v->report;
+    const int* stack = vm->stack;
+
+    // Base pointer of the activation of each procedure; verified programs are
+    // .. not recursive, so there is at most one
+    int* frameOf = v->worklist;
+    int p;
+    for(p = 0; p < report->numOfProcedures; p++)
+        frameOf[p] = -1;
+
+    int pc = vm->PC;
+    int bp = vm->BP;
+    int sp = vm->SP;
+    if(pc < 0 || pc >= v->numOfIns || v->owner[pc] < 0)
+        return 0;
+    p = v->owner[pc];
+    while(p != 0)
+    {
+        if(bp < 1 || bp + 3 >= cells || sp - bp + 1 != v->offset[pc] || frameOf[p] >= 0)
+            return 0;
+        frameOf[p] = bp;
+
+        // The CAL that entered the frame, in the caller
+        int call = stack[bp + 3] - 1;
+        if(call < 0 || call >= v->numOfIns || v->owner[call] < 0 || packedOp(v->ins[call]) != 5 ||
+           v->procedureAt[packedM(v->ins[call])] != p)
+            return 0;
+        pc = call;
+        p = v->owner[call];
+        sp = bp - 1;
+        bp = stack[bp + 2];
+    }
+    if(bp != 1 || sp - bp + 1 != v->offset[pc])
+        return 0;
+    frameOf[0] = 1;
+
+    for(p = 1; p < report->numOfProcedures; p++)
+    {
+        int parent = report->procedures[p].parent;
+        if(frameOf[p] >= 0 && (frameOf[parent] < 0 || stack[frameOf[p] + 1] != frameOf[parent]))
+            return 0;
+    }
+    return 1;
+}
+
+int verifyProgram(const PackedInstruction* ins, int numOfIns, VerifyReport* report)
+{
+    VerifyReport own;
+    Verifier v;
+    int verified = 0;
+    if(openVerifier(&v, ins, numOfIns, report ? report : &own))
+    {
+        verified = prove(&v);
+    }
+    else
+    {
+        free(v.report->procedures);
+        *v.report = (VerifyReport){ .errorPC = -1, .error = "out of memory" };
+    }
+
+    closeVerifier(&v);
+    if(!report)
+        freeVerifyReport(&own);
+    return verified;
+}
+
+void freeVerifyReport(VerifyReport* report)
+{
+    free(report->procedures);
+    report->procedures = NULL;
+    report->numOfProcedures = 0;
+}
+
+int verifyMachineState(const PackedInstruction* ins, int numOfIns, const VirtualMachine* vm)
+{
+    VerifyReport report;
+    Verifier v;
+    int reachable = openVerifier(&v, ins, numOfIns, &report) && prove(&v) && stateReachable(&v, vm);
+
+    closeVerifier(&v);
+    free(report.procedures);
+    return reachable;
+}
+
+int instructionFieldsValid(Instruction insi, int codeSize)
+{
+    int registers = VM_REGISTERS;
+    int op = insi.op;
+
+    // R is the register of every instruction but RTN, STO (which stores R
+    // .. itself), CAL, INC, JMP and SIO halt
+    int usesR = op == 1 || op == 3 || (op >= 8 && op <= 10) || (op >= 12 && op <= 24);
+    int usesL = op >= 12 && op <= 24 && op != 17;
+    int usesM = op >= 13 && op <= 24 && op != 17;
+    int jumps = op == 5 || op == 7 || op == 8;
+
+    if(usesR && (insi.r < 0 || insi.r >= registers))
+        return 0;
+    if(usesL && (insi.l < 0 || insi.l >= registers))
+        return 0;
+    if(usesM && (insi.m < 0 || insi.m >= registers))
+        return 0;
+    if(jumps && (insi.m < 0 || insi.m >= codeSize))
+        return 0;
+    return 1;
+}
+
+void printVerifyReport(FILE* out, const VerifyReport* report)
+{
+    const char* runs = report->guarded ? "runs without checks above a guard page" : "runs with checks";
+    if(report->verified)
+        fprintf(out, "Verified: runs without checks.\n");
+    else if(report->errorPC >= 0)
+        fprintf(out, "Not verified: %s at %d, %s.\n", report->error, report->errorPC, runs);
+    else
+        fprintf(out, "Not verified: %s, %s.\n", report->error, runs);
+
+    fprintf(out, "***Procedures***\n%6s %6s %6s %6s %10s \n", "ENTRY", "LEVEL", "PARENT", "FRAME", "STACK");
+    int i;
+    for(i = 0; i < report->numOfProcedures; i++)
+    {
+        const ProcedureInfo* procedure = &report->procedures[i];
+        int parent = procedure->parent >= 0 ? report->procedures[procedure->parent].entry : -1;
+        fprintf(out, "%6d %6d %6d %6d ", procedure->entry, procedure->depth, parent, procedure->frame);
+        if(procedure->stackNeed >= 0)
+            fprintf(out, "%10d \n", procedure->stackNeed);
+        else
+            fprintf(out, "%10s \n", "-");
+    }
+}
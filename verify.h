@@ -0,0 +1,88 @@
+#ifndef __VERIFY_H__
+#define __VERIFY_H__
+
+#include <stdio.h>
+#include "vm.h"
+#include "data.h"
+#include "bytecode.h"
+
+/**
+ * Load-time verifier of virtual machine code.
+ *
+ * A program is verified if, run from the initial state of the machine, no
+ * instruction it can reach uses a register, a code address or a stack cell
+ * outside the machine, whatever its input. Verified programs run without any
+ * checks; the others run on the checked path, where such an instruction
+ * halts the machine like an illegal instruction (see runProgram()).
+ *
+ * The proof follows the layout of the code generator:
+ *   - procedures are the main block at 0 and the targets of CAL; every
+ *     instruction reached belongs to one procedure and is always reached with
+ *     the same frame size (the sum of the INCs before it)
+ *   - the lexical level of a procedure follows from the CALs to it, and LOD,
+ *     STO and CAL do not go past the main block along the static chain
+ *   - LOD and STO stay inside the frame they address, and STO leaves the
+ *     links of procedure frames alone
+ *   - CAL is only executed once the frame is complete, and the main block
+ *     does not return
+ *   - the deepest chain of calls fits the stack, so recursive programs are
+ *     not verified
+ *
+ * A program for which only the last point fails is guarded: it stays inside
+ * the machine as long as its stack does. It runs without checks too, on a
+ * machine from createVM() whose stack is followed by guard pages, where the
+ * first access past the stack halts it (see runGuarded()).
+ * */
+
+typedef struct
+{
+    int entry;          // address of the first instruction
+    int depth;          // lexical level, 0 for the main block
+    int parent;         // index of the enclosing procedure, -1 for the main block
+    int frame;          // stack cells of the frame, links included
+    int stackNeed;      // cells used by the frame and its deepest calls, -1 if recursive
+} ProcedureInfo;
+
+typedef struct
+{
+    int verified;       // 1 if the program can run without checks
+    int guarded;        // 1 if every check but the depth of the calls holds
+    int errorPC;        // instruction the proof failed at, or -1
+    const char* error;  // why the proof failed, or NULL
+    int numOfProcedures;
+    ProcedureInfo* procedures;  // one per entry address at most, so numOfIns
+} VerifyReport;
+
+/**
+ * Verifies the program. The report may be NULL; otherwise it is filled with
+ * the procedures found and, if the program is not verified, the reason, and
+ * must be released with freeVerifyReport().
+ * Returns 1 if the program is verified, 0 otherwise.
+ * */
+int verifyProgram(const PackedInstruction* ins, int numOfIns, VerifyReport* report);
+
+/**
+ * Releases the procedures of a report filled by verifyProgram().
+ * */
+void freeVerifyReport(VerifyReport* report);
+
+/**
+ * Returns 1 if the program is verified and the machine is in a state the
+ * program can reach from the start, which it may then continue from without
+ * checks: every frame on the stack is an activation the proof allows for,
+ * with intact links. Machines restored from a snapshot are checked this way.
+ * */
+int verifyMachineState(const PackedInstruction* ins, int numOfIns, const VirtualMachine* vm);
+
+/**
+ * Returns 1 if the register fields of the instruction name registers of the
+ * machine and its jump or call target lies below codeSize.
+ * */
+int instructionFieldsValid(Instruction insi, int codeSize);
+
+/**
+ * Prints the verdict and the procedures of the report.
+ * */
+void printVerifyReport(FILE* out, const VerifyReport* report);
+
+#endif
@@ -6,20 +6,112 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "vm.h"
 #include "data.h"
+#include "vm_trace.h"
+#include "bytecode.h"
+#include "vm_engine.h"
+#include "vm_output.h"
+#include "vm_input.h"
+#include "jit.h"
+#include "verify.h"
 
 void initVM(VirtualMachine*);
 
-int readInstructions(FILE*, Instruction*);
+int readInstructions(FILE*, PackedInstruction**);
 
-void dumpInstructions(FILE*, Instruction*, int numOfIns);
+int codeMemorySize(int numOfIns);
+
+void dumpInstructions(FILE*, const PackedInstruction*, int numOfIns);
 
 int getBasePointer(int *stack, int currentBP, int L);
 
+int checkedBasePointer(const int* stack, int currentBP, int L, int* base);
+
+int checkInstruction(const VirtualMachine* vm, Instruction insi, int codeSize);
+
 void dumpStack(FILE*, int* stack, int sp, int bp);
 
-int executeInstruction(VirtualMachine* vm, Instruction insi, FILE* vmIn, FILE* vmOut);
+int executeInstruction(VirtualMachine* vm, Instruction insi, InputSource* vmIn, OutputSink* vmOut);
+
+void traceStep(FILE*, StackView* view, VirtualMachine* vm, Instruction insi);
+
+void dumpExecutionHeader(FILE*);
+
+int stackWrites(VirtualMachine* vm, Instruction insi, int cells[TRACE_MAX_DELTAS]);
+
+void recordStep(FILE* trace, StackView* view, TraceWriter* recorder, VirtualMachine* vm, Instruction insi);
+
+int runProgram(VirtualMachine* vm, const PackedInstruction* ins, int numOfIns, FILE* vmIn, FILE* vmOut, const RunOptions* options);
+
+VmProgram* loadProgram(FILE* inp, int jit);
+
+void freeProgram(VmProgram* program);
+
+const PackedInstruction* programCode(const VmProgram* program, int* numOfIns);
+
+int programVerified(const VmProgram* program);
+
+VirtualMachine* createVM(void);
+
+void resetVM(VirtualMachine* vm);
+
+void resetVMUsed(VirtualMachine* vm, int stackMark);
+
+void freeVM(VirtualMachine* vm);
+
+int runLoadedProgram(const VmProgram* program, VirtualMachine* vm, FILE* vmIn, FILE* vmOut, const RunOptions* options);
+
+int runLoadedProgramWithChannels(const VmProgram* program, VirtualMachine* vm,
+                                 InputSource* in, OutputSink* out, const RunOptions* options);
+
+void profileStep(Profile* profile, VirtualMachine* vm, Instruction insi);
+
+double wallClock(void);
+
+long nextBudgetCheck(const RunOptions* options, long steps);
+
+int budgetSpent(const RunOptions* options, long steps);
+
+int compareProfileEntries(const void* a, const void* b);
+
+Profile* createProfile(int numOfIns);
+
+void freeProfile(Profile* profile);
+
+void printProfileReport(FILE* out, const Profile* profile, const PackedInstruction* ins, int numOfIns);
+
+int buildDisplay(int* stack, int bp, int* display);
+
+int matchFusedForm(const PackedInstruction* ins, int i, int numOfIns);
+
+void printFusionReport(FILE* out, const FusionStats* stats);
+
+int loadCodeMemory(FILE*, CodeMemory* code);
+
+void freeCodeMemory(CodeMemory* code);
+
+int startMachine(VirtualMachine* vm, const CodeMemory* code, FILE* vmIn, FILE* vmOut);
+
+void runVM(FILE* inp, FILE* vm_inp, FILE* vm_outp);
+
+void runVMWithOptions(FILE* inp, FILE* vm_inp, FILE* vm_outp, const RunOptions* options);
+
+void recordVM(FILE* inp, FILE* traceOut, FILE* vm_inp, FILE* vm_outp);
+
+void profileVM(FILE* inp, FILE* reportOut, FILE* vm_inp, FILE* vm_outp);
+
+int checkpointVM(FILE* inp, FILE* snapshotOut);
 
 // Allows conversion from opcode to opcode string
 const char *opcodes[] = 
@@ -31,8 +123,148 @@ const char *opcodes[] =
     "div", "odd", "mod", "eql", "neq",
     "lss", "leq", "gtr", "geq"
 };
-// Conditions
-enum { CONT, HALT };
+// Instruction sequences fused into superinstructions, indexed by FusedForm
+static const struct
+{
+    const char* name;
+    int length;
+    int ops[4];
+} fusedForms[FUSED_FORMS] =
+{
+    [FUSED_LOD_LIT_EQL_JPC] = { "lod-lit-eql-jpc", 4, { 3, 1, 19, 8 } },
+    [FUSED_LOD_LIT_NEQ_JPC] = { "lod-lit-neq-jpc", 4, { 3, 1, 20, 8 } },
+    [FUSED_LOD_LIT_LSS_JPC] = { "lod-lit-lss-jpc", 4, { 3, 1, 21, 8 } },
+    [FUSED_LOD_LIT_LEQ_JPC] = { "lod-lit-leq-jpc", 4, { 3, 1, 22, 8 } },
+    [FUSED_LOD_LIT_GTR_JPC] = { "lod-lit-gtr-jpc", 4, { 3, 1, 23, 8 } },
+    [FUSED_LOD_LIT_GEQ_JPC] = { "lod-lit-geq-jpc", 4, { 3, 1, 24, 8 } },
+    [FUSED_LIT_LIT_ADD]     = { "lit-lit-add",     3, { 1, 1, 13 } },
+    [FUSED_LIT_LIT_SUB]     = { "lit-lit-sub",     3, { 1, 1, 14 } },
+    [FUSED_LIT_LIT_MUL]     = { "lit-lit-mul",     3, { 1, 1, 15 } },
+    [FUSED_LIT_LIT]         = { "lit-lit",         2, { 1, 1 } },
+    [FUSED_LIT_STO]         = { "lit-sto",         2, { 1, 4 } },
+    [FUSED_LOD_WRITE]       = { "lod-sio",         2, { 3, 9 } },
+};
+
+// Highest opcode understood by the virtual machine (GEQ)
+#define MAX_OPCODE 24
+
+// Execution engine selection. GCC and Clang support labels as values, so the
+// engine can jump straight from one instruction handler to the next (direct
+// threading). Other compilers, or builds with -DVM_SWITCH_DISPATCH, fall back
+// to calling executeInstruction() from a fetch loop.
+#if defined(__GNUC__) && !defined(VM_SWITCH_DISPATCH)
+#define VM_THREADED_DISPATCH 1
+#else
+#define VM_THREADED_DISPATCH 0
+#endif
+
+// Pre-decoded instruction used by the threaded engine.
+// The opcode is replaced by the address of the code that executes it.
+typedef struct
+{
+    const void* handler;
+    int r;
+    int l;
+    int m;
+} DecodedInstruction;
+
+// Index of the handler of the checked path (see decodeInstructions()) among
+// .. the opcode handlers
+#define CHECKED_HANDLER (MAX_OPCODE + 1)
+
+// Handler addresses of the threaded engine, obtained from runEngine()
+typedef struct
+{
+    const void* ops[CHECKED_HANDLER + 1];   // indexed by opcode, [0] is illegal
+    const void* fused[FUSED_FORMS];         // indexed by FusedForm
+} HandlerTable;
+
+// A loaded program (see vm_engine.h). Nothing in it changes after loadProgram().
+struct VmProgram
+{
+    CodeMemory code;
+    int verified;                   // 1 if verifyProgram() passed, see verify.h
+    int guarded;                    // 1 if it runs unchecked above a guard page, see verifyForRun()
+    DecodedInstruction* plain;      // threaded engine code, one handler per instruction,
+                                    // .. checked if the program is not verified
+    DecodedInstruction* fused;      // threaded engine code with superinstructions, if
+                                    // .. verified or guarded
+    long rewrites[FUSED_FORMS];     // superinstructions formed in fused
+    JitProgram* jit;                // machine code, if requested and supported
+};
+
+int runEngine(VirtualMachine* vm, const DecodedInstruction* code, const PackedInstruction* ins, int numOfIns,
+              int checked, InputSource* in, OutputSink* out, const RunOptions* options, HandlerTable* labels);
+
+DecodedInstruction* decodeInstructions(const PackedInstruction* ins, int numOfIns, const HandlerTable* labels,
+                                       int fuse, long rewrites[FUSED_FORMS], int checked);
+
+int runWithChannels(VirtualMachine* vm, const DecodedInstruction* code, const PackedInstruction* ins, int numOfIns,
+                    int verified, int checked, const JitProgram* jit, FILE* vmIn, FILE* vmOut,
+                    const RunOptions* options);
+
+int runOnChannels(VirtualMachine* vm, const DecodedInstruction* code, const PackedInstruction* ins, int numOfIns,
+                  int verified, int checked, const JitProgram* jit, InputSource* in, OutputSink* out,
+                  const RunOptions* options);
+
+int runGuarded(VirtualMachine* vm, const DecodedInstruction* code, const PackedInstruction* ins, int numOfIns,
+               InputSource* in, OutputSink* out, const RunOptions* options);
+
+int verifyForRun(const PackedInstruction* ins, int numOfIns, int* guarded);
+
+const DecodedInstruction* selectLoadedCode(const VmProgram* program, const VirtualMachine* vm,
+                                           const RunOptions* options, int blocking,
+                                           const JitProgram** jit, int* checked);
+
+int machineGuarded(const VirtualMachine* vm);
+
+int runsUnchecked(int verified, int guarded, const VirtualMachine* vm, int observing);
+
+// Deepest lexical level the display of the threaded engine keeps track of
+#define MAX_DISPLAY_LEVELS 32
+
+// A run whose stack overflow faults on the guard pages of its machine
+typedef struct StackGuard
+{
+    sigjmp_buf overflow;            // back to runGuarded() when the guard is touched
+    const char* start;              // guard pages following the stack of the machine
+    const char* end;
+    struct StackGuard* outer;       // guarded run of the thread this one is nested in
+} StackGuard;
+
+// Guarded run of the calling thread, or NULL
+static __thread StackGuard* activeGuard;
+
+// Machines from createVM() whose stack is followed by guard pages: a set of
+// .. addresses with open addressing, behind a spin lock. Only the machines in
+// .. it run guarded programs without checks. VirtualMachine has no room to
+// .. mark them itself, and verified programs never look them up.
+static int guardedLock;
+static VirtualMachine** guardedMachines;
+static size_t guardedCapacity;      // slots, a power of two or 0
+static size_t guardedCount;
+
+// 1 if the stack is the last member of VirtualMachine, so that createVM() can
+// .. put guard pages right after it
+#define STACK_ENDS_MACHINE \
+    (offsetof(VirtualMachine, stack) + sizeof(((VirtualMachine*)0)->stack) == sizeof(VirtualMachine))
+
+// Display entry overwritten by a CAL, restored by the matching RTN
+typedef struct
+{
+    int level;    // lexical level of the caller
+    int previous; // previous base pointer of the callee's level
+} DisplaySave;
+
+// Counter and the index it belongs to, sorted by printProfileReport()
+typedef struct
+{
+    long count;
+    int index;
+} ProfileEntry;
+
+// Number of rows printed in the hot PC table
+#define PROFILE_HOT_PCS 20
 
 // Initialize Virtual Machine
 // Since vm was allocated using calloc, just initilize BP to 1
@@ -44,20 +276,53 @@ void initVM(VirtualMachine* vm)
     }
 }
 
- // Fill the (ins)tructions array by reading instructions from (in)put file
- // Return the number of instructions read
-int readInstructions(FILE* in, Instruction* ins)
+ // Fill a heap array of (ins)tructions by reading instructions from (in)put file,
+ // .. packing each of them into a single word. The array starts with room for
+ // .. MAX_CODE_LENGTH instructions and doubles when it is full, up to the
+ // .. addresses the packed encoding can hold; instructions past that are not read.
+ // Return the number of instructions read, or -1 if an instruction does not
+ // .. fit the packed encoding or the array cannot grow. (ins) is set either way.
+int readInstructions(FILE* in, PackedInstruction** ins)
 {
+    int capacity = MAX_CODE_LENGTH;
+    *ins = malloc(capacity * sizeof(PackedInstruction));
+    if(!*ins)
+        return -1;
+
     int i = 0;
-    while(fscanf(in, "%d %d %d %d", &ins[i].op, &ins[i].r, &ins[i].l, &ins[i].m) != EOF)
+    Instruction insi;
+    while(i < PACKED_MAX_CODE_LENGTH && fscanf(in, "%d %d %d %d", &insi.op, &insi.r, &insi.l, &insi.m) == 4)
     {
+        if(!canPackInstruction(insi.op, insi.r, insi.l, insi.m))
+        {
+            fprintf(stderr, "Instruction %d (%d %d %d %d) cannot be encoded.\n", i, insi.op, insi.r, insi.l, insi.m);
+            return -1;
+        }
+        if(i == capacity)
+        {
+            capacity = capacity * 2 < PACKED_MAX_CODE_LENGTH ? capacity * 2 : PACKED_MAX_CODE_LENGTH;
+            PackedInstruction* grown = realloc(*ins, capacity * sizeof(PackedInstruction));
+            if(!grown)
+                return -1;
+            *ins = grown;
+        }
+        (*ins)[i] = packInstruction(insi.op, insi.r, insi.l, insi.m);
         i++;
     }
     return i;
 }
 
+ // Returns the number of instructions in code memory for a program of
+ // .. (numOfIns) instructions: at least MAX_CODE_LENGTH, as when code memory
+ // .. had a fixed size, so jumps and returns below that stay legal and fetch
+ // .. an illegal instruction past the program.
+int codeMemorySize(int numOfIns)
+{
+    return numOfIns > MAX_CODE_LENGTH ? numOfIns : MAX_CODE_LENGTH;
+}
+
  // Dump instructions to the output file with formatting
-void dumpInstructions(FILE* out, Instruction* ins, int numOfIns)
+void dumpInstructions(FILE* out, const PackedInstruction* ins, int numOfIns)
 {
     fprintf(out,"***Code Memory***\n%3s %3s %3s %3s %3s \n","#", "OP", "R", "L", "M" );
 
@@ -65,51 +330,117 @@ void dumpInstructions(FILE* out, Instruction* ins, int numOfIns)
     int i;
     for(i = 0; i < numOfIns; i++)
     {
-        fprintf(out,"%3d %3s %3d %3d %3d \n",i, opcodes[ins[i].op], ins[i].r, ins[i].l, ins[i].m);
+        Instruction insi = unpackInstruction(ins[i]);
+        fprintf(out,"%3d %3s %3d %3d %3d \n",i, opcodes[insi.op], insi.r, insi.l, insi.m);
     }
 }
 
  // Returns the base pointer for the lexiographic level L
+ // .. by following the static links (stack[bp + 1]) L times
 int getBasePointer(int *stack, int currentBP, int L)
 {
-    return 0;
+    int bp = currentBP;
+    while(L > 0)
+    {
+        bp = stack[bp + 1];
+        L--;
+    }
+    return bp;
+}
+
+ // Like getBasePointer(), for the checked path: the links are followed only
+ // .. while they point into the stack.
+ // Returns 1 and stores the base pointer in (base), or 0 if the walk leaves the stack.
+int checkedBasePointer(const int* stack, int currentBP, int L, int* base)
+{
+    int cells = VM_STACK_CELLS;
+    int bp = currentBP;
+    while(L > 0 && bp >= 0 && bp + 1 < cells)
+    {
+        bp = stack[bp + 1];
+        L--;
+    }
+    *base = bp;
+    return L == 0 && bp >= 0 && bp < cells;
+}
+
+ // Returns 1 if (insi), about to run on the (v)irtual (m)achine, only uses
+ // .. registers, code memory and stack cells of the machine. Every instruction
+ // .. of a program that is not verified is checked this way (see verify.h).
+int checkInstruction(const VirtualMachine* vm, Instruction insi, int codeSize)
+{
+    int cells = VM_STACK_CELLS;
+    int base;
+    if(!instructionFieldsValid(insi, codeSize))
+        return 0;
+    switch(insi.op)
+    {
+      case 2: // RTN reads the dynamic link and the return address
+        return vm->BP >= 0 && vm->BP + 3 < cells &&
+               vm->stack[vm->BP + 3] >= 0 && vm->stack[vm->BP + 3] < codeSize;
+      case 3: // LOD
+      case 4: // STO
+        return checkedBasePointer(vm->stack, vm->BP, insi.l, &base) &&
+               base + insi.m >= 0 && base + insi.m < cells;
+      case 5: // CAL writes four cells above SP
+        return checkedBasePointer(vm->stack, vm->BP, insi.l, &base) &&
+               vm->SP >= -1 && vm->SP + 4 < cells;
+      case 6: // INC keeps SP next to the stack
+        return vm->SP + insi.m >= -1 && vm->SP + insi.m < cells;
+      default:
+        return 1;
+    }
 }
 
 // Function that dumps the whole stack into output file
 // Do not forget to use '|' character between stack frames
 void dumpStack(FILE* out, int* stack, int sp, int bp)
 {
-    if(bp == 0)
-        return;
+    // Walk the dynamic links down from the current activation record, so the
+    // .. records can be printed bottom-most first (links that do not lead down
+    // .. the stack, which only programs run on the checked path have, end the
+    // .. walk). Links strictly decrease, so there is one base per stack cell
+    // .. at most.
+    int bases[VM_STACK_CELLS];
+    int numOfBases = 0;
+    while(bp != 0)
+    {
+        bases[numOfBases++] = bp;
+        if(bp == 1 || bp < 0 || bp + 2 >= (int)VM_STACK_CELLS || stack[bp + 2] >= bp)
+            break;
+        bp = stack[bp + 2];
+    }
 
-    // bottom-most level, where a single zero value lies
-    if(bp == 1)
-        fprintf(out, "%3d ", 0);
+    while(numOfBases > 0)
+    {
+        bp = bases[--numOfBases];
 
-    // former levels - if exists
-    if(bp != 1)
-        dumpStack(out, stack, bp - 1, stack[bp + 2]);            
+        // bottom-most level, where a single zero value lies
+        if(bp == 1)
+            fprintf(out, "%3d ", 0);
 
-    // top level: current activation record
-    if(bp <= sp)
-    {
-        // indicate a new activation record
-        fprintf(out, "| ");
-        
-        // print the activation record
-        int i;
-        for(i = bp; i <= sp; i++)
-            fprintf(out, "%3d ", stack[i]);
+        // a former level ends where the next one begins
+        int top = numOfBases > 0 ? bases[numOfBases - 1] - 1 : sp;
+        if(bp <= top)
+        {
+            // indicate a new activation record
+            fprintf(out, "| ");
+
+            // print the activation record
+            int i;
+            for(i = bp; i <= top; i++)
+                fprintf(out, "%3d ", stack[i]);
+        }
     }
 }
 
  // Executes the (ins)truction on the (v)irtual (m)achine.
  // This changes the state of the virtual machine.
- // Returns HALT if the executed instruction was meant to halt the VM.
- // .. Otherwise, returns CONT
+ // Returns HALT if the executed instruction was meant to halt the VM, BLOCKED
+ // .. if it is an SIO read waiting for input. Otherwise, returns CONT
  // ins has op,r,l,m
  // vm has BP,SP,PC,IR,RF,stack
-int executeInstruction(VirtualMachine* VM, Instruction insi, FILE* vmIn, FILE* vmOut)
+int executeInstruction(VirtualMachine* VM, Instruction insi, InputSource* vmIn, OutputSink* vmOut)
 {
     switch(insi.op)
     {
@@ -127,18 +458,18 @@ int executeInstruction(VirtualMachine* VM, Instruction insi, FILE* vmIn, FILE* v
       }
       case 3: // LOD
       {
-        VM->RF[insi.r] = VM->stack[getBasePointer(VM->stack,insi.l,VM->BP) + insi.m];
+        VM->RF[insi.r] = VM->stack[getBasePointer(VM->stack,VM->BP,insi.l) + insi.m];
         break;
       }
       case 4: // STO
       {
-        VM->stack[getBasePointer(VM->stack,insi.l,VM->BP) + insi.m] = insi.r;
+        VM->stack[getBasePointer(VM->stack,VM->BP,insi.l) + insi.m] = insi.r;
         break;
       }
       case 5: // CAL
       {
         VM->stack[VM->SP+1] = 0;
-        VM->stack[VM->SP+2] = getBasePointer(VM->stack,insi.l,VM->BP);
+        VM->stack[VM->SP+2] = getBasePointer(VM->stack,VM->BP,insi.l);
         VM->stack[VM->SP+3] = VM->BP;
         VM->stack[VM->SP+4] = VM->PC;
         VM->BP = VM->SP+1;
@@ -163,15 +494,21 @@ int executeInstruction(VirtualMachine* VM, Instruction insi, FILE* vmIn, FILE* v
       }
       case 9: // SIO
       {
-        fprintf(vmOut,"%d ",VM->RF[insi.r]);
+        writeOutputNumber(vmOut,VM->RF[insi.r]);
         break;
       }
       case 10: // SIO
       {
-        int buffer[1];
-        fscanf(vmIn,"%d",buffer);
-        VM->RF[insi.r] = buffer[0];
-        break; //read??
+        // 0 at the end of input, see vm_input.h
+        if(inputMayWait(vmIn))
+            flushOutputSink(vmOut);
+        if(readInputNumber(vmIn,&VM->RF[insi.r]) < 0)
+        {
+            // Waiting for input: undo the fetch so that the read runs again
+            VM->PC = VM->IR;
+            return BLOCKED;
+        }
+        break;
       }
       case 11: // SIO
       {
@@ -200,6 +537,8 @@ int executeInstruction(VirtualMachine* VM, Instruction insi, FILE* vmIn, FILE* v
       }
       case 16: // DIV
       {
+        if(!divisionDefined(VM->RF[insi.l], VM->RF[insi.m]))
+            goto illegal;
         VM->RF[insi.r] = VM->RF[insi.l] / VM->RF[insi.m];
         break;
       }
@@ -210,6 +549,8 @@ int executeInstruction(VirtualMachine* VM, Instruction insi, FILE* vmIn, FILE* v
       }
       case 18: // MOD
       {
+        if(!divisionDefined(VM->RF[insi.l], VM->RF[insi.m]))
+            goto illegal;
         VM->RF[insi.r] = VM->RF[insi.l] % VM->RF[insi.m];
         break;
       }
@@ -262,6 +603,8 @@ int executeInstruction(VirtualMachine* VM, Instruction insi, FILE* vmIn, FILE* v
         break;
       }
         default:
+        illegal:
+            flushOutputSink(vmOut);
             fprintf(stderr, "Illegal instruction?");
             return HALT;
     }
@@ -269,77 +612,1626 @@ int executeInstruction(VirtualMachine* VM, Instruction insi, FILE* vmIn, FILE* v
     return CONT;
 }
 
-/**
- * inp: The FILE pointer containing the list of instructions to
- *         be loaded to code memory of the virtual machine.
- * 
- * outp: The FILE pointer to write the simulation output, which
- *       contains both code memory and execution history.
- * 
- * vm_inp: The FILE pointer that is going to be attached as the input
- *         stream to the virtual machine. Useful to feed input for SIO
- *         instructions.
- * 
- * vm_outp: The FILE pointer that is going to be attached as the output
- *          stream to the virtual machine. Useful to save the output printed
- *          by SIO instructions.
- * */
-void simulateVM(
-    FILE* inp,
-    FILE* outp,
-    FILE* vm_inp,
-    FILE* vm_outp
-    )
+ // Print the state of the (v)irtual (m)achine after executing (insi). The stack
+ // .. comes from the (view) kept over the previous steps, if not NULL.
+void traceStep(FILE* out, StackView* view, VirtualMachine* vm, Instruction insi)
 {
-    
-    // Allocate array of instructions, initiate all values to 0
-    Instruction* insArray = calloc(MAX_CODE_LENGTH,sizeof(Instruction));
-    // Get number of instructions
-    int nInstructions = readInstructions(inp,insArray);
+    fprintf(out,"%3d %3s %3d %3d %3d %3d %3d %3d ",vm->IR,opcodes[insi.op],insi.r,insi.l,insi.m,vm->PC,vm->BP,vm->SP);
 
-    // Dump instructions to the output file
-    dumpInstructions(outp,insArray,nInstructions);
+    // Print the stack, one activation record per '|' separated group
+    if(view)
+        writeStackView(out,view,vm,insi);
+    else
+        dumpStack(out,vm->stack,vm->SP,vm->BP);
+    fprintf(out, "\n");
+}
 
-    // Before starting the code execution on the virtual machine,
-    // .. write the header for the simulation part (***Execution***)
-    fprintf(outp, "\n***Execution***\n");
-    fprintf(outp,"%3s %3s %3s %3s %3s %3s %3s %3s %3s \n","#","OP","R","L","M","PC","BP","SP","STK");
+ // Print the title and column names of the execution history
+void dumpExecutionHeader(FILE* out)
+{
+    fprintf(out, "\n***Execution***\n");
+    fprintf(out,"%3s %3s %3s %3s %3s %3s %3s %3s %3s \n","#","OP","R","L","M","PC","BP","SP","STK");
+}
 
-    // Create a virtual machine, initilize values to 0(BP to 1)
-    VirtualMachine* vm = calloc(1,sizeof(VirtualMachine));
-    initVM(vm);
+ // Fill cells with the stack indices written by (insi), which was just executed.
+ // Only STO and CAL write to the stack.
+ // Returns the number of cells written.
+int stackWrites(VirtualMachine* vm, Instruction insi, int cells[TRACE_MAX_DELTAS])
+{
+    switch(insi.op)
+    {
+      case 4: // STO, BP is unchanged
+        cells[0] = getBasePointer(vm->stack,vm->BP,insi.l) + insi.m;
+        return 1;
+      case 5: // CAL, the new activation record starts at BP
+        cells[0] = vm->BP;
+        cells[1] = vm->BP + 1;
+        cells[2] = vm->BP + 2;
+        cells[3] = vm->BP + 3;
+        return 4;
+      default:
+        return 0;
+    }
+}
 
-    int flag = CONT;
-    // Fetch&Execute the instructions on the virtual machine until halting
-    while( flag == CONT )
+ // Send the state after executing (insi) to the text trace and the binary recorder,
+ // .. whichever are not NULL
+void recordStep(FILE* trace, StackView* view, TraceWriter* recorder, VirtualMachine* vm, Instruction insi)
+{
+    if(trace)
+        traceStep(trace, view, vm, insi);
+    if(recorder)
+        writeTraceStep(recorder, vm, insi);
+}
+
+ // Count (insi), which was just executed, in the profile
+void profileStep(Profile* profile, VirtualMachine* vm, Instruction insi)
+{
+    profile->instructions++;
+    profile->opcodes[insi.op]++;
+    if(vm->IR < 0 || vm->IR >= profile->numOfPCs)
+        return;
+    profile->pcs[vm->IR]++;
+
+    // Frame the instruction ran in: CAL has already entered the callee and
+    // .. RTN has already left it
+    int frame = vm->BP;
+    if(insi.op == 5)
+        frame = vm->stack[vm->BP + 2];
+    else if(insi.op == 2)
+        frame = vm->SP + 1;
+    if(frame >= 0 && frame < (int)VM_STACK_CELLS)
+        profile->self[profile->frames[frame]]++;
+
+    if(insi.op == 8 && vm->RF[insi.r] == 0)
+        profile->taken[vm->IR]++;
+    if(insi.op == 5 && vm->PC >= 0 && vm->PC < profile->numOfPCs && vm->BP < (int)VM_STACK_CELLS)
     {
-        // Fetch
-        Instruction insi = insArray[vm->PC];
-        vm->IR = vm->PC;
-        vm->PC++; // Advance PC
+        profile->calls[vm->PC]++;
+        profile->frames[vm->BP] = vm->PC;
+    }
+}
 
-        // Execute the instruction
-        flag = executeInstruction(vm,insi,vm_inp,vm_outp);
+ // Returns the time in seconds from an arbitrary starting point
+double wallClock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+ // Returns the instruction count at which a run that has executed (steps)
+ // .. instructions must check the budget of its (options) next
+long nextBudgetCheck(const RunOptions* options, long steps)
+{
+    long next = LONG_MAX;
+    if(options->fuel > 0)
+        next = options->fuel;
+    if(options->deadline > 0 && steps + DEADLINE_CHECK_STEPS < next)
+        next = steps + DEADLINE_CHECK_STEPS;
+    return next;
+}
+
+ // Returns 1 if a run that has executed (steps) instructions is out of fuel or
+ // .. past its deadline
+int budgetSpent(const RunOptions* options, long steps)
+{
+    if(options->fuel > 0 && steps >= options->fuel)
+        return 1;
+    return options->deadline > 0 && wallClock() >= options->deadline;
+}
+
+ // Orders profile entries by decreasing count, then by increasing index
+int compareProfileEntries(const void* a, const void* b)
+{
+    const ProfileEntry* x = a;
+    const ProfileEntry* y = b;
+    if(x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return x->index - y->index;
+}
+
+ // Allocate a zeroed profile whose per-PC counters cover (numOfIns) instructions
+Profile* createProfile(int numOfIns)
+{
+    int size = numOfIns > 0 ? numOfIns : 1;
+    Profile* profile = calloc(1,sizeof(Profile));
+    long* counters = profile ? calloc(4 * (size_t)size,sizeof(long)) : NULL;
+    if(!counters)
+    {
+        free(profile);
+        return NULL;
+    }
+    profile->numOfPCs = size;
+    profile->pcs = counters;
+    profile->taken = counters + size;
+    profile->calls = counters + 2 * (size_t)size;
+    profile->self = counters + 3 * (size_t)size;
+    return profile;
+}
+
+ // Release a profile from createProfile()
+void freeProfile(Profile* profile)
+{
+    if(!profile)
+        return;
+    free(profile->pcs);
+    free(profile);
+}
+
+ // Print the profile, every table sorted by execution count
+void printProfileReport(FILE* out, const Profile* profile, const PackedInstruction* ins, int numOfIns)
+{
+    double total = profile->instructions ? profile->instructions : 1;
+    int i, n;
+
+    // The per-PC counters stop at numOfPCs, see Profile
+    int profiled = numOfIns < profile->numOfPCs ? numOfIns : profile->numOfPCs;
+    ProfileEntry* entries = malloc((profiled > MAX_OPCODE ? profiled : MAX_OPCODE + 1) * sizeof(ProfileEntry));
+    if(!entries)
+        return;
+
+    fprintf(out, "***Profile***\n");
+    fprintf(out, "%-16s %12ld \n", "instructions", profile->instructions);
+    fprintf(out, "%-16s %12.6f \n", "seconds", profile->seconds);
+    fprintf(out, "%-16s %12.0f \n", "instructions/s", profile->seconds > 0 ? profile->instructions / profile->seconds : 0);
+
+    // Opcodes
+    for(i = n = 0; i <= MAX_OPCODE; i++)
+    {
+        if(profile->opcodes[i])
+            entries[n++] = (ProfileEntry){ profile->opcodes[i], i };
+    }
+    qsort(entries, n, sizeof(ProfileEntry), compareProfileEntries);
+    fprintf(out, "\n***Opcodes***\n%3s %3s %12s %7s \n", "#", "OP", "COUNT", "%");
+    for(i = 0; i < n; i++)
+        fprintf(out, "%3d %3s %12ld %7.2f \n", entries[i].index, opcodes[entries[i].index], entries[i].count, 100 * entries[i].count / total);
+
+    // Hot PCs with their disassembly
+    for(i = n = 0; i < profiled; i++)
+    {
+        if(profile->pcs[i])
+            entries[n++] = (ProfileEntry){ profile->pcs[i], i };
+    }
+    qsort(entries, n, sizeof(ProfileEntry), compareProfileEntries);
+    fprintf(out, "\n***Hot PCs***\n%3s %3s %3s %3s %3s %12s %7s \n", "#", "OP", "R", "L", "M", "COUNT", "%");
+    for(i = 0; i < n && i < PROFILE_HOT_PCS; i++)
+    {
+        Instruction insi = unpackInstruction(ins[entries[i].index]);
+        fprintf(out, "%3d %3s %3d %3d %3d %12ld %7.2f \n", entries[i].index, opcodes[insi.op],
+                insi.r, insi.l, insi.m, entries[i].count, 100 * entries[i].count / total);
+    }
+
+    // Procedures, by the instructions executed in their own frames
+    for(i = n = 0; i < profiled; i++)
+    {
+        if(profile->self[i] || profile->calls[i])
+            entries[n++] = (ProfileEntry){ profile->self[i], i };
+    }
+    qsort(entries, n, sizeof(ProfileEntry), compareProfileEntries);
+    fprintf(out, "\n***Procedures***\n%5s %10s %12s %7s \n", "ENTRY", "CALLS", "SELF", "%");
+    for(i = 0; i < n; i++)
+        fprintf(out, "%5d %10ld %12ld %7.2f \n", entries[i].index, profile->calls[entries[i].index],
+                entries[i].count, 100 * entries[i].count / total);
+
+    // Conditional jumps
+    for(i = n = 0; i < profiled; i++)
+    {
+        if(profile->pcs[i] && packedOp(ins[i]) == 8)
+            entries[n++] = (ProfileEntry){ profile->pcs[i], i };
+    }
+    qsort(entries, n, sizeof(ProfileEntry), compareProfileEntries);
+    fprintf(out, "\n***Branches***\n%3s %12s %12s %7s \n", "#", "TAKEN", "NOT TAKEN", "TAKEN%");
+    for(i = 0; i < n; i++)
+    {
+        long taken = profile->taken[entries[i].index];
+        fprintf(out, "%3d %12ld %12ld %7.2f \n", entries[i].index, taken, entries[i].count - taken,
+                100.0 * taken / entries[i].count);
+    }
+    free(entries);
+}
+
+ // Fill the display with the base pointers of the static chain starting at bp,
+ // .. one per lexical level, where the outermost frame (BP 1) is level 0.
+ // Returns the lexical level of bp, or -1 if the chain does not reach the
+ // .. outermost frame within MAX_DISPLAY_LEVELS links, or leaves the stack.
+int buildDisplay(int* stack, int bp, int* display)
+{
+    int chain[MAX_DISPLAY_LEVELS];
+    int level = 0;
+
+    chain[0] = bp;
+    while(chain[level] != 1)
+    {
+        if(level + 1 == MAX_DISPLAY_LEVELS || chain[level] < 0 || chain[level] + 1 >= (int)VM_STACK_CELLS)
+            return -1;
+        chain[level + 1] = stack[chain[level] + 1];
+        level++;
+    }
+
+    int i;
+    for(i = 0; i <= level; i++)
+        display[i] = chain[level - i];
+    return level;
+}
+
+ // Returns the superinstruction that starts at (ins)truction i, or -1 if none does
+int matchFusedForm(const PackedInstruction* ins, int i, int numOfIns)
+{
+    // Longer sequences are tried first, so that they win over their prefixes
+    static const int order[FUSED_FORMS] =
+    {
+        FUSED_LOD_LIT_EQL_JPC, FUSED_LOD_LIT_NEQ_JPC, FUSED_LOD_LIT_LSS_JPC,
+        FUSED_LOD_LIT_LEQ_JPC, FUSED_LOD_LIT_GTR_JPC, FUSED_LOD_LIT_GEQ_JPC,
+        FUSED_LIT_LIT_ADD, FUSED_LIT_LIT_SUB, FUSED_LIT_LIT_MUL,
+        FUSED_LIT_LIT, FUSED_LIT_STO, FUSED_LOD_WRITE
+    };
+
+    int k;
+    for(k = 0; k < FUSED_FORMS; k++)
+    {
+        int form = order[k];
+        int j;
+        if(i + fusedForms[form].length > numOfIns)
+            continue;
+        for(j = 0; j < fusedForms[form].length; j++)
+        {
+            if(packedOp(ins[i + j]) != fusedForms[form].ops[j])
+                break;
+        }
+        if(j == fusedForms[form].length)
+            return form;
+    }
+    return -1;
+}
+
+ // Print how often each superinstruction was formed and executed
+void printFusionReport(FILE* out, const FusionStats* stats)
+{
+    fprintf(out, "***Superinstructions***\n%-16s %10s %12s \n", "FORM", "REWRITES", "EXECUTED");
+    int i;
+    for(i = 0; i < FUSED_FORMS; i++)
+        fprintf(out, "%-16s %10ld %12ld \n", fusedForms[i].name, stats->rewrites[i], stats->executed[i]);
+}
+
+ // Execute the program on the (v)irtual (m)achine until it halts. This is the
+ // .. interpreter shared by runProgram() and runLoadedProgram(): the threaded
+ // .. engine runs the decoded (code), the switch engine fetches from (ins).
+ // If (checked) is set, the program is not verified and the switch engine
+ // .. checks every instruction before executing it; the threaded engine's
+ // .. checks are part of the decoded code.
+ // SIO goes through (in) and (out), which the caller opens.
+ // If (labels) is not NULL, nothing is run: the handler addresses of the
+ // .. threaded engine are stored in it for decodeInstructions() and CONT is returned.
+ // Returns HALT, or PREEMPTED when the budget of the (options) ran out.
+int runEngine(VirtualMachine* vm, const DecodedInstruction* code, const PackedInstruction* ins, int numOfIns,
+              int checked, InputSource* in, OutputSink* out, const RunOptions* options, HandlerTable* labels)
+{
+#if VM_THREADED_DISPATCH
+    // Handler addresses, indexed by opcode, then the checked path
+    static const void* handlers[CHECKED_HANDLER + 1] =
+    {
+        &&op_illegal,
+        &&op_lit, &&op_rtn, &&op_lod, &&op_sto, &&op_cal,
+        &&op_inc, &&op_jmp, &&op_jpc, &&op_write, &&op_read,
+        &&op_halt, &&op_neg, &&op_add, &&op_sub, &&op_mul,
+        &&op_div, &&op_odd, &&op_mod, &&op_eql, &&op_neq,
+        &&op_lss, &&op_leq, &&op_gtr, &&op_geq,
+        &&op_checked
+    };
+
+    // Superinstruction handler addresses, indexed by FusedForm
+    static const void* fusedHandlers[FUSED_FORMS] =
+    {
+        [FUSED_LIT_LIT] = &&fused_lit_lit,
+        [FUSED_LIT_LIT_ADD] = &&fused_lit_lit_add,
+        [FUSED_LIT_LIT_SUB] = &&fused_lit_lit_sub,
+        [FUSED_LIT_LIT_MUL] = &&fused_lit_lit_mul,
+        [FUSED_LIT_STO] = &&fused_lit_sto,
+        [FUSED_LOD_WRITE] = &&fused_lod_write,
+        [FUSED_LOD_LIT_EQL_JPC] = &&fused_lod_lit_eql_jpc,
+        [FUSED_LOD_LIT_NEQ_JPC] = &&fused_lod_lit_neq_jpc,
+        [FUSED_LOD_LIT_LSS_JPC] = &&fused_lod_lit_lss_jpc,
+        [FUSED_LOD_LIT_LEQ_JPC] = &&fused_lod_lit_leq_jpc,
+        [FUSED_LOD_LIT_GTR_JPC] = &&fused_lod_lit_gtr_jpc,
+        [FUSED_LOD_LIT_GEQ_JPC] = &&fused_lod_lit_geq_jpc
+    };
+#endif
+
+    if(labels)
+    {
+#if VM_THREADED_DISPATCH
+        memcpy(labels->ops, handlers, sizeof(handlers));
+        memcpy(labels->fused, fusedHandlers, sizeof(fusedHandlers));
+#endif
+        return CONT;
+    }
+
+    FILE* trace = options->trace;
+    TraceWriter* recorder = options->recorder;
+    int tracing = trace || recorder;
+    Profile* profile = options->profile;
 
-        // Print current state 
-         fprintf(outp,"%3d %3s %3d %3d %3d %3d %3d %3d ",vm->IR,opcodes[insi.op],insi.r,insi.l,insi.m,vm->PC,vm->BP,vm->SP);
+    // The text trace keeps its stack column from step to step
+    StackView* view = trace ? openStackView() : NULL;
 
-        // Print 0 for empty stack
-          fprintf(outp,"%3d",0);
-          
-        // Print out rest of the stack  
-        if(vm->SP > vm->BP)
+#if VM_THREADED_DISPATCH
+    (void)checked;
+    int observing = tracing || profile;
+    long executed[FUSED_FORMS] = { 0 };
+    long steps = 0;
+    long nextCheck = nextBudgetCheck(options, 0);
+    int flag = HALT;
+    int mark = 0;   // highest stack cell written
+    int i;
+
+    // Registers of the machine live in locals while running
+    int* RF = vm->RF;
+    int* stack = vm->stack;
+    int pc = vm->PC;
+    int bp = vm->BP;
+    int sp = vm->SP;
+    const DecodedInstruction* insi;
+
+    // Display: display[k] is the base pointer of the active frame at lexical
+    // .. level k, for k up to the current level. It replaces the static link
+    // .. walk of getBasePointer() in LOD, STO and CAL. CAL pushes the entry it
+    // .. overwrites and RTN pops it. When the display cannot follow the program
+    // .. (level -1), LOD/STO/CAL walk the links until the next RTN rebuilds it.
+    // Links overwritten by STO after the CAL are not seen by the display.
+    int display[MAX_DISPLAY_LEVELS];
+    int level = buildDisplay(stack, bp, display);
+    // Kept off the heap, since a guarded run may leave the engine by a fault
+    int maxDepth = VM_STACK_CELLS;
+    DisplaySave saves[VM_STACK_CELLS];
+    int depth = 0;
+
+    // Base pointer of the frame L levels down the static chain
+    #define BASE(L) ((L) <= level ? display[level - (L)] : getBasePointer(stack, bp, (L)))
+
+    // Write the local registers back to the virtual machine
+    #define SYNC() do { vm->PC = pc; vm->BP = bp; vm->SP = sp; } while(0)
+
+    // Fetch the instruction at pc and jump to its handler
+    #define DISPATCH() do { insi = &code[pc]; vm->IR = pc++; steps++; goto *insi->handler; } while(0)
+
+    // Trace and count the instruction at IR, which may lie past the program
+    #define OBSERVE() do { \
+            Instruction observed = vm->IR < numOfIns ? unpackInstruction(ins[vm->IR]) : (Instruction){ 0 }; \
+            if(tracing) \
+                recordStep(trace, view, recorder, vm, observed); \
+            if(profile) \
+                profileStep(profile, vm, observed); \
+        } while(0)
+
+    // Finish the current instruction: observe it if requested, then dispatch
+    #define NEXT() do { if(observing) { SYNC(); OBSERVE(); } DISPATCH(); } while(0)
+
+    // Preemption point, taken after CALs and (backward) jumps: once the
+    // .. instruction count reaches nextCheck, check the budget before going on
+    #define CHECK_BUDGET(backward) do { if(steps >= nextCheck && (backward)) goto check_budget; } while(0)
+
+    DISPATCH();
+
+    op_lit:
+        RF[insi->r] = insi->m;
+        NEXT();
+    op_rtn:
+        sp = bp - 1;
+        bp = stack[sp+3];
+        pc = stack[sp+4];
+        if(depth > 0)
+        {
+            depth--;
+            display[level] = saves[depth].previous;
+            level = saves[depth].level;
+        }
+        else
+        {
+            level = buildDisplay(stack, bp, display);
+        }
+        NEXT();
+    op_lod:
+        RF[insi->r] = stack[BASE(insi->l) + insi->m];
+        NEXT();
+    op_sto:
+    {
+        int cell = BASE(insi->l) + insi->m;
+        stack[cell] = insi->r;
+        if(cell > mark)
+            mark = cell;
+        NEXT();
+    }
+    op_cal:
+    {
+        int newLevel = level - insi->l + 1;
+        stack[sp+1] = 0;
+        stack[sp+2] = BASE(insi->l);
+        stack[sp+3] = bp;
+        stack[sp+4] = pc;
+        bp = sp+1;
+        pc = insi->m;
+        if(sp+4 > mark)
+            mark = sp+4;
+        if(insi->l <= level && newLevel < MAX_DISPLAY_LEVELS && depth < maxDepth)
+        {
+            saves[depth].level = level;
+            saves[depth].previous = display[newLevel];
+            depth++;
+            display[newLevel] = bp;
+            level = newLevel;
+        }
+        else
+        {
+            level = -1;
+            depth = 0;
+        }
+        CHECK_BUDGET(1);
+        NEXT();
+    }
+    op_inc:
+        sp = sp + insi->m;
+        NEXT();
+    op_jmp:
+        pc = insi->m;
+        CHECK_BUDGET(pc <= vm->IR);
+        NEXT();
+    op_jpc:
+        if(RF[insi->r] == 0)
+        {
+            pc = insi->m;
+            CHECK_BUDGET(pc <= vm->IR);
+        }
+        NEXT();
+    op_write:
+        writeOutputNumber(out,RF[insi->r]);
+        NEXT();
+    op_read:
+        if(inputMayWait(in))
+            flushOutputSink(out);
+        if(readInputNumber(in,&RF[insi->r]) < 0)
         {
-          fprintf(outp," | ");
-          int j;
-           fprintf(outp,"%3d",0);
-          for(j = 1;j<vm->SP; j++)
-          {
-            fprintf(outp,"%3d ",vm->stack[vm->SP]);
-          }
+            // No input yet: stop before the read, which the next run executes again
+            pc = vm->IR;
+            steps--;
+            flag = BLOCKED;
+            SYNC();
+            goto stop;
         }
-        fprintf(outp, "\n");
-  }
-  fprintf(outp,"HLT\n");
-  return;
+        NEXT();
+    op_neg:
+        RF[insi->r] = -RF[insi->l];
+        NEXT();
+    op_add:
+        RF[insi->r] = RF[insi->l] + RF[insi->m];
+        NEXT();
+    op_sub:
+        RF[insi->r] = RF[insi->l] - RF[insi->m];
+        NEXT();
+    op_mul:
+        RF[insi->r] = RF[insi->l] * RF[insi->m];
+        NEXT();
+    op_div:
+        if(!divisionDefined(RF[insi->l], RF[insi->m]))
+            goto op_illegal;
+        RF[insi->r] = RF[insi->l] / RF[insi->m];
+        NEXT();
+    op_odd:
+        RF[insi->r] = RF[insi->r] % 2;
+        NEXT();
+    op_mod:
+        if(!divisionDefined(RF[insi->l], RF[insi->m]))
+            goto op_illegal;
+        RF[insi->r] = RF[insi->l] % RF[insi->m];
+        NEXT();
+    op_eql:
+        RF[insi->r] = RF[insi->l] == RF[insi->m];
+        NEXT();
+    op_neq:
+        RF[insi->r] = RF[insi->l] != RF[insi->m];
+        NEXT();
+    op_lss:
+        RF[insi->r] = RF[insi->l] < RF[insi->m];
+        NEXT();
+    op_leq:
+        RF[insi->r] = RF[insi->l] <= RF[insi->m];
+        NEXT();
+    op_gtr:
+        RF[insi->r] = RF[insi->l] > RF[insi->m];
+        NEXT();
+    op_geq:
+        RF[insi->r] = RF[insi->l] >= RF[insi->m];
+        NEXT();
+
+    // Superinstructions: insi[k] is the k-th instruction of the sequence, and
+    // .. pc already points past the first one
+    fused_lit_lit:
+        executed[FUSED_LIT_LIT]++;
+        steps += 1;
+        RF[insi[0].r] = insi[0].m;
+        RF[insi[1].r] = insi[1].m;
+        pc += 1;
+        DISPATCH();
+
+    #define FUSED_LIT_LIT_ARITH(form, OPER) \
+        executed[form]++; \
+        steps += 2; \
+        RF[insi[0].r] = insi[0].m; \
+        RF[insi[1].r] = insi[1].m; \
+        RF[insi[2].r] = RF[insi[2].l] OPER RF[insi[2].m]; \
+        pc += 2; \
+        DISPATCH();
+
+    fused_lit_lit_add:
+        FUSED_LIT_LIT_ARITH(FUSED_LIT_LIT_ADD, +)
+    fused_lit_lit_sub:
+        FUSED_LIT_LIT_ARITH(FUSED_LIT_LIT_SUB, -)
+    fused_lit_lit_mul:
+        FUSED_LIT_LIT_ARITH(FUSED_LIT_LIT_MUL, *)
+
+    fused_lit_sto:
+        executed[FUSED_LIT_STO]++;
+        steps += 1;
+    {
+        int cell = BASE(insi[1].l) + insi[1].m;
+        RF[insi[0].r] = insi[0].m;
+        stack[cell] = insi[1].r;
+        if(cell > mark)
+            mark = cell;
+        pc += 1;
+        DISPATCH();
+    }
+    fused_lod_write:
+        executed[FUSED_LOD_WRITE]++;
+        steps += 1;
+        RF[insi[0].r] = stack[BASE(insi[0].l) + insi[0].m];
+        writeOutputNumber(out,RF[insi[1].r]);
+        pc += 1;
+        DISPATCH();
+
+    #define FUSED_LOD_LIT_CMP_JPC(form, OPER) \
+        executed[form]++; \
+        steps += 3; \
+        RF[insi[0].r] = stack[BASE(insi[0].l) + insi[0].m]; \
+        RF[insi[1].r] = insi[1].m; \
+        RF[insi[2].r] = RF[insi[2].l] OPER RF[insi[2].m]; \
+        if(RF[insi[3].r] == 0) \
+        { \
+            pc = insi[3].m; \
+            CHECK_BUDGET(pc <= vm->IR + 3); \
+        } \
+        else \
+        { \
+            pc += 3; \
+        } \
+        DISPATCH();
+
+    fused_lod_lit_eql_jpc:
+        FUSED_LOD_LIT_CMP_JPC(FUSED_LOD_LIT_EQL_JPC, ==)
+    fused_lod_lit_neq_jpc:
+        FUSED_LOD_LIT_CMP_JPC(FUSED_LOD_LIT_NEQ_JPC, !=)
+    fused_lod_lit_lss_jpc:
+        FUSED_LOD_LIT_CMP_JPC(FUSED_LOD_LIT_LSS_JPC, <)
+    fused_lod_lit_leq_jpc:
+        FUSED_LOD_LIT_CMP_JPC(FUSED_LOD_LIT_LEQ_JPC, <=)
+    fused_lod_lit_gtr_jpc:
+        FUSED_LOD_LIT_CMP_JPC(FUSED_LOD_LIT_GTR_JPC, >)
+    fused_lod_lit_geq_jpc:
+        FUSED_LOD_LIT_CMP_JPC(FUSED_LOD_LIT_GEQ_JPC, >=)
+
+    #undef FUSED_LIT_LIT_ARITH
+    #undef FUSED_LOD_LIT_CMP_JPC
+
+    // Checked path (see decodeInstructions()): RTN, LOD, STO, CAL and INC of a
+    // .. program that is not verified come here first, and run only if they
+    // .. stay inside the machine. They run without the display, which a STO
+    // .. may have made stale.
+    op_checked:
+        SYNC();
+        if(!checkInstruction(vm, unpackInstruction(ins[vm->IR]), codeMemorySize(numOfIns)))
+            goto op_illegal;
+        level = -1;
+        depth = 0;
+        goto *handlers[packedOp(ins[vm->IR])];
+
+    // Budget check of CHECK_BUDGET(). When the budget ran out, the machine stops
+    // .. between two instructions and the next run resumes it at pc.
+    check_budget:
+        if(budgetSpent(options, steps))
+        {
+            flag = PREEMPTED;
+            goto finish;
+        }
+        nextCheck = nextBudgetCheck(options, steps);
+        NEXT();
+
+    op_illegal:
+        flushOutputSink(out);
+        fprintf(stderr, "Illegal instruction?");
+    op_halt:
+    finish:
+        SYNC();
+        if(observing)
+            OBSERVE();
+    stop:
+        if(options->fusion)
+        {
+            for(i = 0; i < FUSED_FORMS; i++)
+                options->fusion->executed[i] += executed[i];
+        }
+        if(options->instructions)
+            *options->instructions += steps;
+        if(options->stackMark && mark > *options->stackMark)
+            *options->stackMark = mark;
+        closeStackView(view);
+        return flag;
+
+    #undef CHECK_BUDGET
+    #undef BASE
+    #undef NEXT
+    #undef OBSERVE
+    #undef DISPATCH
+    #undef SYNC
+#else
+    (void)code;
+    int flag = CONT;
+    long steps = 0;
+    long nextCheck = nextBudgetCheck(options, 0);
+    int codeSize = codeMemorySize(numOfIns);
+    while( flag == CONT )
+    {
+        // Fetch
+        Instruction insi = vm->PC < numOfIns ? unpackInstruction(ins[vm->PC]) : (Instruction){ 0 };
+        vm->IR = vm->PC;
+        vm->PC++; // Advance PC
+
+        // An instruction that would leave the machine is illegal on the checked path
+        if(checked && !checkInstruction(vm, insi, codeSize))
+            insi = (Instruction){ 0 };
+
+        // Execute the instruction
+        flag = executeInstruction(vm,insi,in,out);
+        if(flag == BLOCKED)
+            break;
+
+        if(tracing)
+            recordStep(trace, view, recorder, vm, insi);
+        if(profile)
+            profileStep(profile, vm, insi);
+        if(options->stackMark)
+        {
+            int cells[TRACE_MAX_DELTAS];
+            int n = stackWrites(vm, insi, cells);
+            while(n-- > 0)
+            {
+                if(cells[n] > *options->stackMark)
+                    *options->stackMark = cells[n];
+            }
+        }
+        steps++;
+
+        // Preemption point after CALs and backward jumps, see CHECK_BUDGET()
+        if(steps >= nextCheck && flag == CONT &&
+           (insi.op == 5 || ((insi.op == 7 || insi.op == 8) && vm->PC <= vm->IR)))
+        {
+            if(budgetSpent(options, steps))
+                flag = PREEMPTED;
+            nextCheck = nextBudgetCheck(options, steps);
+        }
+    }
+    if(options->instructions)
+        *options->instructions += steps;
+    closeStackView(view);
+    return flag;
+#endif
+}
+
+#if VM_THREADED_DISPATCH
+ // Decode the whole code memory for the threaded engine, so that no instruction
+ // .. pays for decoding the opcode again. Unused code memory decodes to illegal.
+ // If (fuse) is set, superinstructions replace the first instruction of every
+ // .. fused sequence and are counted in (rewrites).
+ // If (checked) is set, the program is not verified (see verify.h): instructions
+ // .. naming registers or code addresses outside the machine decode to illegal,
+ // .. those addressing the stack go through the checked path, and nothing is fused.
+ // Returns a heap array of codeMemorySize() instructions, plus an illegal one
+ // .. for falling off the end, or NULL.
+DecodedInstruction* decodeInstructions(const PackedInstruction* ins, int numOfIns, const HandlerTable* labels,
+                                       int fuse, long rewrites[FUSED_FORMS], int checked)
+{
+    int codeSize = codeMemorySize(numOfIns);
+    DecodedInstruction* code = calloc(codeSize + 1, sizeof(DecodedInstruction));
+    if(!code)
+        return NULL;
+
+    int i;
+    for(i = 0; i <= codeSize; i++)
+    {
+        code[i].handler = labels->ops[0];
+        if(i < numOfIns)
+        {
+            int op = packedOp(ins[i]);
+            if(op <= MAX_OPCODE)
+                code[i].handler = labels->ops[op];
+            if(checked && !instructionFieldsValid(unpackInstruction(ins[i]), codeSize))
+                code[i].handler = labels->ops[0];
+            else if(checked && op >= 2 && op <= 6)
+                code[i].handler = labels->ops[CHECKED_HANDLER];
+            code[i].r = packedR(ins[i]);
+            code[i].l = packedL(ins[i]);
+            code[i].m = packedM(ins[i]);
+        }
+    }
+
+    for(i = 0; fuse && !checked && i < numOfIns; i++)
+    {
+        int form = matchFusedForm(ins, i, numOfIns);
+        if(form < 0)
+            continue;
+        code[i].handler = labels->fused[form];
+        rewrites[form]++;
+        i += fusedForms[form].length - 1;
+    }
+    return code;
+}
+#endif
+
+ // Run the program on the SIO channels (in) and (out): as machine code if (jit)
+ // .. is not NULL, otherwise with runEngine(). A program that is not (verified)
+ // .. but runs without checks is guarded, and runsUnchecked() has found guard
+ // .. pages after the stack of the machine: it runs with runGuarded(). Profiled
+ // .. runs are timed and the hardware counters of the (options), if any, count
+ // .. only the run itself.
+ // Returns HALT, PREEMPTED when the budget of the (options) ran out, or BLOCKED.
+int runOnChannels(VirtualMachine* vm, const DecodedInstruction* code, const PackedInstruction* ins, int numOfIns,
+                  int verified, int checked, const JitProgram* jit, InputSource* in, OutputSink* out,
+                  const RunOptions* options)
+{
+    Profile* profile = options->profile;
+    double started = profile ? wallClock() : 0;
+    if(options->counters)
+        startPerfCounters(options->counters);
+
+    int flag;
+    if(jit)
+        flag = runJIT(jit, vm, in, out);
+    else if(!checked && !verified)
+        flag = runGuarded(vm, code, ins, numOfIns, in, out, options);
+    else
+        flag = runEngine(vm, code, ins, numOfIns, checked, in, out, options, NULL);
+
+    if(options->counters)
+        stopPerfCounters(options->counters);
+    if(profile)
+        profile->seconds += wallClock() - started;
+    return flag;
+}
+
+ // SIGSEGV and SIGBUS handler: a fault on the guard pages of the machine the
+ // .. thread is running goes back to runGuarded(); any other fault goes to the
+ // .. handler that was there before.
+static struct sigaction previousSegv, previousBus;
+
+static void stackGuardHandler(int sig, siginfo_t* info, void* context)
+{
+    StackGuard* guard = activeGuard;
+    const char* addr = info->si_addr;
+    if(guard && addr >= guard->start && addr < guard->end)
+        siglongjmp(guard->overflow, 1);
+
+    struct sigaction* previous = sig == SIGSEGV ? &previousSegv : &previousBus;
+    if(previous->sa_flags & SA_SIGINFO)
+        previous->sa_sigaction(sig, info, context);
+    else if(previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN)
+        previous->sa_handler(sig);
+    else
+        sigaction(sig, previous, NULL); // the instruction faults again, now fatally
+}
+
+ // Install stackGuardHandler() once per process.
+ // Returns 0 on success, -1 if it cannot be installed.
+static int installStackGuard(void)
+{
+    // 0: not installed, 1: being installed, 2: installed, 3: failed
+    static int state = 0;
+    int expected = 0;
+    if(__atomic_compare_exchange_n(&state, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = stackGuardHandler;
+        action.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        int ok = sigaction(SIGSEGV, &action, &previousSegv) == 0 &&
+                 sigaction(SIGBUS, &action, &previousBus) == 0;
+        __atomic_store_n(&state, ok ? 2 : 3, __ATOMIC_RELEASE);
+    }
+    while((expected = __atomic_load_n(&state, __ATOMIC_ACQUIRE)) == 1)
+        ;
+    return expected == 2 ? 0 : -1;
+}
+
+ // Bytes of the mapping of a machine up to the end of its stack, and of the guard
+ // .. pages after it: as many as the stack itself, since the furthest a
+ // .. guarded program can reach past the end in one step is a frame, which is
+ // .. smaller
+static size_t machineBytes(void)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (sizeof(VirtualMachine) + page - 1) / page * page;
+}
+
+static size_t guardBytes(void)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return ((VM_STACK_CELLS + 4) * sizeof(int) + page - 1) / page * page;
+}
+
+static void lockGuardedMachines(void)
+{
+    while(__atomic_exchange_n(&guardedLock, 1, __ATOMIC_ACQUIRE))
+    {
+        while(__atomic_load_n(&guardedLock, __ATOMIC_RELAXED))
+            sched_yield();
+    }
+}
+
+static void unlockGuardedMachines(void)
+{
+    __atomic_store_n(&guardedLock, 0, __ATOMIC_RELEASE);
+}
+
+ // Home slot of the machine at (vm) in a set of (capacity) slots
+static size_t guardedSlot(const VirtualMachine* vm, size_t capacity)
+{
+    return (size_t)(((uintptr_t)vm >> 12) * 2654435761u) & (capacity - 1);
+}
+
+ // Returns the slot of (vm), or of the empty slot where it would go.
+ // The lock must be held and the set must have room.
+static size_t findGuardedMachine(const VirtualMachine* vm)
+{
+    size_t i = guardedSlot(vm, guardedCapacity);
+    while(guardedMachines[i] && guardedMachines[i] != vm)
+        i = (i + 1) & (guardedCapacity - 1);
+    return i;
+}
+
+ // Add (vm) to the guarded machines.
+ // Returns 0 on success, -1 if the set cannot grow.
+static int addGuardedMachine(VirtualMachine* vm)
+{
+    lockGuardedMachines();
+    if((guardedCount + 1) * 2 > guardedCapacity)
+    {
+        size_t capacity = guardedCapacity ? guardedCapacity * 2 : 64;
+        VirtualMachine** machines = calloc(capacity, sizeof(VirtualMachine*));
+        if(!machines)
+        {
+            unlockGuardedMachines();
+            return -1;
+        }
+        VirtualMachine** old = guardedMachines;
+        size_t oldCapacity = guardedCapacity;
+        guardedMachines = machines;
+        guardedCapacity = capacity;
+        size_t i;
+        for(i = 0; i < oldCapacity; i++)
+        {
+            if(old[i])
+                guardedMachines[findGuardedMachine(old[i])] = old[i];
+        }
+        free(old);
+    }
+    guardedMachines[findGuardedMachine(vm)] = vm;
+    guardedCount++;
+    unlockGuardedMachines();
+    return 0;
+}
+
+ // Remove (vm) from the guarded machines.
+ // Returns 1 if it was one of them.
+static int removeGuardedMachine(const VirtualMachine* vm)
+{
+    lockGuardedMachines();
+    size_t i = guardedCapacity ? findGuardedMachine(vm) : 0;
+    if(!guardedCapacity || !guardedMachines[i])
+    {
+        unlockGuardedMachines();
+        return 0;
+    }
+
+    // Move back the machines after it that would no longer be found
+    guardedMachines[i] = NULL;
+    size_t mask = guardedCapacity - 1;
+    size_t j = (i + 1) & mask;
+    while(guardedMachines[j])
+    {
+        size_t home = guardedSlot(guardedMachines[j], guardedCapacity);
+        if(((j - home) & mask) >= ((j - i) & mask))
+        {
+            guardedMachines[i] = guardedMachines[j];
+            guardedMachines[j] = NULL;
+            i = j;
+        }
+        j = (j + 1) & mask;
+    }
+    guardedCount--;
+    unlockGuardedMachines();
+    return 1;
+}
+
+ // Returns 1 if the (v)irtual (m)achine came from createVM() with guard pages
+ // .. after its stack
+int machineGuarded(const VirtualMachine* vm)
+{
+    lockGuardedMachines();
+    int found = guardedCapacity && guardedMachines[findGuardedMachine(vm)] != NULL;
+    unlockGuardedMachines();
+    return found;
+}
+
+ // Returns 1 if a program that is (verified), or (guarded) (see verify.h), can
+ // .. run on the (v)irtual (m)achine without checks. Guarded programs need a
+ // .. machine with guard pages in its initial state, since neither a machine
+ // .. reused in another state nor a run resumed from a snapshot or a
+ // .. preemption is covered by the proof, and are checked when (observing).
+int runsUnchecked(int verified, int guarded, const VirtualMachine* vm, int observing)
+{
+    if(verified)
+        return 1;
+    int initial = vm->PC == 0 && vm->BP == 1 && vm->SP == 0;
+    return guarded && !observing && initial && machineGuarded(vm);
+}
+
+ // Run the program without checks on a (v)irtual (m)achine from createVM(),
+ // .. like runEngine(). A program that is guarded but not verified (see
+ // .. verify.h) may run its stack past the end; the first access to the guard
+ // .. pages there stops the run like an illegal instruction on the checked
+ // .. path. The machine is then left halted with IR and PC past the program,
+ // .. and the instructions of the run are not counted.
+ // Returns HALT, PREEMPTED when the budget of the (options) ran out, or BLOCKED.
+int runGuarded(VirtualMachine* vm, const DecodedInstruction* code, const PackedInstruction* ins, int numOfIns,
+               InputSource* in, OutputSink* out, const RunOptions* options)
+{
+    StackGuard guard;
+    guard.start = (const char*)(vm->stack + VM_STACK_CELLS);
+    guard.end = guard.start + guardBytes();
+    guard.outer = activeGuard;
+
+    // The mask is not saved: the handler runs with SA_NODEFER, so leaving it
+    // .. by siglongjmp() leaves SIGSEGV unblocked
+    if(sigsetjmp(guard.overflow, 0))
+    {
+        activeGuard = guard.outer;
+        flushOutputSink(out);
+        fprintf(stderr, "Illegal instruction?");
+        vm->IR = numOfIns;
+        vm->PC = numOfIns;
+        if(options->stackMark)
+            *options->stackMark = VM_STACK_CELLS - 1;
+        return HALT;
+    }
+    activeGuard = &guard;
+    int flag = runEngine(vm, code, ins, numOfIns, 0, in, out, options, NULL);
+    activeGuard = guard.outer;
+    return flag;
+}
+
+ // Run the program with SIO channels opened for this run only, see runOnChannels().
+ // Returns HALT, or PREEMPTED when the budget of the (options) ran out.
+int runWithChannels(VirtualMachine* vm, const DecodedInstruction* code, const PackedInstruction* ins, int numOfIns,
+                    int verified, int checked, const JitProgram* jit, FILE* vmIn, FILE* vmOut,
+                    const RunOptions* options)
+{
+    // SIO output is buffered for the whole run. Trace rows may go to the same
+    // .. file, so every number is passed on at once while tracing.
+    OutputSink* out = openOutputSink(vmOut);
+    if(!out)
+        return HALT;
+    out->unbuffered = options->trace || options->recorder;
+
+    // SIO input is parsed from a mapping of the file when possible
+    InputSource* in = openInputSource(vmIn);
+    if(!in)
+    {
+        closeOutputSink(out);
+        return HALT;
+    }
+
+    int flag = runOnChannels(vm, code, ins, numOfIns, verified, checked, jit, in, out, options);
+
+    closeOutputSink(out);
+    closeInputSource(in);
+    return flag;
+}
+
+ // Fetch and execute the (ins)tructions on the (v)irtual (m)achine until it halts.
+ // numOfIns is the number of valid instructions; fetching past them halts the VM
+ // .. the same way an illegal instruction does.
+ // options may be NULL, see RunOptions.
+ // If options->trace is not NULL, the state of the machine is printed to it after every step.
+ // If options->recorder is not NULL, every step is also appended to the binary trace.
+ // If options->profile is not NULL, every step is counted in it and the run is timed.
+ // If options->fuel or options->deadline is set, the run may stop early and be resumed.
+ // Programs that verifyProgram() cannot prove safe run on the checked path,
+ // .. but for guarded ones run from the start on a machine from createVM().
+ // Returns HALT, or PREEMPTED when the budget ran out.
+int runProgram(VirtualMachine* vm, const PackedInstruction* ins, int numOfIns, FILE* vmIn, FILE* vmOut, const RunOptions* options)
+{
+    static const RunOptions defaults = { 0 };
+    if(!options)
+        options = &defaults;
+
+    // Tracing and profiling see every instruction, so neither machine code
+    // .. nor superinstructions are used then
+    int observing = options->trace || options->recorder || options->profile;
+
+    // Run as machine code if requested and the program is verified and can be
+    // .. compiled. The machine code has no checks, does not count instructions
+    // .. or stack writes, and cannot be preempted.
+    // Guarded programs run without checks too, unless observed or resumed
+    // .. from a snapshot, whose state only verifyMachineState() can vouch for
+    int guarded;
+    int verified = verifyForRun(ins, numOfIns, &guarded);
+    int checked = !runsUnchecked(verified, guarded, vm, observing);
+    int counting = options->instructions || options->stackMark || options->fuel || options->deadline;
+    JitProgram* jit = options->jit && !observing && !counting && verified ? compileJIT(ins, numOfIns) : NULL;
+
+    DecodedInstruction* code = NULL;
+    long rewrites[FUSED_FORMS] = { 0 };
+#if VM_THREADED_DISPATCH
+    if(!jit)
+    {
+        HandlerTable labels;
+        runEngine(NULL, NULL, NULL, 0, 0, NULL, NULL, NULL, &labels);
+        code = decodeInstructions(ins, numOfIns, &labels, !observing && !options->noFusion, rewrites, checked);
+        if(!code)
+            return HALT;
+    }
+#endif
+
+    int flag = runWithChannels(vm, code, ins, numOfIns, verified, checked, jit, vmIn, vmOut, options);
+
+    int i;
+    for(i = 0; options->fusion && i < FUSED_FORMS; i++)
+        options->fusion->rewrites[i] += rewrites[i];
+
+    free(code);
+    freeJIT(jit);
+    return flag;
+}
+
+ // Load the program from the (inp)ut file, verify it and prepare it for every
+ // .. kind of run: decoded for the threaded engine with and without
+ // .. superinstructions, and compiled to machine code if (jit) is set and the
+ // .. JIT supports it. A program that is not verified is decoded for the
+ // .. checked path, and if it is guarded also with superinstructions, for
+ // .. runs without checks above a guard page.
+ // Returns NULL if the code file is invalid.
+VmProgram* loadProgram(FILE* inp, int jit)
+{
+    VmProgram* program = calloc(1,sizeof(VmProgram));
+    if(!program)
+        return NULL;
+    if(loadCodeMemory(inp,&program->code) != 0)
+    {
+        free(program);
+        return NULL;
+    }
+    if(program->code.snapshot)
+    {
+        fprintf(stderr, "A snapshot cannot be loaded as a program.\n");
+        freeProgram(program);
+        return NULL;
+    }
+
+    const PackedInstruction* ins = program->code.ins;
+    int numOfIns = program->code.numOfIns;
+    program->verified = verifyForRun(ins, numOfIns, &program->guarded);
+#if VM_THREADED_DISPATCH
+    int unchecked = program->verified || program->guarded;
+    HandlerTable labels;
+    runEngine(NULL, NULL, NULL, 0, 0, NULL, NULL, NULL, &labels);
+    program->plain = decodeInstructions(ins, numOfIns, &labels, 0, NULL, !program->verified);
+    if(unchecked)
+        program->fused = decodeInstructions(ins, numOfIns, &labels, 1, program->rewrites, 0);
+    if(!program->plain || (unchecked && !program->fused))
+    {
+        freeProgram(program);
+        return NULL;
+    }
+#endif
+    if(jit && program->verified)
+        program->jit = compileJIT(ins, numOfIns);
+    return program;
+}
+
+ // Verify the program for a run, storing in (guarded) whether it may run without
+ // .. checks above a guard page (see verify.h).
+ // Returns 1 if the program is verified.
+int verifyForRun(const PackedInstruction* ins, int numOfIns, int* guarded)
+{
+    VerifyReport report;
+    int verified = verifyProgram(ins, numOfIns, &report);
+    *guarded = report.guarded;
+    freeVerifyReport(&report);
+    return verified;
+}
+
+ // Release everything loadProgram() allocated
+void freeProgram(VmProgram* program)
+{
+    if(!program)
+        return;
+    free(program->plain);
+    free(program->fused);
+    freeJIT(program->jit);
+    freeCodeMemory(&program->code);
+    free(program);
+}
+
+ // Returns the instructions of the program and stores their number in numOfIns
+const PackedInstruction* programCode(const VmProgram* program, int* numOfIns)
+{
+    *numOfIns = program->code.numOfIns;
+    return program->code.ins;
+}
+
+int programVerified(const VmProgram* program)
+{
+    return program->verified;
+}
+
+ // Allocate a virtual machine in its initial state.
+ // The machine is mapped so that its stack, the last member, ends on a page
+ // .. boundary, followed by guard pages (see guardBytes()). Guarded programs can then run on it without
+ // .. checks (see runGuarded()). If the stack is not the last member, or the
+ // .. mapping or the handler cannot be set up, the machine comes from calloc()
+ // .. instead, and guarded programs run on it with checks.
+VirtualMachine* createVM(void)
+{
+    VirtualMachine* vm = NULL;
+    if(STACK_ENDS_MACHINE && installStackGuard() == 0)
+    {
+        size_t body = machineBytes();
+        size_t guard = guardBytes();
+        char* map = mmap(NULL, body + guard, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(map != MAP_FAILED)
+        {
+            vm = (VirtualMachine*)(map + body - sizeof(VirtualMachine));
+            if(mprotect(map + body, guard, PROT_NONE) != 0 || addGuardedMachine(vm) != 0)
+            {
+                munmap(map, body + guard);
+                vm = NULL;
+            }
+        }
+    }
+    if(!vm)
+        vm = calloc(1,sizeof(VirtualMachine));
+    if(vm)
+        initVM(vm);
+    return vm;
+}
+
+ // Put the (v)irtual (m)achine back into its initial state, so that it can run
+ // .. another job without being allocated again
+void resetVM(VirtualMachine* vm)
+{
+    memset(vm,0,sizeof(VirtualMachine));
+    initVM(vm);
+}
+
+ // Like resetVM(), but only clears the stack up to cell (stackMark), the highest
+ // .. one written since the machine was last reset (see RunOptions.stackMark)
+void resetVMUsed(VirtualMachine* vm, int stackMark)
+{
+    int cells = stackMark + 1 < (int)VM_STACK_CELLS ? stackMark + 1 : (int)VM_STACK_CELLS;
+    memset(vm->stack,0,cells * sizeof(vm->stack[0]));
+    memset(vm->RF,0,sizeof(vm->RF));
+    vm->BP = 0;
+    vm->SP = 0;
+    vm->PC = 0;
+    vm->IR = 0;
+    initVM(vm);
+}
+
+ // Release a machine from createVM()
+void freeVM(VirtualMachine* vm)
+{
+    if(!vm)
+        return;
+    if(removeGuardedMachine(vm))
+    {
+        size_t body = machineBytes();
+        munmap((char*)vm + sizeof(VirtualMachine) - body, body + guardBytes());
+    }
+    else
+    {
+        free(vm);
+    }
+}
+
+ // Run the loaded program on the (v)irtual (m)achine until it halts, like
+ // .. runProgram() but without decoding or compiling anything. The program is
+ // .. only read, so other threads may run it on their own machines meanwhile.
+ // Returns HALT, or PREEMPTED when the budget of the (options) ran out.
+int runLoadedProgram(const VmProgram* program, VirtualMachine* vm, FILE* vmIn, FILE* vmOut, const RunOptions* options)
+{
+    static const RunOptions defaults = { 0 };
+    if(!options)
+        options = &defaults;
+
+    const JitProgram* jit;
+    int checked;
+    const DecodedInstruction* code = selectLoadedCode(program, vm, options, 0, &jit, &checked);
+    return runWithChannels(vm, code, program->code.ins, program->code.numOfIns, program->verified,
+                           checked, jit, vmIn, vmOut, options);
+}
+
+ // Run the loaded program like runLoadedProgram() on SIO channels the caller
+ // .. owns and keeps between runs. An SIO read that has to wait for input
+ // .. stops the run, see vm_engine.h.
+ // Returns HALT, PREEMPTED when the budget of the (options) ran out, or BLOCKED.
+int runLoadedProgramWithChannels(const VmProgram* program, VirtualMachine* vm,
+                                 InputSource* in, OutputSink* out, const RunOptions* options)
+{
+    static const RunOptions defaults = { 0 };
+    if(!options)
+        options = &defaults;
+
+    const JitProgram* jit;
+    int checked;
+    const DecodedInstruction* code = selectLoadedCode(program, vm, options, in->more, &jit, &checked);
+    return runOnChannels(vm, code, program->code.ins, program->code.numOfIns, program->verified,
+                         checked, jit, in, out, options);
+}
+
+ // Choose how the loaded (program) runs with the (options): returns the decoded
+ // .. code for runEngine(), with or without superinstructions, and stores the
+ // .. machine code to run instead, if any, in (jit). Machine code is not used if
+ // .. SIO read may have to wait for input (blocking), which it cannot do.
+ // Stores 1 in (checked) if the run on the (v)irtual (m)achine needs the checked
+ // .. path, see runsUnchecked().
+const DecodedInstruction* selectLoadedCode(const VmProgram* program, const VirtualMachine* vm,
+                                           const RunOptions* options, int blocking,
+                                           const JitProgram** jit, int* checked)
+{
+    int observing = options->trace || options->recorder || options->profile;
+    int counting = options->instructions || options->stackMark || options->fuel || options->deadline;
+    *jit = options->jit && !observing && !counting && !blocking ? program->jit : NULL;
+    *checked = !runsUnchecked(program->verified, program->guarded, vm, observing);
+    int fuse = !*jit && !observing && !options->noFusion && !*checked;
+
+    int i;
+    for(i = 0; fuse && options->fusion && i < FUSED_FORMS; i++)
+        options->fusion->rewrites[i] += program->rewrites[i];
+    return fuse ? program->fused : program->plain;
+}
+
+ // Load the program from the (in)put file into code memory.
+ // Bytecode files (see bytecode.h) and snapshots (see snapshot.h) are used in
+ // .. place; text code files are read with readInstructions() into an array
+ // .. of packed instructions that grows with the program.
+ // Returns 0 on success, -1 if the code file is invalid.
+int loadCodeMemory(FILE* in, CodeMemory* code)
+{
+    code->text = NULL;
+    code->image = NULL;
+    code->snapshot = NULL;
+
+    if(isSnapshot(in))
+    {
+        code->snapshot = openSnapshot(in);
+        if(!code->snapshot)
+            return -1;
+        code->ins = code->snapshot->code;
+        code->numOfIns = code->snapshot->header->numOfIns;
+        return 0;
+    }
+
+    if(isBytecode(in))
+    {
+        code->image = openBytecode(in);
+        if(!code->image)
+            return -1;
+        code->ins = code->image->code;
+        code->numOfIns = code->image->header->numOfIns;
+        return 0;
+    }
+
+    // Read the instructions into an array that grows with the program
+    code->numOfIns = readInstructions(in,&code->text);
+    code->ins = code->text;
+    if(code->numOfIns < 0)
+    {
+        freeCodeMemory(code);
+        return -1;
+    }
+    return 0;
+}
+
+ // Release the code memory filled by loadCodeMemory()
+void freeCodeMemory(CodeMemory* code)
+{
+    free(code->text);
+    closeBytecode(code->image);
+    closeSnapshot(code->snapshot);
+}
+
+ // Put the new (v)irtual (m)achine into the state the (code) starts from: the
+ // .. initial one, or the one saved in the snapshot the code was loaded from.
+ // The SIO output of the snapshot is written to (vmOut) again, and the SIO
+ // .. input it had read is skipped in (vmIn), so that a resumed run given the
+ // .. whole input prints what a run from the start would.
+ // Returns 0, or -1 if the state of the snapshot is not one the program can
+ // .. reach, which would break the assumptions of the unchecked fast path, or
+ // .. if the input ends before the position of the snapshot.
+int startMachine(VirtualMachine* vm, const CodeMemory* code, FILE* vmIn, FILE* vmOut)
+{
+    initVM(vm);
+    SnapshotImage* snapshot = code->snapshot;
+    if(!snapshot)
+        return 0;
+
+    restoreSnapshot(snapshot, vm);
+    if(verifyProgram(code->ins, code->numOfIns, NULL) && !verifyMachineState(code->ins, code->numOfIns, vm))
+    {
+        fprintf(stderr, "The snapshot does not hold a state of its program.\n");
+        return -1;
+    }
+    // Streams that cannot seek (pipes, terminals) are read past the input
+    uint64_t skip = snapshot->header->inputOffset;
+    if(skip && fseeko(vmIn, (off_t)skip, SEEK_CUR) != 0)
+    {
+        while(skip > 0 && getc(vmIn) != EOF)
+            skip--;
+        if(skip > 0)
+        {
+            fprintf(stderr, "The input ends before the position of the snapshot.\n");
+            return -1;
+        }
+    }
+    if(snapshot->header->outputSize)
+        fwrite(snapshot->output, 1, snapshot->header->outputSize, vmOut);
+    return 0;
+}
+
+/**
+ * inp: The FILE pointer containing the list of instructions to
+ *         be loaded to code memory of the virtual machine. Either the
+ *         text format or a bytecode file (see bytecode.h), or a
+ *         snapshot to resume from (see snapshot.h).
+ * 
+ * outp: The FILE pointer to write the simulation output, which
+ *       contains both code memory and execution history.
+ * 
+ * vm_inp: The FILE pointer that is going to be attached as the input
+ *         stream to the virtual machine. Useful to feed input for SIO
+ *         instructions.
+ * 
+ * vm_outp: The FILE pointer that is going to be attached as the output
+ *          stream to the virtual machine. Useful to save the output printed
+ *          by SIO instructions.
+ * 
+ * Passing NULL as outp skips the code memory dump and the execution history,
+ * which makes this the same as runVM().
+ * */
+void simulateVM(
+    FILE* inp,
+    FILE* outp,
+    FILE* vm_inp,
+    FILE* vm_outp
+    )
+{
+    if(!outp)
+    {
+        runVM(inp,vm_inp,vm_outp);
+        return;
+    }
+
+    CodeMemory code;
+    if(loadCodeMemory(inp,&code) != 0)
+        return;
+
+    // Dump instructions to the output file
+    dumpInstructions(outp,code.ins,code.numOfIns);
+
+    // Before starting the code execution on the virtual machine,
+    // .. write the header for the simulation part (***Execution***)
+    dumpExecutionHeader(outp);
+
+    // Create a virtual machine, initilize values to 0(BP to 1), or to the
+    // .. state saved in the snapshot
+    VirtualMachine* vm = createVM();
+    if(!vm || startMachine(vm,&code,vm_inp,vm_outp) != 0)
+    {
+        freeVM(vm);
+        freeCodeMemory(&code);
+        return;
+    }
+
+    // Fetch&Execute the instructions on the virtual machine until halting,
+    // .. printing the state after every step
+    RunOptions options = { .trace = outp };
+    runProgram(vm,code.ins,code.numOfIns,vm_inp,vm_outp,&options);
+
+    fprintf(outp,"HLT\n");
+
+    freeVM(vm);
+    freeCodeMemory(&code);
+}
+
+/**
+ * Production entry point: runs the program without any tracing.
+ * 
+ * inp: The FILE pointer containing the list of instructions to
+ *      be loaded to code memory of the virtual machine.
+ * 
+ * vm_inp, vm_outp: Input and output streams of the SIO instructions,
+ *                  as in simulateVM().
+ * */
+void runVM(FILE* inp, FILE* vm_inp, FILE* vm_outp)
+{
+    runVMWithOptions(inp,vm_inp,vm_outp,NULL);
+}
+
+/**
+ * Runs the program like runVM() with the given options (see RunOptions).
+ * options may be NULL.
+ * */
+void runVMWithOptions(FILE* inp, FILE* vm_inp, FILE* vm_outp, const RunOptions* options)
+{
+    CodeMemory code;
+    if(loadCodeMemory(inp,&code) != 0)
+        return;
+
+    VirtualMachine* vm = createVM();
+    if(!vm || startMachine(vm,&code,vm_inp,vm_outp) != 0)
+    {
+        freeVM(vm);
+        freeCodeMemory(&code);
+        return;
+    }
+
+    runProgram(vm,code.ins,code.numOfIns,vm_inp,vm_outp,options);
+
+    freeVM(vm);
+    freeCodeMemory(&code);
+}
+
+/**
+ * Runs the program like runVM(), recording the execution history as a binary
+ * trace (see vm_trace.h) instead of text. trace_render prints it in the same
+ * layout as simulateVM().
+ * 
+ * traceOut: The FILE pointer, opened in binary mode, to write the trace to.
+ * */
+void recordVM(FILE* inp, FILE* traceOut, FILE* vm_inp, FILE* vm_outp)
+{
+    CodeMemory code;
+    if(loadCodeMemory(inp,&code) != 0)
+        return;
+
+    // Traces are replayed from an empty stack
+    if(code.snapshot)
+    {
+        fprintf(stderr, "Runs resumed from a snapshot cannot be recorded.\n");
+        freeCodeMemory(&code);
+        return;
+    }
+
+    TraceWriter* recorder = openTraceWriter(traceOut);
+    if(!recorder)
+    {
+        freeCodeMemory(&code);
+        return;
+    }
+
+    VirtualMachine* vm = createVM();
+    if(!vm)
+    {
+        closeTraceWriter(recorder);
+        freeCodeMemory(&code);
+        return;
+    }
+
+    RunOptions options = { .recorder = recorder };
+    runProgram(vm,code.ins,code.numOfIns,vm_inp,vm_outp,&options);
+
+    if(closeTraceWriter(recorder) != 0)
+        fprintf(stderr, "Cannot write the execution trace.\n");
+
+    freeVM(vm);
+    freeCodeMemory(&code);
+}
+
+/**
+ * Runs the program like runVM() with the profiler on, then writes the profile
+ * report (see printProfileReport()) to reportOut.
+ * 
+ * reportOut: The FILE pointer to write the report to.
+ * */
+void profileVM(FILE* inp, FILE* reportOut, FILE* vm_inp, FILE* vm_outp)
+{
+    CodeMemory code;
+    if(loadCodeMemory(inp,&code) != 0)
+        return;
+
+    VirtualMachine* vm = createVM();
+    if(!vm || startMachine(vm,&code,vm_inp,vm_outp) != 0)
+    {
+        freeVM(vm);
+        freeCodeMemory(&code);
+        return;
+    }
+
+    Profile* profile = createProfile(code.numOfIns);
+    if(!profile)
+    {
+        freeVM(vm);
+        freeCodeMemory(&code);
+        return;
+    }
+    RunOptions options = { .profile = profile };
+    runProgram(vm,code.ins,code.numOfIns,vm_inp,vm_outp,&options);
+
+    printProfileReport(reportOut,profile,code.ins,code.numOfIns);
+
+    freeProfile(profile);
+    freeVM(vm);
+    freeCodeMemory(&code);
+}
+
+/**
+ * Runs the program until its first SIO read and saves the machine as a
+ * snapshot (see snapshot.h), from which runVM() and simulateVM() resume.
+ * 
+ * inp: The FILE pointer containing the list of instructions, as in runVM().
+ * 
+ * snapshotOut: The FILE pointer, opened in binary mode, to write the snapshot to.
+ * 
+ * Returns 0 on success, -1 if no snapshot was written.
+ * */
+int checkpointVM(FILE* inp, FILE* snapshotOut)
+{
+    VmProgram* program = loadProgram(inp,0);
+    if(!program)
+        return -1;
+
+    // SIO output is collected for the snapshot
+    char* output = NULL;
+    size_t outputSize = 0;
+    FILE* capture = open_memstream(&output,&outputSize);
+    OutputSink* out = capture ? openOutputSink(capture) : NULL;
+    VirtualMachine* vm = createVM();
+
+    int status = -1;
+    if(out && vm)
+    {
+        // With no input yet and more to come, the first SIO read stops the run
+        // .. before it executes (see InputSource.more)
+        InputSource in;
+        initInputBuffer(&in,NULL,0,1);
+        int flag = runLoadedProgramWithChannels(program,vm,&in,out,NULL);
+        flushOutputSink(out);
+        fflush(capture);
+
+        int numOfIns;
+        const PackedInstruction* ins = programCode(program,&numOfIns);
+        if(flag != BLOCKED)
+            fprintf(stderr, "The program halted before reading input.\n");
+        else if(writeSnapshot(snapshotOut,vm,ins,numOfIns,in.base ? in.next - in.base : 0,output,outputSize) != 0)
+            fprintf(stderr, "Cannot write the snapshot.\n");
+        else
+            status = 0;
+    }
+
+    closeOutputSink(out);
+    if(capture)
+        fclose(capture);
+    free(output);
+    freeVM(vm);
+    freeProgram(program);
+    return status;
 }
@@ -0,0 +1,59 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program translates a text code file or a bytecode file into a
+* .. standalone C program (see aot.h)
+*
+* Usage: vm2c <code file> [C file]
+* Build: link with aot.c, vm.c, vm_trace.c, vm_output.c, vm_input.c, bytecode.c, jit.c,
+*        verify.c, snapshot.c and vm_perf.c
+*        then: cc -O2 -o program program.c
+*/
+
+#include <stdio.h>
+#include "vm_engine.h"
+#include "aot.h"
+
+int main(int argc, char** argv)
+{
+    if(argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "Usage: %s <code file> [C file]\n", argv[0]);
+        return 1;
+    }
+
+    FILE* in = fopen(argv[1], "rb");
+    if(!in)
+    {
+        fprintf(stderr, "Cannot open %s.\n", argv[1]);
+        return 1;
+    }
+
+    CodeMemory code;
+    int status = loadCodeMemory(in, &code);
+    fclose(in);
+    if(status != 0)
+        return 1;
+
+    // The C file goes to stdout unless a name is given
+    FILE* out = argc > 2 ? fopen(argv[2], "w") : stdout;
+    if(!out)
+    {
+        fprintf(stderr, "Cannot open %s.\n", argv[2]);
+        freeCodeMemory(&code);
+        return 1;
+    }
+
+    status = translateToC(out, code.ins, code.numOfIns);
+    if(out != stdout)
+        fclose(out);
+    freeCodeMemory(&code);
+
+    // The C file may be on stdout, so the verdict goes to stderr
+    if(status == 0)
+        fprintf(stderr, "Verified: translated without checks.\n");
+    else if(status == 1)
+        fprintf(stderr, "Not verified: translated with checks on the stack instructions.\n");
+
+    return status < 0;
+}
@@ -0,0 +1,547 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program runs a batch of virtual machine jobs on a pool of threads
+*
+* Usage: vm_batch [-t threads] [-l] <manifest> [results file]
+* Build: link with vm.c, vm_trace.c, vm_output.c, vm_input.c, bytecode.c, jit.c,
+*        verify.c, snapshot.c, vm_perf.c, vm_lanes.c and -lpthread
+*
+* Every line of the manifest is one job: a code file (text or bytecode), the
+* .. file read by SIO read and the file written by SIO write. Blank lines and
+* .. lines starting with '#' are skipped.
+*
+*     <code file> <input file> <output file>
+*
+* Each distinct code file is loaded and decoded once (see loadProgram()).
+* With -l, jobs of the same verified program run VM_LANES at a time in
+* .. lockstep (see vm_lanes.h); every job of such a group reports the wall time
+* .. of the whole group.
+* The results file (stdout by default) gets one line per job, in manifest
+* .. order: job number, exit status, instructions executed and wall time.
+* Exit status: 0 halted by SIO halt, 1 illegal instruction, 2 the job could
+* .. not be started. Throughput and latency percentiles go to stderr.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "vm_engine.h"
+#include "vm_lanes.h"
+
+// Longest path accepted in the manifest
+#define BATCH_MAX_PATH 1024
+
+// Exit status of a job
+enum { JOB_HALTED, JOB_ILLEGAL, JOB_FAILED };
+
+typedef struct
+{
+    char* code;             // paths from the manifest
+    char* input;
+    char* output;
+    VmProgram* program;     // shared with every job of the same code file
+    int status;
+    long instructions;
+    double seconds;
+} Job;
+
+// Jobs run by one worker at a time: a single job, or jobs of one program
+// .. that run in lockstep
+typedef struct
+{
+    int jobs[VM_LANES];
+    int numOfJobs;
+} Task;
+
+// Tasks of one worker. The owner takes from the back, idle workers steal
+// .. from the front.
+typedef struct
+{
+    pthread_mutex_t lock;
+    int* tasks;
+    int front;
+    int back;
+} WorkQueue;
+
+typedef struct
+{
+    Job* jobs;
+    Task* tasks;
+    WorkQueue* queues;
+    int numOfQueues;
+} Pool;
+
+typedef struct
+{
+    Pool* pool;
+    int id;
+} Worker;
+
+// Take the task at the back of the worker's own queue, or -1 if it is empty
+static int takeTask(WorkQueue* queue)
+{
+    int task = -1;
+    pthread_mutex_lock(&queue->lock);
+    if(queue->front < queue->back)
+        task = queue->tasks[--queue->back];
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+// Take the task at the front of another worker's queue, or -1 if it is empty
+static int stealTask(WorkQueue* queue)
+{
+    int task = -1;
+    pthread_mutex_lock(&queue->lock);
+    if(queue->front < queue->back)
+        task = queue->tasks[queue->front++];
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+// Run one job on the worker's machine and fill in its results. The machine
+// .. is left in its initial state for the next job.
+static void runJob(Job* job, VirtualMachine* vm)
+{
+    double started = wallClock();
+    job->status = JOB_FAILED;
+    if(!job->program)
+        return;
+
+    FILE* in = fopen(job->input, "r");
+    FILE* out = fopen(job->output, "w");
+    if(in && out)
+    {
+        int stackMark = 0;
+        RunOptions options = { .instructions = &job->instructions, .stackMark = &stackMark };
+        runLoadedProgram(job->program, vm, in, out, &options);
+
+        // Only SIO halt (opcode 11) ends a run normally
+        int numOfIns;
+        const PackedInstruction* ins = programCode(job->program, &numOfIns);
+        int halted = vm->IR >= 0 && vm->IR < numOfIns && packedOp(ins[vm->IR]) == 11;
+        job->status = halted ? JOB_HALTED : JOB_ILLEGAL;
+
+        // Short jobs only clear the stack cells they wrote
+        resetVMUsed(vm, stackMark);
+    }
+    else
+    {
+        fprintf(stderr, "Cannot open %s.\n", in ? job->output : job->input);
+    }
+
+    if(in)
+        fclose(in);
+    if(out && fclose(out) != 0)
+        job->status = JOB_FAILED;
+    job->seconds = wallClock() - started;
+}
+
+// Run the jobs of the task in lockstep; jobs whose files cannot be opened are
+// .. left out. Falls back to one job at a time if the lanes cannot run.
+static void runLaneJobs(Job* jobs, const Task* task, VirtualMachine* vm)
+{
+    double started = wallClock();
+    Lane lanes[VM_LANES];
+    Job* members[VM_LANES];
+    FILE* ins[VM_LANES];
+    FILE* outs[VM_LANES];
+    int n = 0;
+    int i;
+
+    for(i = 0; i < task->numOfJobs; i++)
+    {
+        Job* job = &jobs[task->jobs[i]];
+        job->status = JOB_FAILED;
+        FILE* in = fopen(job->input, "r");
+        FILE* out = fopen(job->output, "w");
+        InputSource* source = in ? openInputSource(in) : NULL;
+        OutputSink* sink = out ? openOutputSink(out) : NULL;
+        if(!source || !sink)
+        {
+            fprintf(stderr, "Cannot open %s.\n", in ? job->output : job->input);
+            if(source)
+                closeInputSource(source);
+            if(sink)
+                closeOutputSink(sink);
+            if(in)
+                fclose(in);
+            if(out)
+                fclose(out);
+            job->seconds = wallClock() - started;
+            continue;
+        }
+        members[n] = job;
+        ins[n] = in;
+        outs[n] = out;
+        lanes[n] = (Lane){ source, sink, LANE_ILLEGAL, 0 };
+        n++;
+    }
+
+    int status = n > 0 ? runLanes(members[0]->program, lanes, n) : 0;
+
+    double seconds = wallClock() - started;
+    for(i = 0; i < n; i++)
+    {
+        Job* job = members[i];
+        job->status = lanes[i].status == LANE_HALTED ? JOB_HALTED : JOB_ILLEGAL;
+        job->instructions = lanes[i].instructions;
+        job->seconds = seconds;
+        closeInputSource(lanes[i].in);
+        fclose(ins[i]);
+        if(closeOutputSink(lanes[i].out) != 0)
+            job->status = JOB_FAILED;
+        if(fclose(outs[i]) != 0)
+            job->status = JOB_FAILED;
+    }
+
+    if(status != 0)
+        for(i = 0; i < n; i++)
+            runJob(members[i], vm);
+}
+
+static void* workerMain(void* argument)
+{
+    Worker* worker = argument;
+    Pool* pool = worker->pool;
+    VirtualMachine* vm = createVM();
+    if(!vm)
+        return NULL;
+
+    for(;;)
+    {
+        int task = takeTask(&pool->queues[worker->id]);
+
+        // Own queue is empty: steal, starting with the next worker
+        int k;
+        for(k = 1; task < 0 && k < pool->numOfQueues; k++)
+            task = stealTask(&pool->queues[(worker->id + k) % pool->numOfQueues]);
+
+        // Tasks are never added, so empty queues everywhere means done
+        if(task < 0)
+            break;
+        if(pool->tasks[task].numOfJobs == 1)
+            runJob(&pool->jobs[pool->tasks[task].jobs[0]], vm);
+        else
+            runLaneJobs(pool->jobs, &pool->tasks[task], vm);
+    }
+
+    freeVM(vm);
+    return NULL;
+}
+
+static void freeJobs(Job* jobs, int numOfJobs)
+{
+    int i;
+    for(i = 0; i < numOfJobs; i++)
+    {
+        free(jobs[i].code);
+        free(jobs[i].input);
+        free(jobs[i].output);
+    }
+    free(jobs);
+}
+
+// Read the manifest into a heap array of jobs.
+// Returns the number of jobs, or -1 if a line is malformed or memory runs out.
+static int readManifest(FILE* in, Job** jobs)
+{
+    char line[3 * BATCH_MAX_PATH + 16];
+    char code[BATCH_MAX_PATH], input[BATCH_MAX_PATH], output[BATCH_MAX_PATH];
+    int capacity = 64;
+    int numOfJobs = 0;
+    int lineNumber = 0;
+    *jobs = malloc(capacity * sizeof(Job));
+    if(!*jobs)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), in))
+    {
+        lineNumber++;
+        char first[2];
+        if(sscanf(line, " %1s", first) != 1 || first[0] == '#')
+            continue;
+        if(sscanf(line, "%1023s %1023s %1023s", code, input, output) != 3)
+        {
+            fprintf(stderr, "Manifest line %d: expected <code file> <input file> <output file>.\n", lineNumber);
+            freeJobs(*jobs, numOfJobs);
+            return -1;
+        }
+
+        if(numOfJobs == capacity)
+        {
+            Job* grown = realloc(*jobs, capacity * 2 * sizeof(Job));
+            if(!grown)
+            {
+                fprintf(stderr, "Out of memory.\n");
+                freeJobs(*jobs, numOfJobs);
+                return -1;
+            }
+            *jobs = grown;
+            capacity *= 2;
+        }
+        Job* job = &(*jobs)[numOfJobs++];
+        memset(job, 0, sizeof(Job));
+        job->status = JOB_FAILED;
+        job->code = strdup(code);
+        job->input = strdup(input);
+        job->output = strdup(output);
+        if(!job->code || !job->input || !job->output)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            freeJobs(*jobs, numOfJobs);
+            return -1;
+        }
+    }
+    return numOfJobs;
+}
+
+// Orders job indices by code file, so that jobs sharing one are adjacent
+static Job* sortedJobs;
+static int compareCodeFiles(const void* a, const void* b)
+{
+    return strcmp(sortedJobs[*(const int*)a].code, sortedJobs[*(const int*)b].code);
+}
+
+// Load every distinct code file once and point its jobs at it.
+// Returns the number of programs loaded, or -1 if memory runs out first.
+static int loadPrograms(Job* jobs, int numOfJobs, VmProgram** programs)
+{
+    int* order = malloc((numOfJobs ? numOfJobs : 1) * sizeof(int));
+    if(!order)
+        return -1;
+    int i, n = 0;
+    for(i = 0; i < numOfJobs; i++)
+        order[i] = i;
+    sortedJobs = jobs;
+    qsort(order, numOfJobs, sizeof(int), compareCodeFiles);
+
+    for(i = 0; i < numOfJobs; i++)
+    {
+        Job* job = &jobs[order[i]];
+        if(i > 0 && strcmp(job->code, jobs[order[i - 1]].code) == 0)
+        {
+            job->program = jobs[order[i - 1]].program;
+            continue;
+        }
+
+        FILE* in = fopen(job->code, "rb");
+        if(!in)
+        {
+            fprintf(stderr, "Cannot open %s.\n", job->code);
+            continue;
+        }
+        job->program = loadProgram(in, 0);
+        fclose(in);
+        if(job->program)
+            programs[n++] = job->program;
+    }
+    free(order);
+    return n;
+}
+
+// Make the tasks of the batch, in manifest order. With lanes, jobs of the same
+// .. verified program share a task until it is full.
+// Returns the number of tasks, or -1 if memory runs out.
+static int makeTasks(const Job* jobs, int numOfJobs, int lanes, Task* tasks)
+{
+    int* open = malloc((numOfJobs ? numOfJobs : 1) * sizeof(int));
+    if(!open)
+        return -1;
+    int numOfOpen = 0;
+    int numOfTasks = 0;
+    int i, k;
+    for(i = 0; i < numOfJobs; i++)
+    {
+        const VmProgram* program = jobs[i].program;
+        Task* task = NULL;
+        if(lanes && program && programVerified(program))
+        {
+            for(k = 0; k < numOfOpen && !task; k++)
+                if(jobs[tasks[open[k]].jobs[0]].program == program)
+                    task = &tasks[open[k]];
+            if(!task)
+                open[numOfOpen++] = numOfTasks;
+        }
+        if(!task)
+        {
+            task = &tasks[numOfTasks++];
+            task->numOfJobs = 0;
+        }
+        task->jobs[task->numOfJobs++] = i;
+
+        // A full task is closed
+        if(task->numOfJobs == VM_LANES)
+            for(k = 0; k < numOfOpen; k++)
+                if(&tasks[open[k]] == task)
+                    open[k] = open[--numOfOpen];
+    }
+    free(open);
+    return numOfTasks;
+}
+
+static int compareSeconds(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Print throughput and the latency distribution of the jobs
+static void printSummary(FILE* out, const Job* jobs, int numOfJobs, int threads, double seconds)
+{
+    double* latencies = malloc((numOfJobs ? numOfJobs : 1) * sizeof(double));
+    long instructions = 0;
+    int failed = 0;
+    int i;
+    for(i = 0; i < numOfJobs; i++)
+    {
+        if(latencies)
+            latencies[i] = jobs[i].seconds;
+        instructions += jobs[i].instructions;
+        failed += jobs[i].status != JOB_HALTED;
+    }
+    if(latencies)
+        qsort(latencies, numOfJobs, sizeof(double), compareSeconds);
+
+    fprintf(out, "***Batch***\n");
+    fprintf(out, "%-16s %12d \n", "jobs", numOfJobs);
+    fprintf(out, "%-16s %12d \n", "not halted", failed);
+    fprintf(out, "%-16s %12d \n", "threads", threads);
+    fprintf(out, "%-16s %12.6f \n", "seconds", seconds);
+    fprintf(out, "%-16s %12.1f \n", "jobs/s", seconds > 0 ? numOfJobs / seconds : 0);
+    fprintf(out, "%-16s %12.0f \n", "instructions/s", seconds > 0 ? instructions / seconds : 0);
+
+    // Nearest-rank percentiles of the job wall times
+    static const double percentiles[] = { 50, 90, 99, 99.9, 100 };
+    for(i = 0; latencies && numOfJobs > 0 && i < (int)(sizeof(percentiles) / sizeof(percentiles[0])); i++)
+    {
+        int rank = (int)(percentiles[i] / 100 * numOfJobs + 0.999999);
+        if(rank < 1)
+            rank = 1;
+        char name[24];
+        snprintf(name, sizeof(name), "p%g ms", percentiles[i]);
+        fprintf(out, "%-16s %12.3f \n", name, latencies[rank - 1] * 1000);
+    }
+    free(latencies);
+}
+
+int main(int argc, char** argv)
+{
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int lanes = 0;
+    int arg = 1;
+    if(arg + 1 < argc && strcmp(argv[arg], "-t") == 0)
+    {
+        threads = atoi(argv[arg + 1]);
+        arg += 2;
+    }
+    if(arg < argc && strcmp(argv[arg], "-l") == 0)
+    {
+        lanes = 1;
+        arg++;
+    }
+    if(argc - arg < 1 || argc - arg > 2 || threads < 1)
+    {
+        fprintf(stderr, "Usage: %s [-t threads] [-l] <manifest> [results file]\n", argv[0]);
+        return 1;
+    }
+
+    FILE* manifest = fopen(argv[arg], "r");
+    if(!manifest)
+    {
+        fprintf(stderr, "Cannot open %s.\n", argv[arg]);
+        return 1;
+    }
+    Job* jobs;
+    int numOfJobs = readManifest(manifest, &jobs);
+    fclose(manifest);
+    if(numOfJobs < 0)
+        return 1;
+
+    FILE* results = argc - arg > 1 ? fopen(argv[arg + 1], "w") : stdout;
+    if(!results)
+    {
+        fprintf(stderr, "Cannot open %s.\n", argv[arg + 1]);
+        freeJobs(jobs, numOfJobs);
+        return 1;
+    }
+
+    double started = wallClock();
+    VmProgram** programs = malloc((numOfJobs ? numOfJobs : 1) * sizeof(VmProgram*));
+    int numOfPrograms = programs ? loadPrograms(jobs, numOfJobs, programs) : -1;
+
+    Task* tasks = malloc((numOfJobs ? numOfJobs : 1) * sizeof(Task));
+    int numOfTasks = tasks ? makeTasks(jobs, numOfJobs, lanes, tasks) : -1;
+
+    // Deal the tasks out round-robin; stealing evens out the rest
+    if(threads > numOfTasks && numOfTasks > 0)
+        threads = numOfTasks;
+    Pool pool = { jobs, tasks, calloc(threads, sizeof(WorkQueue)), threads };
+    pthread_t* ids = malloc(threads * sizeof(pthread_t));
+    Worker* workers = malloc(threads * sizeof(Worker));
+    int ready = numOfPrograms >= 0 && numOfTasks >= 0 && pool.queues && ids && workers;
+    int i;
+    for(i = 0; pool.queues && i < threads; i++)
+    {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+        pool.queues[i].tasks = malloc((numOfTasks / threads + 1) * sizeof(int));
+        ready = ready && pool.queues[i].tasks;
+    }
+    if(!ready)
+        fprintf(stderr, "Out of memory.\n");
+    for(i = numOfTasks - 1; ready && i >= 0; i--)
+    {
+        WorkQueue* queue = &pool.queues[i % threads];
+        queue->tasks[queue->back++] = i;
+    }
+
+    // Workers that cannot be started leave their tasks to be stolen
+    int running = 0;
+    for(i = 0; ready && i < threads; i++)
+    {
+        workers[i] = (Worker){ &pool, i };
+        if(pthread_create(&ids[running], NULL, workerMain, &workers[i]) == 0)
+            running++;
+    }
+    if(ready && running == 0)
+    {
+        fprintf(stderr, "Cannot start the worker threads.\n");
+        ready = 0;
+    }
+    for(i = 0; i < running; i++)
+        pthread_join(ids[i], NULL);
+    double seconds = wallClock() - started;
+
+    int failed = !ready;
+    for(i = 0; ready && i < numOfJobs; i++)
+    {
+        failed |= jobs[i].status != JOB_HALTED;
+        fprintf(results, "%d %d %ld %.3f\n", i, jobs[i].status, jobs[i].instructions, jobs[i].seconds * 1000);
+    }
+    if(results != stdout)
+        fclose(results);
+    if(ready)
+        printSummary(stderr, jobs, numOfJobs, running, seconds);
+
+    for(i = 0; i < numOfPrograms; i++)
+        freeProgram(programs[i]);
+    for(i = 0; pool.queues && i < threads; i++)
+    {
+        pthread_mutex_destroy(&pool.queues[i].lock);
+        free(pool.queues[i].tasks);
+    }
+    freeJobs(jobs, numOfJobs);
+    free(tasks);
+    free(pool.queues);
+    free(ids);
+    free(workers);
+    free(programs);
+    return failed;
+}
@@ -0,0 +1,666 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program measures the speed of the virtual machine
+*
+* Usage: vm_bench [-s seconds] [-f filter] [-w results file] [-b baseline file] [-t tolerance]
+* Build: link with CodeGeneration.c, lexical_analyzer.c, aot.c, vm.c, vm_trace.c,
+*        vm_output.c, vm_input.c, bytecode.c, jit.c, verify.c, snapshot.c and
+*        vm_perf.c
+*
+* Micro benchmarks repeat one kind of instruction in a loop: dispatch (NEG),
+* .. arithmetic and comparisons, LOD and STO at lexical levels 0 to 3, CAL/RTN
+* .. round trips, and SIO write and read. Macro benchmarks run the hard-coded
+* .. programs T0() to T5() of CodeGeneration.c and generated programs: deep
+* .. recursion, a long loop shaped like compiled code and many small
+* .. procedures. -f runs only the benchmarks whose name contains the filter.
+*
+* Every benchmark runs on each engine that accepts it: the threaded engine
+* .. with superinstructions (interp) and without (nofuse), and the JIT. Runs
+* .. are repeated for at least the given seconds (default 0.2) and the fastest
+* .. one counts. The report gives ns/instruction, instructions/s and the peak
+* .. RSS of the process. T0() to T5() run a few dozen instructions, so their
+* .. time includes starting the run.
+*
+* -w writes the results as JSON, one benchmark per line. -b compares the run
+* .. with such a file: a benchmark whose ns/instruction grew by more than the
+* .. tolerance (in percent, default 10) is flagged, and the exit status is 2.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "vm_engine.h"
+#include "jit.h"
+
+// CodeGeneration.c
+extern PackedInstruction* vmCode;
+extern int nextCodeIndex;
+void T0();
+void T1();
+void T2();
+void T3();
+void T4();
+void T5();
+
+// Iterations of the micro benchmark loops: outer x inner
+#define MICRO_OUTER 300
+#define MICRO_INNER 1000
+
+// SIO moves a number per instruction, so its loops are shorter
+#define SIO_OUTER 30
+
+// Instructions repeated in the body of a micro benchmark loop
+#define MICRO_BODY 32
+
+// Runs of every benchmark, at least
+#define MIN_RUNS 3
+
+// Longest benchmark and engine name
+#define BENCH_MAX_NAME 32
+
+// A program to measure and the SIO input of each of its runs
+typedef struct
+{
+    PackedInstruction ins[MAX_CODE_LENGTH];
+    int numOfIns;
+    int fits;               // 0 if the program does not fit MAX_CODE_LENGTH
+    char* input;            // heap text, or NULL for no input
+} Bench;
+
+// Appends an instruction. Returns its address.
+static int put(Bench* b, int op, int r, int l, int m)
+{
+    if(b->numOfIns >= MAX_CODE_LENGTH || !canPackInstruction(op, r, l, m))
+    {
+        b->fits = 0;
+        return b->numOfIns;
+    }
+    b->ins[b->numOfIns] = packInstruction(op, r, l, m);
+    return b->numOfIns++;
+}
+
+// Points the jump at the address to target
+static void patch(Bench* b, int at, int target)
+{
+    if(at >= b->numOfIns)
+        return;
+    Instruction insi = unpackInstruction(b->ins[at]);
+    b->ins[at] = packInstruction(insi.op, insi.r, insi.l, target);
+}
+
+/**
+ * Loop skeleton of the benchmarks: R7 counts the outer loop and R6 the inner
+ * loop down to 0, R5 holds 1. The body goes between beginLoop() and endLoop()
+ * and may not use these registers.
+ * */
+static void beginLoop(Bench* b, int outer, int inner, int* outerTop, int* innerTop)
+{
+    put(b, 1, 7, 0, outer);
+    *outerTop = put(b, 1, 6, 0, inner);
+    *innerTop = b->numOfIns;
+}
+
+static void endLoop(Bench* b, int outerTop, int innerTop)
+{
+    put(b, 1, 5, 0, 1);
+    put(b, 14, 6, 6, 5);
+    int innerExit = put(b, 8, 6, 0, 0);
+    put(b, 7, 0, 0, innerTop);
+    patch(b, innerExit, b->numOfIns);
+    put(b, 14, 7, 7, 5);
+    int outerExit = put(b, 8, 7, 0, 0);
+    put(b, 7, 0, 0, outerTop);
+    patch(b, outerExit, b->numOfIns);
+}
+
+// NEG does the least work of all instructions, so its loop measures dispatch
+static void dispatchLoop(Bench* b, int variant)
+{
+    (void)variant;
+    int outerTop, innerTop, i;
+    put(b, 6, 0, 0, 5);
+    beginLoop(b, MICRO_OUTER, MICRO_INNER, &outerTop, &innerTop);
+    for(i = 0; i < MICRO_BODY; i++)
+        put(b, 12, 1, 1, 0);
+    endLoop(b, outerTop, innerTop);
+    put(b, 11, 0, 0, 3);
+}
+
+// ADD, SUB, MUL and LSS on values that stay small
+static void arithLoop(Bench* b, int variant)
+{
+    (void)variant;
+    int outerTop, innerTop, i;
+    put(b, 6, 0, 0, 5);
+    put(b, 1, 1, 0, 1);
+    put(b, 1, 2, 0, 3);
+    beginLoop(b, MICRO_OUTER, MICRO_INNER, &outerTop, &innerTop);
+    for(i = 0; i < MICRO_BODY / 4; i++)
+    {
+        put(b, 13, 1, 1, 2);
+        put(b, 14, 1, 1, 2);
+        put(b, 15, 3, 2, 2);
+        put(b, 21, 4, 1, 3);
+    }
+    endLoop(b, outerTop, innerTop);
+    put(b, 11, 0, 0, 3);
+}
+
+// The loop runs in a procedure nested levels deep, main calling P1, P1 calling
+// .. P2 and so on. Every frame has 5 cells; the loop body is op (LOD or STO)
+// .. on offset 4 of the main frame.
+static void nestedLoop(Bench* b, int levels, int op)
+{
+    int outerTop, innerTop, i;
+    int toMain = put(b, 7, 0, 0, 0);
+
+    // The innermost procedure is emitted first, so every CAL target is known
+    int callee = b->numOfIns;
+    put(b, 6, 0, 0, 5);
+    if(levels == 0)
+        patch(b, toMain, callee);
+    beginLoop(b, MICRO_OUTER, MICRO_INNER, &outerTop, &innerTop);
+    for(i = 0; i < MICRO_BODY; i++)
+        put(b, op, 1, levels, 4);
+    endLoop(b, outerTop, innerTop);
+    if(levels == 0)
+    {
+        put(b, 11, 0, 0, 3);
+        return;
+    }
+    put(b, 2, 0, 0, 0);
+
+    for(i = 1; i < levels; i++)
+    {
+        int entry = put(b, 6, 0, 0, 5);
+        put(b, 5, 0, 0, callee);
+        put(b, 2, 0, 0, 0);
+        callee = entry;
+    }
+
+    patch(b, toMain, put(b, 6, 0, 0, 5));
+    put(b, 5, 0, 0, callee);
+    put(b, 11, 0, 0, 3);
+}
+
+static void lodLoop(Bench* b, int level)
+{
+    nestedLoop(b, level, 3);
+}
+
+static void stoLoop(Bench* b, int level)
+{
+    nestedLoop(b, level, 4);
+}
+
+// CAL of a procedure that only sets up its frame and returns
+static void callLoop(Bench* b, int variant)
+{
+    (void)variant;
+    int outerTop, innerTop, i;
+    int toMain = put(b, 7, 0, 0, 0);
+    int callee = put(b, 6, 0, 0, 4);
+    put(b, 2, 0, 0, 0);
+
+    patch(b, toMain, put(b, 6, 0, 0, 5));
+    beginLoop(b, MICRO_OUTER, MICRO_INNER, &outerTop, &innerTop);
+    for(i = 0; i < MICRO_BODY / 4; i++)
+        put(b, 5, 0, 0, callee);
+    endLoop(b, outerTop, innerTop);
+    put(b, 11, 0, 0, 3);
+}
+
+static void writeLoop(Bench* b, int variant)
+{
+    (void)variant;
+    int outerTop, innerTop, i;
+    put(b, 6, 0, 0, 5);
+    put(b, 1, 1, 0, 12345);
+    beginLoop(b, SIO_OUTER, MICRO_INNER, &outerTop, &innerTop);
+    for(i = 0; i < MICRO_BODY; i++)
+        put(b, 9, 1, 0, 1);
+    endLoop(b, outerTop, innerTop);
+    put(b, 11, 0, 0, 3);
+}
+
+// Reads exactly the numbers in the input
+static void readLoop(Bench* b, int variant)
+{
+    (void)variant;
+    int outerTop, innerTop, i;
+    put(b, 6, 0, 0, 5);
+    beginLoop(b, SIO_OUTER, MICRO_INNER, &outerTop, &innerTop);
+    for(i = 0; i < MICRO_BODY; i++)
+        put(b, 10, 1, 0, 2);
+    endLoop(b, outerTop, innerTop);
+    put(b, 11, 0, 0, 3);
+
+    long numbers = (long)SIO_OUTER * MICRO_INNER * MICRO_BODY;
+    b->input = malloc(numbers * 6 + 1);
+    if(!b->input)
+        return;
+    long n;
+    char* text = b->input;
+    for(n = 0; n < numbers; n++)
+        text += sprintf(text, "%05ld ", n % 100000);
+}
+
+// The hard-coded programs of the code generator, with the input of the tests
+static void hardCoded(Bench* b, int variant)
+{
+    static void (*const programs[])() = { T0, T1, T2, T3, T4, T5 };
+    nextCodeIndex = 0;
+    programs[variant]();
+    memcpy(b->ins, vmCode, nextCodeIndex * sizeof(PackedInstruction));
+    b->numOfIns = nextCodeIndex;
+    b->input = strdup("5 3\n");
+}
+
+// A procedure calling itself as deep as the stack allows; R0 counts down the
+// .. depth. Recursive programs are not verified but guarded, so this runs
+// .. without checks above the guard pages of its machine (see verify.h).
+static void recursion(Bench* b, int variant)
+{
+    (void)variant;
+    int outerTop, innerTop;
+    int depth = (int)(VM_STACK_CELLS - 16) / 4;
+    int toMain = put(b, 7, 0, 0, 0);
+    int callee = put(b, 6, 0, 0, 4);
+    put(b, 14, 0, 0, 5);
+    int bottom = put(b, 8, 0, 0, 0);
+    put(b, 5, 0, 1, callee);
+    patch(b, bottom, put(b, 2, 0, 0, 0));
+
+    patch(b, toMain, put(b, 6, 0, 0, 4));
+    put(b, 1, 5, 0, 1);
+    beginLoop(b, 10, 100, &outerTop, &innerTop);
+    put(b, 1, 0, 0, depth);
+    put(b, 5, 0, 0, callee);
+    endLoop(b, outerTop, innerTop);
+    put(b, 11, 0, 0, 3);
+}
+
+// The code of "i := i + 1; if i < 100 then ..." as the code generator emits
+// .. it, which is also what the superinstructions are made for
+static void compiledLoop(Bench* b, int variant)
+{
+    (void)variant;
+    int outerTop, innerTop, i;
+    put(b, 6, 0, 0, 6);
+    beginLoop(b, MICRO_OUTER, MICRO_INNER, &outerTop, &innerTop);
+    for(i = 0; i < MICRO_BODY / 8; i++)
+    {
+        put(b, 3, 1, 0, 4);
+        put(b, 1, 2, 0, 1);
+        put(b, 13, 1, 1, 2);
+        put(b, 4, 1, 0, 5);
+        put(b, 3, 3, 0, 4);
+        put(b, 1, 4, 0, 100);
+        put(b, 21, 3, 3, 4);
+        put(b, 8, 3, 0, b->numOfIns + 1);
+    }
+    endLoop(b, outerTop, innerTop);
+    put(b, 11, 0, 0, 3);
+}
+
+// As many small procedures as fit in code memory, all called once per
+// .. iteration, so the code is spread over all of it
+static void manyProcedures(Bench* b, int variant)
+{
+    (void)variant;
+    int outerTop, innerTop, i;
+    int count = (MAX_CODE_LENGTH - 32) / 5;
+    if(count > 64)
+        count = 64;
+    int* entries = malloc(count * sizeof(int));
+    if(!entries)
+        return;
+
+    int toMain = put(b, 7, 0, 0, 0);
+    for(i = 0; i < count; i++)
+    {
+        entries[i] = put(b, 6, 0, 0, 4);
+        put(b, 1, 1, 0, i);
+        put(b, 13, 2, 1, 1);
+        put(b, 2, 0, 0, 0);
+    }
+
+    patch(b, toMain, put(b, 6, 0, 0, 4));
+    beginLoop(b, MICRO_OUTER / 10, MICRO_INNER, &outerTop, &innerTop);
+    for(i = 0; i < count; i++)
+        put(b, 5, 0, 0, entries[i]);
+    endLoop(b, outerTop, innerTop);
+    put(b, 11, 0, 0, 3);
+    free(entries);
+}
+
+static const struct
+{
+    const char* name;
+    void (*generate)(Bench* b, int variant);
+    int variant;
+} benchmarks[] =
+{
+    { "dispatch", dispatchLoop, 0 },
+    { "arith", arithLoop, 0 },
+    { "lod_l0", lodLoop, 0 },
+    { "lod_l1", lodLoop, 1 },
+    { "lod_l2", lodLoop, 2 },
+    { "lod_l3", lodLoop, 3 },
+    { "sto_l0", stoLoop, 0 },
+    { "sto_l1", stoLoop, 1 },
+    { "sto_l2", stoLoop, 2 },
+    { "sto_l3", stoLoop, 3 },
+    { "cal_rtn", callLoop, 0 },
+    { "sio_write", writeLoop, 0 },
+    { "sio_read", readLoop, 0 },
+    { "T0", hardCoded, 0 },
+    { "T1", hardCoded, 1 },
+    { "T2", hardCoded, 2 },
+    { "T3", hardCoded, 3 },
+    { "T4", hardCoded, 4 },
+    { "T5", hardCoded, 5 },
+    { "recursion", recursion, 0 },
+    { "long_loop", compiledLoop, 0 },
+    { "procedures", manyProcedures, 0 },
+};
+
+#define NUM_BENCHMARKS ((int)(sizeof(benchmarks) / sizeof(benchmarks[0])))
+
+// Ways of running a program
+static const struct
+{
+    const char* name;
+    int noFusion;
+    int jit;
+} engines[] =
+{
+    { "interp", 0, 0 },
+    { "nofuse", 1, 0 },
+    { "jit", 0, 1 },
+};
+
+#define NUM_ENGINES ((int)(sizeof(engines) / sizeof(engines[0])))
+
+// One line of the report
+typedef struct
+{
+    char name[BENCH_MAX_NAME];
+    char engine[BENCH_MAX_NAME];
+    long instructions;      // per run
+    double nsPerInstruction;
+    double instructionsPerSecond;
+    long rssKB;             // peak RSS of the process after the benchmark
+} Result;
+
+static long peakRSS(void)
+{
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return usage.ru_maxrss;
+}
+
+// Loads the benchmark the way code files are loaded, from a bytecode file
+static VmProgram* loadBench(const Bench* b)
+{
+    FILE* file = tmpfile();
+    if(!file)
+        return NULL;
+    VmProgram* program = NULL;
+    if(writeBytecode(file, b->ins, b->numOfIns, NULL, 0, NULL, 0) == 0 && fflush(file) == 0)
+    {
+        rewind(file);
+        program = loadProgram(file, 1);
+    }
+    fclose(file);
+    return program;
+}
+
+// Seconds of the fastest run made in at least minSeconds and MIN_RUNS runs
+static double fastestRun(const VmProgram* program, VirtualMachine* vm, FILE* input, FILE* output,
+                         const RunOptions* options, double minSeconds)
+{
+    double best = 0;
+    double spent = 0;
+    int runs;
+    for(runs = 0; runs < MIN_RUNS || spent < minSeconds; runs++)
+    {
+        resetVM(vm);
+        rewind(input);
+        double started = wallClock();
+        runLoadedProgram(program, vm, input, output, options);
+        double seconds = wallClock() - started;
+        spent += seconds;
+        if(runs == 0 || seconds < best)
+            best = seconds;
+    }
+    return best;
+}
+
+// Runs the benchmark on every engine that accepts it, appending the results.
+// Returns the number of results, or -1 if the benchmark cannot be run.
+static int runBench(int index, VirtualMachine* vm, FILE* output, double minSeconds, Result* results)
+{
+    Bench* b = calloc(1, sizeof(Bench));
+    if(!b)
+        return -1;
+    b->fits = 1;
+    benchmarks[index].generate(b, benchmarks[index].variant);
+
+    int numOfResults = -1;
+    VmProgram* program = NULL;
+    FILE* input = tmpfile();
+    if(!b->fits)
+        fprintf(stderr, "%s does not fit in code memory.\n", benchmarks[index].name);
+    else if(input && (!b->input || fputs(b->input, input) >= 0) && fflush(input) == 0)
+        program = loadBench(b);
+
+    if(program)
+    {
+        // The instructions of one run, counted without superinstructions
+        long instructions = 0;
+        RunOptions counting = { .noFusion = 1, .instructions = &instructions };
+        resetVM(vm);
+        rewind(input);
+        runLoadedProgram(program, vm, input, output, &counting);
+
+        JitProgram* jit = programVerified(program) ? compileJIT(b->ins, b->numOfIns) : NULL;
+        int jitWorks = jit != NULL;
+        freeJIT(jit);
+
+        int e;
+        numOfResults = 0;
+        for(e = 0; e < NUM_ENGINES; e++)
+        {
+            if(engines[e].jit && !jitWorks)
+                continue;
+            RunOptions options = { .noFusion = engines[e].noFusion, .jit = engines[e].jit };
+            double seconds = fastestRun(program, vm, input, output, &options, minSeconds);
+
+            Result* result = &results[numOfResults++];
+            snprintf(result->name, sizeof(result->name), "%s", benchmarks[index].name);
+            snprintf(result->engine, sizeof(result->engine), "%s", engines[e].name);
+            result->instructions = instructions;
+            result->nsPerInstruction = instructions > 0 ? seconds * 1e9 / instructions : 0;
+            result->instructionsPerSecond = seconds > 0 ? instructions / seconds : 0;
+            result->rssKB = peakRSS();
+        }
+        freeProgram(program);
+    }
+
+    if(input)
+        fclose(input);
+    free(b->input);
+    free(b);
+    return numOfResults;
+}
+
+// Reads the results of a file written with -w.
+// Returns the number of results, or -1 if the file cannot be read.
+static int readBaseline(const char* path, Result** baseline)
+{
+    FILE* in = fopen(path, "r");
+    if(!in)
+        return -1;
+
+    int capacity = 64;
+    int n = 0;
+    char line[512];
+    *baseline = malloc(capacity * sizeof(Result));
+    while(*baseline && fgets(line, sizeof(line), in))
+    {
+        Result r;
+        if(sscanf(line, " {\"name\": \"%31[^\"]\", \"engine\": \"%31[^\"]\", \"instructions\": %ld, "
+                        "\"ns_per_instruction\": %lf, \"instructions_per_second\": %lf, \"rss_kb\": %ld",
+                  r.name, r.engine, &r.instructions, &r.nsPerInstruction, &r.instructionsPerSecond, &r.rssKB) != 6)
+            continue;
+        if(n == capacity)
+        {
+            capacity *= 2;
+            *baseline = realloc(*baseline, capacity * sizeof(Result));
+            if(!*baseline)
+                break;
+        }
+        (*baseline)[n++] = r;
+    }
+    fclose(in);
+    return *baseline ? n : -1;
+}
+
+static void writeResults(FILE* out, const Result* results, int numOfResults)
+{
+    int i;
+    fprintf(out, "{\"benchmarks\": [\n");
+    for(i = 0; i < numOfResults; i++)
+    {
+        const Result* r = &results[i];
+        fprintf(out, "  {\"name\": \"%s\", \"engine\": \"%s\", \"instructions\": %ld, "
+                     "\"ns_per_instruction\": %.4f, \"instructions_per_second\": %.0f, \"rss_kb\": %ld}%s\n",
+                r->name, r->engine, r->instructions, r->nsPerInstruction, r->instructionsPerSecond, r->rssKB,
+                i + 1 < numOfResults ? "," : "");
+    }
+    fprintf(out, "]}\n");
+}
+
+// Prints the results, each compared with the same benchmark and engine of the
+// .. baseline if there is one.
+// Returns the number of regressions: ns/instruction up by more than tolerance percent.
+static int printResults(FILE* out, const Result* results, int numOfResults,
+                        const Result* baseline, int numOfBaseline, double tolerance)
+{
+    int regressions = 0;
+    int i, k;
+    fprintf(out, "***Benchmarks***\n");
+    fprintf(out, "%-12s %-8s %14s %10s %14s %10s %10s \n",
+            "BENCHMARK", "ENGINE", "INSTRUCTIONS", "NS/INS", "INS/S", "RSS KB", "CHANGE");
+    for(i = 0; i < numOfResults; i++)
+    {
+        const Result* r = &results[i];
+        fprintf(out, "%-12s %-8s %14ld %10.3f %14.0f %10ld ",
+                r->name, r->engine, r->instructions, r->nsPerInstruction, r->instructionsPerSecond, r->rssKB);
+
+        const Result* base = NULL;
+        for(k = 0; k < numOfBaseline && !base; k++)
+            if(strcmp(baseline[k].name, r->name) == 0 && strcmp(baseline[k].engine, r->engine) == 0)
+                base = &baseline[k];
+        if(!base || base->nsPerInstruction <= 0)
+        {
+            fprintf(out, "%10s \n", "-");
+            continue;
+        }
+
+        double change = (r->nsPerInstruction / base->nsPerInstruction - 1) * 100;
+        int regressed = change > tolerance;
+        regressions += regressed;
+        fprintf(out, "%+9.1f%% %s\n", change, regressed ? "REGRESSION" : "");
+    }
+    return regressions;
+}
+
+int main(int argc, char** argv)
+{
+    double minSeconds = 0.2;
+    double tolerance = 10;
+    const char* filter = NULL;
+    const char* resultsPath = NULL;
+    const char* baselinePath = NULL;
+
+    int arg;
+    for(arg = 1; arg + 1 < argc && argv[arg][0] == '-'; arg += 2)
+    {
+        if(strcmp(argv[arg], "-s") == 0)
+            minSeconds = atof(argv[arg + 1]);
+        else if(strcmp(argv[arg], "-f") == 0)
+            filter = argv[arg + 1];
+        else if(strcmp(argv[arg], "-w") == 0)
+            resultsPath = argv[arg + 1];
+        else if(strcmp(argv[arg], "-b") == 0)
+            baselinePath = argv[arg + 1];
+        else if(strcmp(argv[arg], "-t") == 0)
+            tolerance = atof(argv[arg + 1]);
+        else
+            break;
+    }
+    if(arg != argc)
+    {
+        fprintf(stderr, "Usage: %s [-s seconds] [-f filter] [-w results file] [-b baseline file] [-t tolerance]\n",
+                argv[0]);
+        return 1;
+    }
+
+    Result* baseline = NULL;
+    int numOfBaseline = 0;
+    if(baselinePath && (numOfBaseline = readBaseline(baselinePath, &baseline)) < 0)
+    {
+        fprintf(stderr, "Cannot read %s.\n", baselinePath);
+        return 1;
+    }
+
+    VirtualMachine* vm = createVM();
+    FILE* output = fopen("/dev/null", "w");
+    Result* results = malloc(NUM_BENCHMARKS * NUM_ENGINES * sizeof(Result));
+    if(!vm || !output || !results)
+    {
+        fprintf(stderr, "Cannot set up the benchmarks.\n");
+        return 1;
+    }
+
+    int numOfResults = 0;
+    int failed = 0;
+    int i;
+    for(i = 0; i < NUM_BENCHMARKS; i++)
+    {
+        if(filter && !strstr(benchmarks[i].name, filter))
+            continue;
+        int n = runBench(i, vm, output, minSeconds, results + numOfResults);
+        if(n < 0)
+            failed = 1;
+        else
+            numOfResults += n;
+    }
+
+    int regressions = printResults(stdout, results, numOfResults, baseline, numOfBaseline, tolerance);
+
+    if(resultsPath)
+    {
+        FILE* out = fopen(resultsPath, "w");
+        if(out)
+            writeResults(out, results, numOfResults);
+        if(!out || fclose(out) != 0)
+        {
+            fprintf(stderr, "Cannot write %s.\n", resultsPath);
+            failed = 1;
+        }
+    }
+
+    fclose(output);
+    freeVM(vm);
+    free(results);
+    free(baseline);
+    if(regressions > 0)
+        return 2;
+    return failed;
+}
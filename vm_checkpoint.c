@@ -0,0 +1,47 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program saves a program, run up to its first input, as a snapshot
+*
+* Usage: vm_checkpoint <code file> <snapshot file>
+* Build: link with vm.c, vm_trace.c, vm_output.c, vm_input.c, bytecode.c, jit.c,
+*        verify.c, snapshot.c and vm_perf.c
+*
+* The snapshot (see snapshot.h) is given to the virtual machine instead of the
+* .. code file: every run then starts at the first SIO read, without running
+* .. the initialization before it again.
+*/
+
+#include <stdio.h>
+#include "vm_engine.h"
+
+int main(int argc, char** argv)
+{
+    if(argc != 3)
+    {
+        fprintf(stderr, "Usage: %s <code file> <snapshot file>\n", argv[0]);
+        return 1;
+    }
+
+    FILE* in = fopen(argv[1], "rb");
+    if(!in)
+    {
+        fprintf(stderr, "Cannot open %s.\n", argv[1]);
+        return 1;
+    }
+    FILE* out = fopen(argv[2], "wb");
+    if(!out)
+    {
+        fprintf(stderr, "Cannot create %s.\n", argv[2]);
+        fclose(in);
+        return 1;
+    }
+
+    int status = checkpointVM(in, out);
+    fclose(in);
+    if(fclose(out) != 0)
+        status = -1;
+    if(status != 0)
+        remove(argv[2]);
+    return status != 0;
+}
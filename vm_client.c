@@ -0,0 +1,74 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program sends one program and its input to vm_daemon
+*
+* Usage: vm_client [-s socket] [-c] <program file> [input file]
+* Build: link with vm_protocol.c
+*
+* The program file is PL/0 source, or VM code (text or bytecode) with -c.
+* The SIO output is printed on stdout and the run statistics on stderr. The
+* .. exit status is the status of the response (see vm_protocol.h), or 10 if
+* .. the daemon could not be reached.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "vm_protocol.h"
+
+int main(int argc, char** argv)
+{
+    const char* path = VM_SOCKET_PATH;
+    uint32_t kind = PROGRAM_SOURCE;
+    int arg = 1;
+    while(arg < argc && argv[arg][0] == '-')
+    {
+        if(strcmp(argv[arg], "-s") == 0 && arg + 1 < argc)
+            path = argv[arg + 1], arg += 2;
+        else if(strcmp(argv[arg], "-c") == 0)
+            kind = PROGRAM_CODE, arg++;
+        else
+            break;
+    }
+    if(argc - arg < 1 || argc - arg > 2 || argv[arg][0] == '-')
+    {
+        fprintf(stderr, "Usage: %s [-s socket] [-c] <program file> [input file]\n", argv[0]);
+        return 10;
+    }
+
+    uint32_t programSize, inputSize = 0;
+    char* program = readFile(argv[arg], &programSize);
+    char* input = argc - arg > 1 ? readFile(argv[arg + 1], &inputSize) : calloc(1, 1);
+    if(!program || !input)
+        return 10;
+
+    int fd = connectDaemon(path);
+    if(fd < 0)
+        return 10;
+
+    ResponseHeader response;
+    char* output;
+    if(callDaemon(fd, kind, program, programSize, input, inputSize, &response, &output) != 0)
+    {
+        fprintf(stderr, "The daemon closed the connection.\n");
+        return 10;
+    }
+    close(fd);
+
+    fwrite(output, 1, response.outputSize, stdout);
+    static const char* statusNames[] = { "halted", "illegal instruction", "compile error", "bad request",
+                                         "out of budget" };
+    fprintf(stderr, "\nstatus %s, %s, %llu instructions, compile %llu us, run %llu us\n",
+            response.status < 5 ? statusNames[response.status] : "unknown",
+            response.cacheHit ? "cached" : "loaded",
+            (unsigned long long)response.instructions,
+            (unsigned long long)response.compileMicros,
+            (unsigned long long)response.runMicros);
+
+    free(output);
+    free(program);
+    free(input);
+    return response.status;
+}
@@ -0,0 +1,214 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program reads the hardware performance counters of every phase of a run
+*
+* Usage: vm_counters [-c] [-e] [-s] <program file> [input file]
+* Build: link with vm_perf.c, vm_protocol.c, lexical_analyzer.c, CodeGeneration.c,
+*        aot.c, vm.c, vm_trace.c, vm_output.c, vm_input.c, bytecode.c, jit.c,
+*        verify.c and snapshot.c
+*
+* The program file is PL/0 source, or VM code (text or bytecode) with -c.
+* Source goes through the phases lex, codegen (parser and code generator) and
+* .. load (verification and decoding); VM code only through load. The program
+* .. then runs once on the threaded engine, writing its SIO output to stdout.
+* With -e it runs again without superinstructions and, when it can be
+* .. compiled, as machine code. With -s it runs again through simulateVM(),
+* .. which also loads the code and writes the execution history (to
+* .. /dev/null). Every run after the first reads the same input and discards
+* .. its output.
+*
+* A report per phase is printed on stderr (see vm_perf.h). The counts of a
+* .. run are also divided by the VM instructions the first run executed.
+* Hardware counters are often not available in virtual machines and
+* .. containers, or need a lower /proc/sys/kernel/perf_event_paranoid; the
+* .. reports then only have the times.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lexical_analyzer.h"
+#include "token.h"
+#include "vm.h"
+#include "vm_engine.h"
+#include "vm_protocol.h"
+#include "jit.h"
+
+int codeGeneratorBytecode(TokenList tokenList, FILE* out);
+
+// Compile the null-terminated PL/0 (source) to bytecode in a heap buffer,
+// .. reading the counters of each phase.
+// Returns 0 on success.
+static int compileSource(char* source, char** code, size_t* codeSize, PerfCounters* counters)
+{
+    startPerfCounters(counters);
+    LexerOut lexed = lexicalAnalyzer(source);
+    stopPerfCounters(counters);
+    printPerfReport(stderr, "lex", counters, 0);
+    clearPerfCounters(counters);
+    if(lexed.lexerError != NONE)
+    {
+        fprintf(stderr, "Lexer error on line %d.\n", lexed.errorLine);
+        deleteTokenList(&lexed.tokenList);
+        return -1;
+    }
+
+    int err = -1;
+    FILE* out = open_memstream(code, codeSize);
+    if(out)
+    {
+        startPerfCounters(counters);
+        err = codeGeneratorBytecode(lexed.tokenList, out);
+        fclose(out);
+        stopPerfCounters(counters);
+        printPerfReport(stderr, "codegen", counters, 0);
+        clearPerfCounters(counters);
+        if(err != 0)
+            free(*code);
+    }
+    deleteTokenList(&lexed.tokenList);
+    return err != 0 ? -1 : 0;
+}
+
+// Run the program again on a fresh machine with the (options), from the start
+// .. of the (input), and report it as the (phase)
+static void rerun(const VmProgram* program, const char* phase, RunOptions* options, FILE* input,
+                  FILE* discard, long instructions)
+{
+    VirtualMachine* vm = createVM();
+    if(!vm)
+        return;
+    rewind(input);
+    runLoadedProgram(program, vm, input, discard, options);
+    printPerfReport(stderr, phase, options->counters, instructions);
+    clearPerfCounters(options->counters);
+    freeVM(vm);
+}
+
+int main(int argc, char** argv)
+{
+    int isCode = 0, engines = 0, simulate = 0;
+    int arg = 1;
+    while(arg < argc && argv[arg][0] == '-')
+    {
+        if(strcmp(argv[arg], "-c") == 0)
+            isCode = 1, arg++;
+        else if(strcmp(argv[arg], "-e") == 0)
+            engines = 1, arg++;
+        else if(strcmp(argv[arg], "-s") == 0)
+            simulate = 1, arg++;
+        else
+            break;
+    }
+    if(argc - arg < 1 || argc - arg > 2 || argv[arg][0] == '-')
+    {
+        fprintf(stderr, "Usage: %s [-c] [-e] [-s] <program file> [input file]\n", argv[0]);
+        return 1;
+    }
+
+    uint32_t size;
+    char* bytes = readFile(argv[arg], &size);
+    // Runs after the first read the input again, so it has to be seekable
+    FILE* input = argc - arg > 1 ? fopen(argv[arg + 1], "rb") : tmpfile();
+    FILE* discard = fopen("/dev/null", "w");
+    if(!bytes || !input || !discard)
+    {
+        if(!input)
+            fprintf(stderr, "Cannot open %s.\n", argc - arg > 1 ? argv[arg + 1] : "the input");
+        return 1;
+    }
+
+    PerfCounters counters;
+    if(openPerfCounters(&counters) == 0)
+        fprintf(stderr, "No hardware counters are available, only times are reported.\n");
+
+    char* code = NULL;
+    size_t codeSize = size;
+    if(!isCode)
+    {
+        // The lexer needs a null-terminated string
+        char* source = realloc(bytes, size + 1);
+        if(!source)
+            return 1;
+        bytes = source;
+        bytes[size] = '\0';
+        if(compileSource(bytes, &code, &codeSize, &counters) != 0)
+            return 1;
+    }
+
+    VmProgram* program = NULL;
+    FILE* in = fmemopen(code ? code : bytes, codeSize, "rb");
+    if(in)
+    {
+        startPerfCounters(&counters);
+        program = loadProgram(in, engines);
+        stopPerfCounters(&counters);
+        fclose(in);
+    }
+    if(!program)
+    {
+        fprintf(stderr, "Invalid code file.\n");
+        return 1;
+    }
+    printPerfReport(stderr, "load", &counters, 0);
+    clearPerfCounters(&counters);
+
+    // The first run counts the instructions every run is divided by
+    long instructions = 0;
+    VirtualMachine* vm = createVM();
+    if(!vm)
+        return 1;
+    RunOptions options = { .counters = &counters, .instructions = &instructions };
+    runLoadedProgram(program, vm, input, stdout, &options);
+    fflush(stdout);
+    printPerfReport(stderr, "run", &counters, instructions);
+    clearPerfCounters(&counters);
+    freeVM(vm);
+
+    if(engines)
+    {
+        RunOptions plain = { .counters = &counters, .noFusion = 1 };
+        rerun(program, "run, no superinstructions", &plain, input, discard, instructions);
+
+        // The JIT falls back to the engine silently, so only report machine
+        // .. code the program can actually be compiled to
+        int numOfIns;
+        const PackedInstruction* ins = programCode(program, &numOfIns);
+        JitProgram* jit = programVerified(program) ? compileJIT(ins, numOfIns) : NULL;
+        if(jit)
+        {
+            RunOptions native = { .counters = &counters, .jit = 1 };
+            rerun(program, "run, jit", &native, input, discard, instructions);
+            freeJIT(jit);
+        }
+        else
+            fprintf(stderr, "***Counters: run, jit***\nnot supported for this program\n");
+    }
+
+    if(simulate)
+    {
+        FILE* trace = fopen("/dev/null", "w");
+        in = fmemopen(code ? code : bytes, codeSize, "rb");
+        if(trace && in)
+        {
+            rewind(input);
+            startPerfCounters(&counters);
+            simulateVM(in, trace, input, discard);
+            stopPerfCounters(&counters);
+            printPerfReport(stderr, "simulateVM", &counters, instructions);
+        }
+        if(trace)
+            fclose(trace);
+        if(in)
+            fclose(in);
+    }
+
+    closePerfCounters(&counters);
+    freeProgram(program);
+    fclose(discard);
+    fclose(input);
+    free(code);
+    free(bytes);
+    return 0;
+}
@@ -0,0 +1,422 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program serves compile-and-run requests on a Unix domain socket
+*
+* Usage: vm_daemon [-s socket] [-c cache entries] [-f fuel] [-t seconds]
+* Build: link with vm_protocol.c, lexical_analyzer.c, CodeGeneration.c, aot.c,
+*        vm.c, vm_trace.c, vm_output.c, vm_input.c, bytecode.c, jit.c, verify.c,
+*        snapshot.c, vm_perf.c and -lpthread
+*
+* Requests and responses are described in vm_protocol.h; vm_client and
+* .. vm_loadgen are the matching clients. Every connection is served by its
+* .. own thread with its own virtual machine. A run may be given a budget of
+* .. instructions (-f) and of wall time (-t); a program that exceeds it is
+* .. stopped and answered with RUN_OUT_OF_BUDGET.
+*
+* Loaded programs are kept in an LRU cache keyed by a hash of the request's
+* .. program bytes, so a program sent again is neither compiled nor decoded.
+* The lexer and the code generator keep their state in globals, so sources
+* .. are compiled one at a time; cached programs run concurrently.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "lexical_analyzer.h"
+#include "token.h"
+#include "vm_engine.h"
+#include "vm_protocol.h"
+
+// CodeGeneration.c
+int codeGeneratorBytecode(TokenList tokenList, FILE* out);
+
+#define DEFAULT_CACHE_ENTRIES 64
+
+// A loaded program and the request bytes it was loaded from
+typedef struct
+{
+    uint64_t hash;
+    uint32_t kind;
+    uint32_t size;
+    char* bytes;
+    VmProgram* program;
+    int users;              // requests running the program right now
+    unsigned long lastUsed; // cache clock at the last lookup
+} CacheEntry;
+
+// LRU cache of loaded programs, guarded by lock
+typedef struct
+{
+    pthread_mutex_t lock;
+    CacheEntry** entries;
+    int used;
+    int capacity;
+    unsigned long clock;
+} ProgramCache;
+
+static ProgramCache cache = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0 };
+
+// Budget of every run, 0 for no limit (see RunOptions.fuel)
+static long runFuel = 0;
+static double runSeconds = 0;
+
+// The lexer and the code generator are not reentrant
+static pthread_mutex_t compileLock = PTHREAD_MUTEX_INITIALIZER;
+
+// 64-bit FNV-1a hash of the program kind and bytes
+static uint64_t hashProgram(uint32_t kind, const char* bytes, uint32_t size)
+{
+    uint64_t hash = 14695981039346656037ull ^ kind;
+    uint32_t i;
+    for(i = 0; i < size; i++)
+    {
+        hash ^= (unsigned char)bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static void freeEntry(CacheEntry* entry)
+{
+    freeProgram(entry->program);
+    free(entry->bytes);
+    free(entry);
+}
+
+// Returns the cached entry for the program, marked in use, or NULL.
+// Must be called with the cache locked.
+static CacheEntry* findEntry(uint64_t hash, uint32_t kind, const char* bytes, uint32_t size)
+{
+    int i;
+    for(i = 0; i < cache.used; i++)
+    {
+        CacheEntry* entry = cache.entries[i];
+        if(entry->hash == hash && entry->kind == kind && entry->size == size &&
+           memcmp(entry->bytes, bytes, size) == 0)
+        {
+            entry->users++;
+            entry->lastUsed = ++cache.clock;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Adds a new entry, in use, evicting the least recently used one when full.
+// An evicted entry still in use is freed by its last user (see releaseEntry()).
+// Must be called with the cache locked.
+static void insertEntry(CacheEntry* entry)
+{
+    if(cache.used == cache.capacity)
+    {
+        int oldest = 0;
+        int i;
+        for(i = 1; i < cache.used; i++)
+        {
+            if(cache.entries[i]->lastUsed < cache.entries[oldest]->lastUsed)
+                oldest = i;
+        }
+        CacheEntry* evicted = cache.entries[oldest];
+        cache.entries[oldest] = cache.entries[--cache.used];
+        evicted->lastUsed = 0;  // marks it as evicted
+        if(evicted->users == 0)
+            freeEntry(evicted);
+    }
+
+    entry->users = 1;
+    entry->lastUsed = ++cache.clock;
+    cache.entries[cache.used++] = entry;
+}
+
+// Marks the entry as no longer used by the caller
+static void releaseEntry(CacheEntry* entry)
+{
+    pthread_mutex_lock(&cache.lock);
+    entry->users--;
+    int unused = entry->lastUsed == 0 && entry->users == 0;
+    pthread_mutex_unlock(&cache.lock);
+
+    if(unused)
+        freeEntry(entry);
+}
+
+// Compile PL/0 source into a bytecode file in memory.
+// Returns 0 on success; *code is a heap buffer of *codeSize bytes.
+static int compileSource(const char* bytes, uint32_t size, char** code, size_t* codeSize)
+{
+    // The lexer needs a null-terminated string
+    char* source = malloc(size + 1);
+    if(!source)
+        return -1;
+    memcpy(source, bytes, size);
+    source[size] = '\0';
+
+    pthread_mutex_lock(&compileLock);
+    int err = -1;
+    LexerOut lexed = lexicalAnalyzer(source);
+    if(lexed.lexerError == NONE)
+    {
+        FILE* out = open_memstream(code, codeSize);
+        if(out)
+        {
+            err = codeGeneratorBytecode(lexed.tokenList, out);
+            fclose(out);
+            if(err != 0)
+                free(*code);
+        }
+    }
+    deleteTokenList(&lexed.tokenList);
+    pthread_mutex_unlock(&compileLock);
+
+    free(source);
+    return err != 0 ? -1 : 0;
+}
+
+// Load the program of a request, compiling it first if it is source.
+// Returns NULL if it is rejected.
+static VmProgram* buildProgram(uint32_t kind, const char* bytes, uint32_t size)
+{
+    char* code = NULL;
+    size_t codeSize = size;
+    if(kind == PROGRAM_SOURCE && compileSource(bytes, size, &code, &codeSize) != 0)
+        return NULL;
+
+    VmProgram* program = NULL;
+    FILE* in = fmemopen(code ? code : (char*)bytes, codeSize, "rb");
+    if(in)
+    {
+        program = loadProgram(in, 0);
+        fclose(in);
+    }
+    free(code);
+    return program;
+}
+
+// Returns the cache entry of the program, in use, building it on a miss.
+// Returns NULL if the program is rejected.
+static CacheEntry* acquireProgram(uint32_t kind, const char* bytes, uint32_t size, ResponseHeader* response)
+{
+    uint64_t hash = hashProgram(kind, bytes, size);
+    pthread_mutex_lock(&cache.lock);
+    CacheEntry* entry = findEntry(hash, kind, bytes, size);
+    pthread_mutex_unlock(&cache.lock);
+    if(entry)
+    {
+        response->cacheHit = 1;
+        return entry;
+    }
+
+    double started = wallClock();
+    entry = calloc(1, sizeof(CacheEntry));
+    if(entry)
+    {
+        entry->hash = hash;
+        entry->kind = kind;
+        entry->size = size;
+        entry->bytes = malloc(size ? size : 1);
+        if(entry->bytes)
+        {
+            memcpy(entry->bytes, bytes, size);
+            entry->program = buildProgram(kind, bytes, size);
+        }
+        if(!entry->program)
+        {
+            free(entry->bytes);
+            free(entry);
+            entry = NULL;
+        }
+    }
+    response->compileMicros = (wallClock() - started) * 1e6;
+    if(!entry)
+        return NULL;
+
+    // Another connection may have built the same program meanwhile
+    pthread_mutex_lock(&cache.lock);
+    CacheEntry* existing = findEntry(hash, kind, bytes, size);
+    if(!existing)
+        insertEntry(entry);
+    pthread_mutex_unlock(&cache.lock);
+    if(existing)
+    {
+        freeEntry(entry);
+        entry = existing;
+    }
+    return entry;
+}
+
+// Run the program on the connection's machine, filling the response.
+// Returns the SIO output as a heap buffer of response->outputSize bytes.
+static char* runRequest(const VmProgram* program, VirtualMachine* vm, const char* input, uint32_t inputSize,
+                        ResponseHeader* response)
+{
+    char* output = NULL;
+    size_t outputSize = 0;
+    FILE* out = open_memstream(&output, &outputSize);
+
+    // fmemopen() may reject an empty buffer, and white space reads as empty input
+    FILE* in = fmemopen(inputSize ? (char*)input : " ", inputSize ? inputSize : 1, "r");
+    if(!in || !out)
+    {
+        response->status = RUN_BAD_REQUEST;
+        if(in)
+            fclose(in);
+        if(out)
+            fclose(out);
+        free(output);
+        return NULL;
+    }
+
+    long instructions = 0;
+    int stackMark = 0;
+    RunOptions options = { .instructions = &instructions, .stackMark = &stackMark, .fuel = runFuel };
+    double started = wallClock();
+    if(runSeconds > 0)
+        options.deadline = started + runSeconds;
+    int flag = runLoadedProgram(program, vm, in, out, &options);
+    response->runMicros = (wallClock() - started) * 1e6;
+    fclose(in);
+    fclose(out);
+
+    // Only SIO halt (opcode 11) ends a run normally
+    int numOfIns;
+    const PackedInstruction* ins = programCode(program, &numOfIns);
+    int halted = vm->IR >= 0 && vm->IR < numOfIns && packedOp(ins[vm->IR]) == 11;
+    response->status = flag == PREEMPTED ? RUN_OUT_OF_BUDGET : halted ? RUN_HALTED : RUN_ILLEGAL;
+    response->instructions = instructions;
+    resetVMUsed(vm, stackMark);
+
+    if(outputSize > MAX_MESSAGE_SIZE)
+    {
+        response->status = RUN_BAD_REQUEST;
+        outputSize = 0;
+    }
+    response->outputSize = outputSize;
+    return output;
+}
+
+// Serve the requests of one connection until the client closes it
+static void* serveConnection(void* argument)
+{
+    int fd = (int)(intptr_t)argument;
+    VirtualMachine* vm = createVM();
+    char* program = NULL;
+    char* input = NULL;
+
+    RequestHeader request;
+    while(vm && readAll(fd, &request, sizeof(request)) == 0)
+    {
+        if(request.magic != REQUEST_MAGIC || request.kind > PROGRAM_CODE ||
+           request.programSize > MAX_MESSAGE_SIZE || request.inputSize > MAX_MESSAGE_SIZE)
+            break;
+
+        program = malloc(request.programSize ? request.programSize : 1);
+        input = malloc(request.inputSize ? request.inputSize : 1);
+        if(!program || !input ||
+           readAll(fd, program, request.programSize) != 0 ||
+           readAll(fd, input, request.inputSize) != 0)
+            break;
+
+        ResponseHeader response;
+        memset(&response, 0, sizeof(response));
+        response.magic = RESPONSE_MAGIC;
+        char* output = NULL;
+
+        CacheEntry* entry = acquireProgram(request.kind, program, request.programSize, &response);
+        if(entry)
+        {
+            output = runRequest(entry->program, vm, input, request.inputSize, &response);
+            releaseEntry(entry);
+        }
+        else
+        {
+            response.status = RUN_COMPILE_ERROR;
+        }
+
+        int sent = writeAll(fd, &response, sizeof(response)) == 0 &&
+                   writeAll(fd, output, response.outputSize) == 0;
+        free(output);
+        free(program);
+        free(input);
+        program = input = NULL;
+        if(!sent)
+            break;
+    }
+
+    free(program);
+    free(input);
+    if(vm)
+        freeVM(vm);
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = VM_SOCKET_PATH;
+    int capacity = DEFAULT_CACHE_ENTRIES;
+    int arg;
+    for(arg = 1; arg + 1 < argc; arg += 2)
+    {
+        if(strcmp(argv[arg], "-s") == 0)
+            path = argv[arg + 1];
+        else if(strcmp(argv[arg], "-c") == 0)
+            capacity = atoi(argv[arg + 1]);
+        else if(strcmp(argv[arg], "-f") == 0)
+            runFuel = atol(argv[arg + 1]);
+        else if(strcmp(argv[arg], "-t") == 0)
+            runSeconds = atof(argv[arg + 1]);
+        else
+            break;
+    }
+    if(arg != argc || capacity < 1 || runFuel < 0 || runSeconds < 0)
+    {
+        fprintf(stderr, "Usage: %s [-s socket] [-c cache entries] [-f fuel] [-t seconds]\n", argv[0]);
+        return 1;
+    }
+
+    cache.capacity = capacity;
+    cache.entries = calloc(capacity, sizeof(CacheEntry*));
+
+    // A client that hangs up must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path %s is too long.\n", path);
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if(listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+       listen(listener, SOMAXCONN) != 0)
+    {
+        fprintf(stderr, "Cannot listen on %s.\n", path);
+        return 1;
+    }
+
+    for(;;)
+    {
+        int fd = accept(listener, NULL, NULL);
+        if(fd < 0)
+            continue;
+
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, serveConnection, (void*)(intptr_t)fd) != 0)
+        {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
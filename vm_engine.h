@@ -0,0 +1,293 @@
+#ifndef __VM_ENGINE_H__
+#define __VM_ENGINE_H__
+
+#include <stdio.h>
+#include <limits.h>
+#include "vm.h"
+#include "bytecode.h"
+#include "vm_trace.h"
+#include "vm_input.h"
+#include "vm_output.h"
+#include "snapshot.h"
+#include "vm_perf.h"
+
+/**
+ * Execution engine of the virtual machine (vm.c).
+ * */
+
+// Conditions. PREEMPTED: the run stopped because its budget ran out (see
+// .. RunOptions.fuel). BLOCKED: an SIO read is waiting for input that has not
+// .. arrived yet (see InputSource.more). In both cases, running the machine
+// .. again resumes it.
+enum { CONT, HALT, PREEMPTED, BLOCKED };
+
+// Returns 1 if DIV and MOD are defined for the operands. Dividing by zero, or
+// .. INT_MIN by -1, is illegal and halts the machine like an illegal
+// .. instruction, in every engine.
+static inline int divisionDefined(int dividend, int divisor)
+{
+    return divisor != 0 && !(divisor == -1 && dividend == INT_MIN);
+}
+
+// Code memory of a loaded program
+typedef struct
+{
+    const PackedInstruction* ins; // the instructions, read-only while running
+    int numOfIns;
+    PackedInstruction* text;      // heap array, if loaded from a text code file
+    BytecodeImage* image;         // mapped file, if loaded from a bytecode file
+    SnapshotImage* snapshot;      // mapped file, if loaded from a snapshot (see snapshot.h)
+} CodeMemory;
+
+/**
+ * Superinstructions. At load time, the threaded engine replaces the first
+ * instruction of each of these sequences with a handler that executes the
+ * whole sequence in one dispatch. The other instructions of the sequence stay
+ * in place, so PC numbering and jump targets do not change.
+ * */
+typedef enum
+{
+    FUSED_LIT_LIT,          // LIT; LIT
+    FUSED_LIT_LIT_ADD,      // LIT; LIT; ADD
+    FUSED_LIT_LIT_SUB,      // LIT; LIT; SUB
+    FUSED_LIT_LIT_MUL,      // LIT; LIT; MUL
+    FUSED_LIT_STO,          // LIT; STO
+    FUSED_LOD_WRITE,        // LOD; SIO write
+    FUSED_LOD_LIT_EQL_JPC,  // LOD; LIT; EQL; JPC
+    FUSED_LOD_LIT_NEQ_JPC,
+    FUSED_LOD_LIT_LSS_JPC,
+    FUSED_LOD_LIT_LEQ_JPC,
+    FUSED_LOD_LIT_GTR_JPC,
+    FUSED_LOD_LIT_GEQ_JPC,
+    FUSED_FORMS             // number of fused forms
+} FusedForm;
+
+// Counters of the fusion pass
+typedef struct
+{
+    long rewrites[FUSED_FORMS]; // sequences replaced at load time
+    long executed[FUSED_FORMS]; // dispatches of each fused handler
+} FusionStats;
+
+// Number of cells of the stack of the virtual machine
+#define VM_STACK_CELLS (sizeof(((VirtualMachine*)0)->stack) / sizeof(int))
+
+// Number of registers of the virtual machine
+#define VM_REGISTERS (sizeof(((VirtualMachine*)0)->RF) / sizeof(int))
+
+/**
+ * Execution profile, filled by runProgram() when RunOptions.profile is set.
+ * Counters are added to, so a profile from createProfile() must be passed to
+ * the first run. Procedures are identified by their entry address (the CAL
+ * target); the main block is the procedure at 0. Instructions at numOfPCs and
+ * above are only counted in the totals and the opcodes.
+ * */
+typedef struct
+{
+    long instructions;                  // instructions executed
+    double seconds;                     // wall time of the runs
+    long opcodes[1 << PACKED_OP_BITS];  // executions per opcode
+    int numOfPCs;                       // length of the per-PC counters below
+    long* pcs;                          // executions per PC
+    long* taken;                        // jumps taken by the JPC at each PC
+    long* calls;                        // CALs per procedure
+    long* self;                         // instructions executed in each procedure
+    int frames[VM_STACK_CELLS];         // procedure running in the frame at each BP
+} Profile;
+
+// Options of a single run. A zeroed struct (or NULL) runs the program with
+// .. superinstructions and without any tracing.
+typedef struct
+{
+    FILE* trace;            // text execution history, or NULL
+    TraceWriter* recorder;  // binary execution trace, or NULL
+    int noFusion;           // 1 to run the instructions exactly as loaded
+    FusionStats* fusion;    // filled with the fusion counters, or NULL
+    int jit;                // 1 to compile to machine code when supported (see jit.h)
+    Profile* profile;       // execution counters and timing, or NULL
+    long* instructions;     // incremented by the number of instructions executed, or NULL
+    int* stackMark;         // raised to the highest stack cell written, or NULL
+    long fuel;              // instructions to run before preempting, or 0 for no limit
+    double deadline;        // wallClock() time to preempt at, or 0 for none
+    PerfCounters* counters; // opened hardware counters to add the run to (see vm_perf.h), or NULL
+} RunOptions;
+
+/**
+ * Budgets. The fuel and the deadline are only checked after a backward JMP or
+ * JPC and after a CAL, so straight-line code pays nothing for them; a run may
+ * overshoot its fuel by the instructions executed since the last check. The
+ * clock is read once every DEADLINE_CHECK_STEPS instructions at most.
+ * A preempted machine is left between two instructions with its PC at the
+ * next one: passing it to runProgram() or runLoadedProgram() again, with the
+ * same input stream, continues the program where it stopped. Budgeted runs
+ * do not use the JIT.
+ * */
+#define DEADLINE_CHECK_STEPS 65536
+
+/**
+ * Loads the program from a text code file, a bytecode file or a snapshot,
+ * whose machine state startMachine() restores.
+ * Returns 0 on success, -1 if the code file is invalid.
+ * */
+int loadCodeMemory(FILE*, CodeMemory* code);
+
+/**
+ * Releases the code memory filled by loadCodeMemory().
+ * */
+void freeCodeMemory(CodeMemory* code);
+
+/**
+ * Fetches and executes the instructions on the virtual machine until it halts.
+ * Superinstructions and the JIT are not used while tracing or profiling, and
+ * the JIT is not used when counting instructions or stack writes or when
+ * running with a budget.
+ * The program is verified first (see verify.h). If it is not, it runs on the
+ * checked path: without superinstructions or the JIT, and an instruction that
+ * would leave the machine halts it like an illegal instruction. Guarded
+ * programs run from the start on a machine from createVM() are the exception:
+ * they run without checks, and running the stack into its guard pages halts
+ * them the same way.
+ * Returns HALT, or PREEMPTED when the budget of the options ran out.
+ * */
+int runProgram(VirtualMachine* vm, const PackedInstruction* ins, int numOfIns,
+               FILE* vmIn, FILE* vmOut, const RunOptions* options);
+
+/**
+ * Reentrant interface for embedding.
+ *
+ * A program is loaded once into a VmProgram, which is never modified
+ * afterwards and can be shared between threads. Each thread runs it on its
+ * own VirtualMachine with its own input and output streams; the engine keeps
+ * no global state besides read-only tables, the locked set of machines that
+ * createVM() guarded, and the SIGSEGV and SIGBUS handler the first createVM()
+ * installs for guard pages. Machines can be reset and reused for the next job.
+ * */
+typedef struct VmProgram VmProgram;
+
+/**
+ * Loads, verifies and decodes the program from a text code file or a bytecode
+ * file. Snapshots are refused, since their state belongs to one machine. If
+ * jit is 1, the program is also compiled to machine code when supported.
+ * Programs that are not verified run on the checked path, see runProgram().
+ * Returns NULL if the code file is invalid.
+ * */
+VmProgram* loadProgram(FILE* inp, int jit);
+
+/**
+ * Releases a program. No machine may be running it.
+ * */
+void freeProgram(VmProgram* program);
+
+/**
+ * Returns the instructions of the program, and their number in numOfIns.
+ * */
+const PackedInstruction* programCode(const VmProgram* program, int* numOfIns);
+
+/**
+ * Returns 1 if the program was verified when it was loaded (see verify.h).
+ * */
+int programVerified(const VmProgram* program);
+
+/**
+ * Allocates a virtual machine in its initial state, or returns NULL.
+ * Its stack is followed by guard pages where the system allows it. Guarded
+ * programs (see verify.h) only run without checks on such machines; on any
+ * other machine they take the checked path.
+ * */
+VirtualMachine* createVM(void);
+
+/**
+ * Puts a virtual machine back into its initial state.
+ * */
+void resetVM(VirtualMachine* vm);
+
+/**
+ * Puts a virtual machine back into its initial state, clearing the stack only
+ * up to stackMark: the highest cell written since the last reset, as counted
+ * by RunOptions.stackMark. Cheaper than resetVM() for short runs.
+ * */
+void resetVMUsed(VirtualMachine* vm, int stackMark);
+
+/**
+ * Releases a virtual machine created by createVM().
+ * */
+void freeVM(VirtualMachine* vm);
+
+/**
+ * Runs the loaded program on the virtual machine until it halts, like
+ * runProgram(). options may be NULL; the streams, the trace writer and the
+ * counters named in the options must not be shared with concurrent runs.
+ * Returns HALT, or PREEMPTED when the budget of the options ran out.
+ * */
+int runLoadedProgram(const VmProgram* program, VirtualMachine* vm,
+                     FILE* vmIn, FILE* vmOut, const RunOptions* options);
+
+/**
+ * Runs the loaded program like runLoadedProgram(), with SIO channels owned by
+ * the caller, which is how a machine is resumed over many runs: the sink is
+ * not flushed at the end (see flushOutputSink()), and a source that may get
+ * more input makes SIO read stop the run when it has to wait. The read is then
+ * executed again by the next run. Such runs do not use the JIT. While tracing,
+ * the sink should be unbuffered.
+ * Returns HALT, PREEMPTED when the budget of the options ran out, or BLOCKED.
+ * */
+int runLoadedProgramWithChannels(const VmProgram* program, VirtualMachine* vm,
+                                 InputSource* in, OutputSink* out, const RunOptions* options);
+
+/**
+ * Prints how often each superinstruction was formed and executed.
+ * */
+void printFusionReport(FILE* out, const FusionStats* stats);
+
+/**
+ * Returns the time in seconds from an arbitrary starting point, for timing runs.
+ * */
+double wallClock(void);
+
+/**
+ * Allocates a zeroed profile with per-PC counters for a program of numOfIns
+ * instructions.
+ * Returns NULL if it cannot be allocated.
+ * */
+Profile* createProfile(int numOfIns);
+
+/**
+ * Releases a profile from createProfile().
+ * */
+void freeProfile(Profile* profile);
+
+/**
+ * Prints the profile sorted by execution count: totals and instructions per
+ * second, opcodes, hot PCs with their disassembly, procedures, and the
+ * taken/not-taken ratio of every executed JPC.
+ * */
+void printProfileReport(FILE* out, const Profile* profile, const PackedInstruction* ins, int numOfIns);
+
+/**
+ * Production entry point: runs the program without any tracing.
+ * */
+void runVM(FILE* inp, FILE* vm_inp, FILE* vm_outp);
+
+/**
+ * Runs the program like runVM() with the given options.
+ * */
+void runVMWithOptions(FILE* inp, FILE* vm_inp, FILE* vm_outp, const RunOptions* options);
+
+/**
+ * Runs the program like runVM() with the profiler on, then writes the profile
+ * report to reportOut.
+ * */
+void profileVM(FILE* inp, FILE* reportOut, FILE* vm_inp, FILE* vm_outp);
+
+/**
+ * Runs the program until it is about to execute its first SIO read, then
+ * writes the machine as a snapshot to snapshotOut (see snapshot.h). runVM()
+ * and simulateVM() given the snapshot instead of the code file skip everything
+ * the program does before reading input. SIO output written until then is
+ * kept in the snapshot and written again by every resumed run.
+ * Returns 0 on success, -1 if the code file is invalid, the program halts
+ * before reading input or the snapshot cannot be written.
+ * */
+int checkpointVM(FILE* inp, FILE* snapshotOut);
+
+#endif
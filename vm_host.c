@@ -0,0 +1,248 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program hosts interactive sessions of a program on a Unix domain socket
+*
+* Usage: vm_host [-s socket] [-t threads] [-q slice] <code file>
+* Build: link with vm_sched.c, vm.c, vm_trace.c, vm_output.c, vm_input.c,
+*        bytecode.c, jit.c, verify.c, snapshot.c, vm_perf.c and -lpthread
+*
+* Every connection runs the program on its own machine (see vm_sched.h): what
+* .. the client sends is the input of SIO read, and the SIO output is sent
+* .. back at the end of every time slice. Shutting down the sending side of
+* .. the connection ends the input. The connection is closed when the program
+* .. halts.
+* All connections are read by one thread with poll() and the programs run on
+* .. a few worker threads (-t), a slice of -q instructions at a time, so a
+* .. session waiting for input costs its machine and nothing else. A client
+* .. that does not read its output holds up the worker writing it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "vm_sched.h"
+
+#define HOST_SOCKET_PATH "/tmp/vm_host.sock"
+
+#define DEFAULT_WORKERS 4
+
+// Bytes read from a connection at a time
+#define HOST_READ_SIZE 4096
+
+typedef struct
+{
+    int fd;
+    FILE* out;              // SIO output, on a duplicate of fd
+    VmSession* session;
+    int slot;               // index in the tables of main()
+} Connection;
+
+// Connections whose program has stopped, written by the workers
+static int exitPipe[2];
+
+// Hand the connection back to the main thread, which closes it
+static void sessionExited(VmSession* session, int halted, void* context)
+{
+    (void)session;
+    (void)halted;
+    Connection* connection = context;
+    while(write(exitPipe[1], &connection, sizeof(connection)) < 0 && errno == EINTR)
+        ;
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = HOST_SOCKET_PATH;
+    int workers = DEFAULT_WORKERS;
+    long slice = 0;
+    int arg;
+    for(arg = 1; arg + 1 < argc; arg += 2)
+    {
+        if(strcmp(argv[arg], "-s") == 0)
+            path = argv[arg + 1];
+        else if(strcmp(argv[arg], "-t") == 0)
+            workers = atoi(argv[arg + 1]);
+        else if(strcmp(argv[arg], "-q") == 0)
+            slice = atol(argv[arg + 1]);
+        else
+            break;
+    }
+    if(arg != argc - 1 || workers < 1 || slice < 0)
+    {
+        fprintf(stderr, "Usage: %s [-s socket] [-t threads] [-q slice] <code file>\n", argv[0]);
+        return 1;
+    }
+
+    FILE* inp = fopen(argv[arg], "rb");
+    if(!inp)
+    {
+        fprintf(stderr, "Cannot open %s.\n", argv[arg]);
+        return 1;
+    }
+    VmProgram* program = loadProgram(inp, 0);
+    fclose(inp);
+    if(!program)
+    {
+        fprintf(stderr, "Invalid code file %s.\n", argv[arg]);
+        return 1;
+    }
+
+    // A client that hangs up must not kill the host
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path %s is too long.\n", path);
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if(listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+       listen(listener, SOMAXCONN) != 0 || pipe(exitPipe) != 0)
+    {
+        fprintf(stderr, "Cannot listen on %s.\n", path);
+        return 1;
+    }
+
+    Scheduler* scheduler = createScheduler(workers, slice);
+    if(!scheduler)
+    {
+        fprintf(stderr, "Cannot start the worker threads.\n");
+        return 1;
+    }
+
+    // fds[0] is the listener and fds[1] the exit pipe; fds[k] for k >= 2
+    // .. belongs to connections[k], and is negative (ignored by poll()) once
+    // .. the input of the connection has ended
+    int capacity = 64;
+    int used = 2;
+    struct pollfd* fds = malloc(capacity * sizeof(struct pollfd));
+    Connection** connections = malloc(capacity * sizeof(Connection*));
+    if(!fds || !connections)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    fds[1].fd = exitPipe[0];
+    fds[1].events = POLLIN;
+
+    char buffer[HOST_READ_SIZE];
+    for(;;)
+    {
+        if(poll(fds, used, -1) < 0)
+            continue;
+
+        // Close the connections of the programs that stopped
+        if(fds[1].revents & POLLIN)
+        {
+            Connection* stopped[HOST_READ_SIZE / sizeof(Connection*)];
+            ssize_t n = read(exitPipe[0], stopped, sizeof(stopped));
+            int i;
+            for(i = 0; i < n / (ssize_t)sizeof(Connection*); i++)
+            {
+                Connection* connection = stopped[i];
+                int slot = connection->slot;
+                used--;
+                fds[slot] = fds[used];
+                connections[slot] = connections[used];
+                connections[slot]->slot = slot;
+
+                releaseSession(connection->session);
+                fclose(connection->out);
+                close(connection->fd);
+                free(connection);
+            }
+        }
+
+        // Feed what the clients sent to their sessions
+        int k;
+        for(k = 2; k < used; k++)
+        {
+            if(fds[k].fd < 0 || !(fds[k].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            ssize_t n = read(fds[k].fd, buffer, sizeof(buffer));
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n > 0 && feedSession(connections[k]->session, buffer, n) == 0)
+                continue;
+            closeSessionInput(connections[k]->session);
+            fds[k].fd = -1;
+        }
+
+        // Start a session for every new connection
+        if(fds[0].revents & POLLIN)
+        {
+            int fd = accept(listener, NULL, NULL);
+            if(fd < 0)
+                continue;
+            // Without memory for the connection, it is refused; the tables
+            // .. only count as grown once both are
+            if(used == capacity)
+            {
+                struct pollfd* grownFds = realloc(fds, capacity * 2 * sizeof(struct pollfd));
+                if(grownFds)
+                    fds = grownFds;
+                Connection** grownConnections = NULL;
+                if(grownFds)
+                    grownConnections = realloc(connections, capacity * 2 * sizeof(Connection*));
+                if(grownConnections)
+                    connections = grownConnections;
+                if(!grownFds || !grownConnections)
+                {
+                    close(fd);
+                    continue;
+                }
+                capacity *= 2;
+            }
+
+            Connection* connection = calloc(1, sizeof(Connection));
+            if(!connection)
+            {
+                close(fd);
+                continue;
+            }
+            int copy = dup(fd);
+            connection->fd = fd;
+            connection->out = copy >= 0 ? fdopen(copy, "w") : NULL;
+            connection->slot = used;
+            if(!connection->out)
+            {
+                if(copy >= 0)
+                    close(copy);
+                close(fd);
+                free(connection);
+                continue;
+            }
+
+            // The session may stop before the next poll(), so the connection
+            // .. is in the tables first
+            fds[used].fd = fd;
+            fds[used].events = POLLIN;
+            fds[used].revents = 0;
+            connections[used] = connection;
+            used++;
+            connection->session = startSession(scheduler, program, connection->out, sessionExited, connection);
+            if(!connection->session)
+            {
+                used--;
+                fclose(connection->out);
+                close(fd);
+                free(connection);
+            }
+        }
+    }
+}
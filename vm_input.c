@@ -0,0 +1,134 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program parses the input of the SIO read instruction
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "vm_input.h"
+
+InputSource* openInputSource(FILE* in)
+{
+    InputSource* source = calloc(1, sizeof(InputSource));
+    if(!source)
+    {
+        fprintf(stderr, "Cannot allocate input reader.\n");
+        return NULL;
+    }
+    source->in = in;
+
+    // Map regular files and continue from the position of the stream, which
+    // .. accounts for anything stdio has already buffered
+    struct stat st;
+    long position = ftell(in);
+    if(position >= 0 && fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+        if(base != MAP_FAILED)
+        {
+            source->base = base;
+            source->size = st.st_size;
+            source->end = source->base + source->size;
+            source->next = (size_t)position < source->size ? source->base + position : source->end;
+        }
+    }
+    return source;
+}
+
+void initInputBuffer(InputSource* source, const char* data, size_t size, int more)
+{
+    // A NULL base would mean reading the stream
+    if(!data)
+        data = "";
+    source->in = NULL;
+    source->base = data;
+    source->size = size;
+    source->next = data;
+    source->end = data + size;
+    source->more = more;
+}
+
+// Returns the next character, or EOF
+static inline int nextChar(InputSource* source)
+{
+    if(!source->base)
+        return getc_unlocked(source->in);
+    return source->next < source->end ? (unsigned char)*source->next++ : EOF;
+}
+
+// Puts back the character just returned by nextChar()
+static inline void putBackChar(InputSource* source, int c)
+{
+    if(c == EOF)
+        return;
+    if(!source->base)
+        ungetc(c, source->in);
+    else
+        source->next--;
+}
+
+static inline int isSpace(int c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+int readInputNumber(InputSource* source, int* value)
+{
+    const char* start = source->next;
+    int c;
+    do
+    {
+        c = nextChar(source);
+    } while(isSpace(c));
+
+    int negative = 0;
+    if(c == '+' || c == '-')
+    {
+        negative = c == '-';
+        c = nextChar(source);
+    }
+
+    if(c < '0' || c > '9')
+    {
+        if(c == EOF && source->more)
+            goto wait;
+        putBackChar(source, c);
+        *value = 0;
+        return 0;
+    }
+
+    // Accumulate unsigned, so that out of range numbers wrap instead of
+    // .. overflowing, as they do with fscanf()
+    unsigned magnitude = 0;
+    while(c >= '0' && c <= '9')
+    {
+        magnitude = magnitude * 10 + (c - '0');
+        c = nextChar(source);
+    }
+    if(c == EOF && source->more)
+        goto wait;
+    putBackChar(source, c);
+
+    *value = (int)(negative ? 0u - magnitude : magnitude);
+    return 1;
+
+wait:
+    // The number may start or go on in input that has not arrived yet
+    source->next = start;
+    return -1;
+}
+
+void closeInputSource(InputSource* source)
+{
+    if(!source)
+        return;
+    if(source->base)
+    {
+        fseek(source->in, source->next - source->base, SEEK_SET);
+        munmap((void*)source->base, source->size);
+    }
+    free(source);
+}
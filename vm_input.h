@@ -0,0 +1,69 @@
+#ifndef __VM_INPUT_H__
+#define __VM_INPUT_H__
+
+#include <stdio.h>
+
+/**
+ * Input channel of the SIO read instruction.
+ *
+ * Numbers are parsed by hand with the rules of fscanf(in, "%d", ...): leading
+ * white space is skipped, then an optional sign and the decimal digits are
+ * read. Regular files are mapped and scanned in place; other streams (pipes,
+ * terminals) are read character by character without locking.
+ *
+ * End of input: when the input is exhausted, or the next characters do not
+ * form a number, the read yields 0. A character that is not part of a number
+ * is not consumed, so every later read yields 0 as well.
+ *
+ * Buffer sources (initInputBuffer()) read from memory. While more input may
+ * still be appended to them, a read that reaches the end of the buffer waits
+ * instead: it consumes nothing and reports that it has to be retried once the
+ * input has grown, since the number may go on in the next bytes.
+ * */
+
+typedef struct
+{
+    FILE* in;
+    const char* base;   // mapped file, or NULL when reading the stream
+    size_t size;
+    const char* next;   // next unread character of the mapping
+    const char* end;
+    int more;           // 1 if input may follow end (buffer sources only)
+} InputSource;
+
+/**
+ * Creates a source reading from the current position of the stream.
+ * Returns NULL if the source cannot be allocated.
+ * */
+InputSource* openInputSource(FILE* in);
+
+/**
+ * Initializes a source reading size bytes of data in place. If more is 1, the
+ * data may be followed by input that has not arrived yet. The source is not
+ * closed; next - data is the number of bytes consumed.
+ * */
+void initInputBuffer(InputSource*, const char* data, size_t size, int more);
+
+/**
+ * Returns 1 if a read may have to wait for input: the source reads a stream
+ * (pipe, terminal), or a buffer that more input may follow. Output is flushed
+ * before such reads only, so that a prompt is seen before the wait.
+ * */
+static inline int inputMayWait(const InputSource* source)
+{
+    return !source->base || source->more;
+}
+
+/**
+ * Reads the next number into value.
+ * Returns 1 on success, 0 at the end of input (value is then 0), or -1 if the
+ * source has to wait for more input (nothing is consumed, value is unchanged).
+ * */
+int readInputNumber(InputSource*, int* value);
+
+/**
+ * Moves the stream past the characters read and frees the source.
+ * */
+void closeInputSource(InputSource*);
+
+#endif
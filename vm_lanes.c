@@ -0,0 +1,351 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program runs instances of one program in lockstep, one vector per register
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "vm_lanes.h"
+
+// One register of every lane of a pack
+typedef int32_t LaneVector __attribute__((vector_size(VM_LANES * sizeof(int32_t))));
+
+// Lanes running in lockstep on one stack
+typedef struct
+{
+    LaneVector RF[VM_REGISTERS];
+    unsigned active;            // bit k is set if lane k of the group runs in this pack
+    int PC;
+    int BP;
+    int SP;
+    int IR;
+    long steps;                 // instructions executed since the start
+    int stack[VM_STACK_CELLS];
+} Pack;
+
+// Up to VM_LANES lanes started together. Packs are only ever split, so there
+// .. are never more packs than lanes.
+typedef struct
+{
+    const VmProgram* program;
+    const PackedInstruction* ins;
+    int numOfIns;
+    Lane* lanes;
+    Pack* packs;                // VM_LANES packs, aligned for the vectors
+    int ready[VM_LANES];        // packs waiting to run
+    int numOfReady;
+    int unused[VM_LANES];       // packs free for a split
+    int numOfUnused;
+    VirtualMachine* vm;         // runs the packs left with one lane
+} Group;
+
+// Every lane set to value. A macro, since passing 256-bit vectors to functions
+// .. depends on whether AVX is enabled.
+#define BROADCAST(value) ((LaneVector){ 0 } + (value))
+
+// Like getBasePointer() in vm.c: the BP of the frame L static levels down
+static int basePointer(const int* stack, int bp, int L)
+{
+    while(L > 0)
+    {
+        bp = stack[bp + 1];
+        L--;
+    }
+    return bp;
+}
+
+// Stop every lane of the pack. An illegal instruction is reported like the
+// .. scalar engine does, once per lane.
+static void stopLanes(Group* group, Pack* pack, int status)
+{
+    int k;
+    for(k = 0; k < VM_LANES; k++)
+    {
+        if(!(pack->active & (1u << k)))
+            continue;
+        Lane* lane = &group->lanes[k];
+        lane->status = status;
+        lane->instructions += pack->steps;
+        if(status == LANE_ILLEGAL)
+        {
+            flushOutputSink(lane->out);
+            fprintf(stderr, "Illegal instruction?");
+        }
+    }
+}
+
+// Finish the only lane of the pack on the scalar engine
+static void finishAlone(Group* group, Pack* pack)
+{
+    int k = __builtin_ctz(pack->active);
+    Lane* lane = &group->lanes[k];
+    VirtualMachine* vm = group->vm;
+
+    int i;
+    for(i = 0; i < (int)VM_REGISTERS; i++)
+        vm->RF[i] = pack->RF[i][k];
+    memcpy(vm->stack, pack->stack, sizeof(pack->stack));
+    vm->PC = pack->PC;
+    vm->BP = pack->BP;
+    vm->SP = pack->SP;
+    vm->IR = pack->IR;
+
+    lane->instructions += pack->steps;
+    RunOptions options = { .instructions = &lane->instructions };
+    runLoadedProgramWithChannels(group->program, vm, lane->in, lane->out, &options);
+
+    // Only SIO halt (opcode 11) ends a run normally
+    int halted = vm->IR >= 0 && vm->IR < group->numOfIns && packedOp(group->ins[vm->IR]) == 11;
+    lane->status = halted ? LANE_HALTED : LANE_ILLEGAL;
+}
+
+// Stop the lanes of the pack where a DIV or MOD of the dividends by the
+// .. divisors is illegal (see divisionDefined()), and finish the pack on the
+// .. scalar engine if one lane is left.
+// Returns 1 if the pack goes on with the lanes left.
+static int stopUndefinedDivisions(Group* group, Pack* pack, const LaneVector* dividends,
+                                  const LaneVector* divisors)
+{
+    unsigned undefined = 0;
+    int k;
+    for(k = 0; k < VM_LANES; k++)
+        if((pack->active & (1u << k)) && !divisionDefined((*dividends)[k], (*divisors)[k]))
+            undefined |= 1u << k;
+    if(!undefined)
+        return 1;
+
+    unsigned left = pack->active & ~undefined;
+    pack->active = undefined;
+    stopLanes(group, pack, LANE_ILLEGAL);
+    pack->active = left;
+    if(__builtin_popcount(left) != 1)
+        return left != 0;
+
+    // The last lane runs the instruction again on its own
+    pack->PC = pack->IR;
+    pack->steps--;
+    finishAlone(group, pack);
+    return 0;
+}
+
+// The lanes of the pack in taken go on at target in a copy of the pack
+static void splitPack(Group* group, Pack* pack, unsigned taken, int target)
+{
+    int index = group->unused[--group->numOfUnused];
+    Pack* copy = &group->packs[index];
+    memcpy(copy, pack, sizeof(Pack));
+    copy->active = taken;
+    copy->PC = target;
+    pack->active &= ~taken;
+    group->ready[group->numOfReady++] = index;
+}
+
+// Run the pack until all of its lanes have stopped or been split off
+static void runPack(Group* group, Pack* pack)
+{
+    const PackedInstruction* ins = group->ins;
+    LaneVector* RF = pack->RF;
+    int* stack = pack->stack;
+    int k;
+
+    if(__builtin_popcount(pack->active) == 1)
+    {
+        finishAlone(group, pack);
+        return;
+    }
+
+    for(;;)
+    {
+        if(pack->PC < 0 || pack->PC >= group->numOfIns)
+        {
+            stopLanes(group, pack, LANE_ILLEGAL);
+            return;
+        }
+        PackedInstruction word = ins[pack->PC];
+        int r = packedR(word);
+        int l = packedL(word);
+        int m = packedM(word);
+        pack->IR = pack->PC;
+        pack->PC++;
+        pack->steps++;
+
+        switch(packedOp(word))
+        {
+          case 1: // LIT
+            RF[r] = BROADCAST(m);
+            break;
+          case 2: // RTN
+            pack->SP = pack->BP - 1;
+            pack->BP = stack[pack->SP + 3];
+            pack->PC = stack[pack->SP + 4];
+            break;
+          case 3: // LOD, the stack is the same in every lane
+            RF[r] = BROADCAST(stack[basePointer(stack, pack->BP, l) + m]);
+            break;
+          case 4: // STO, which stores R itself
+            stack[basePointer(stack, pack->BP, l) + m] = r;
+            break;
+          case 5: // CAL
+            stack[pack->SP + 1] = 0;
+            stack[pack->SP + 2] = basePointer(stack, pack->BP, l);
+            stack[pack->SP + 3] = pack->BP;
+            stack[pack->SP + 4] = pack->PC;
+            pack->BP = pack->SP + 1;
+            pack->PC = m;
+            break;
+          case 6: // INC
+            pack->SP += m;
+            break;
+          case 7: // JMP
+            pack->PC = m;
+            break;
+          case 8: // JPC
+          {
+            LaneVector zero = RF[r] == 0;
+            unsigned taken = 0;
+            for(k = 0; k < VM_LANES; k++)
+                if(zero[k])
+                    taken |= 1u << k;
+            taken &= pack->active;
+
+            if(taken == pack->active)
+                pack->PC = m;
+            else if(taken)
+            {
+                splitPack(group, pack, taken, m);
+                if(__builtin_popcount(pack->active) == 1)
+                {
+                    finishAlone(group, pack);
+                    return;
+                }
+            }
+            break;
+          }
+          case 9: // SIO write
+            for(k = 0; k < VM_LANES; k++)
+                if(pack->active & (1u << k))
+                    writeOutputNumber(group->lanes[k].out, RF[r][k]);
+            break;
+          case 10: // SIO read, 0 at the end of input (see vm_input.h)
+            for(k = 0; k < VM_LANES; k++)
+            {
+                if(!(pack->active & (1u << k)))
+                    continue;
+                int value = 0;
+                readInputNumber(group->lanes[k].in, &value);
+                RF[r][k] = value;
+            }
+            break;
+          case 11: // SIO halt
+            stopLanes(group, pack, LANE_HALTED);
+            return;
+          case 12: // NEG
+            RF[r] = -RF[l];
+            break;
+          case 13: // ADD
+            RF[r] = RF[l] + RF[m];
+            break;
+          case 14: // SUB
+            RF[r] = RF[l] - RF[m];
+            break;
+          case 15: // MUL
+            RF[r] = RF[l] * RF[m];
+            break;
+          case 16: // DIV, only in the lanes of the pack
+            if(!stopUndefinedDivisions(group, pack, &RF[l], &RF[m]))
+                return;
+            for(k = 0; k < VM_LANES; k++)
+                if(pack->active & (1u << k))
+                    RF[r][k] = RF[l][k] / RF[m][k];
+            break;
+          case 17: // ODD
+            RF[r] = RF[r] % 2;
+            break;
+          case 18: // MOD, only in the lanes of the pack
+            if(!stopUndefinedDivisions(group, pack, &RF[l], &RF[m]))
+                return;
+            for(k = 0; k < VM_LANES; k++)
+                if(pack->active & (1u << k))
+                    RF[r][k] = RF[l][k] % RF[m][k];
+            break;
+          // Vector comparisons yield -1 in the lanes where they hold
+          case 19: // EQL
+            RF[r] = -(RF[l] == RF[m]);
+            break;
+          case 20: // NEQ
+            RF[r] = -(RF[l] != RF[m]);
+            break;
+          case 21: // LSS
+            RF[r] = -(RF[l] < RF[m]);
+            break;
+          case 22: // LEQ
+            RF[r] = -(RF[l] <= RF[m]);
+            break;
+          case 23: // GTR
+            RF[r] = -(RF[l] > RF[m]);
+            break;
+          case 24: // GEQ
+            RF[r] = -(RF[l] >= RF[m]);
+            break;
+          default:
+            stopLanes(group, pack, LANE_ILLEGAL);
+            return;
+        }
+    }
+}
+
+int runLanes(const VmProgram* program, Lane* lanes, int numOfLanes)
+{
+    // Verified programs cannot leave the stack or the registers, so packs
+    // .. run without checks
+    if(!programVerified(program))
+        return -1;
+
+    Group group;
+    memset(&group, 0, sizeof(group));
+    group.program = program;
+    group.ins = programCode(program, &group.numOfIns);
+    void* packs;
+    if(posix_memalign(&packs, sizeof(LaneVector), VM_LANES * sizeof(Pack)) != 0)
+        return -1;
+    group.packs = packs;
+    group.vm = createVM();
+    if(!group.vm)
+    {
+        free(packs);
+        return -1;
+    }
+
+    int first;
+    for(first = 0; first < numOfLanes; first += VM_LANES)
+    {
+        int n = numOfLanes - first < VM_LANES ? numOfLanes - first : VM_LANES;
+        group.lanes = lanes + first;
+        group.numOfUnused = 0;
+        int i;
+        for(i = VM_LANES - 1; i > 0; i--)
+            group.unused[group.numOfUnused++] = i;
+
+        // All lanes start in pack 0, in the initial state of the machine
+        Pack* pack = &group.packs[0];
+        memset(pack, 0, sizeof(Pack));
+        pack->BP = 1;
+        pack->active = (1u << n) - 1;
+        group.ready[0] = 0;
+        group.numOfReady = 1;
+
+        while(group.numOfReady > 0)
+        {
+            int index = group.ready[--group.numOfReady];
+            runPack(&group, &group.packs[index]);
+            group.unused[group.numOfUnused++] = index;
+        }
+    }
+
+    freeVM(group.vm);
+    free(packs);
+    return 0;
+}
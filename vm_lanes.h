@@ -0,0 +1,52 @@
+#ifndef __VM_LANES_H__
+#define __VM_LANES_H__
+
+#include <stdio.h>
+#include "vm_engine.h"
+
+/**
+ * Lockstep execution of one program over many independent inputs.
+ *
+ * Up to VM_LANES instances (lanes) of a verified program run as a pack that
+ * shares one PC, BP, SP and stack; only the registers differ between lanes.
+ * This is exact and not an approximation: STO stores its R field and CAL
+ * stores links and addresses, so nothing a lane reads as input ever reaches
+ * the stack, and lanes that took the same jumps have the same stack. Each
+ * register is a vector of lanes, so LIT, LOD, NEG and ADD..GEQ execute once
+ * for the whole pack with SSE2 or AVX2 instructions (GCC and Clang vector
+ * extensions; build with -mavx2 for 8 lanes per instruction). DIV and MOD are
+ * done lane by lane, so that lanes not in the pack cannot trap, and the lanes
+ * where they are illegal (see divisionDefined()) stop alone.
+ *
+ * When the lanes of a pack disagree on a JPC, the pack splits in two: the
+ * lanes taking the jump go on in a copy of the pack. A pack left with a
+ * single lane is finished by the scalar engine (runLoadedProgramWithChannels())
+ * on a VirtualMachine holding its state. Packs are never merged again.
+ * */
+
+// Instances per pack: one 256-bit vector of 32-bit registers
+#define VM_LANES 8
+
+// How a lane stopped
+enum { LANE_HALTED, LANE_ILLEGAL };
+
+// One instance of the program
+typedef struct
+{
+    InputSource* in;        // SIO read; must not wait for more input (InputSource.more is 0)
+    OutputSink* out;        // SIO write; flushed only before the illegal instruction message
+    int status;             // set by runLanes()
+    long instructions;      // incremented by the number of instructions the lane executed
+} Lane;
+
+/**
+ * Runs every lane from the initial state of the machine until it halts, each
+ * reading from and writing to its own channels. The output of every lane is
+ * the same as when it runs alone with runLoadedProgramWithChannels().
+ * Returns 0, or -1 without running anything if the program is not verified
+ * (see verify.h) or the packs cannot be allocated; such lanes have to run on
+ * their own.
+ * */
+int runLanes(const VmProgram* program, Lane* lanes, int numOfLanes);
+
+#endif
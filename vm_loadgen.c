@@ -0,0 +1,178 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program measures vm_daemon under load
+*
+* Usage: vm_loadgen [-s socket] [-c] [-t threads] [-n requests] <program file> [input file]
+* Build: link with vm_protocol.c and -lpthread
+*
+* Every thread opens its own connection and sends its share of the requests,
+* .. all with the same program and input (-c: VM code instead of PL/0
+* .. source). Throughput and the latency percentiles are printed at the end.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "vm_protocol.h"
+
+typedef struct
+{
+    const char* path;
+    uint32_t kind;
+    const char* program;
+    uint32_t programSize;
+    const char* input;
+    uint32_t inputSize;
+    int requests;           // requests to send
+    double* latencies;      // seconds, one per request
+    int completed;
+    int failed;             // responses other than RUN_HALTED
+    unsigned long long instructions;
+} Client;
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void* clientMain(void* argument)
+{
+    Client* client = argument;
+    int fd = connectDaemon(client->path);
+    if(fd < 0)
+        return NULL;
+
+    int i;
+    for(i = 0; i < client->requests; i++)
+    {
+        ResponseHeader response;
+        char* output;
+        double started = now();
+        if(callDaemon(fd, client->kind, client->program, client->programSize,
+                      client->input, client->inputSize, &response, &output) != 0)
+            break;
+        client->latencies[client->completed++] = now() - started;
+        client->failed += response.status != RUN_HALTED;
+        client->instructions += response.instructions;
+        free(output);
+    }
+    close(fd);
+    return NULL;
+}
+
+static int compareSeconds(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = VM_SOCKET_PATH;
+    uint32_t kind = PROGRAM_SOURCE;
+    int threads = 4;
+    int requests = 10000;
+    int arg = 1;
+    while(arg < argc && argv[arg][0] == '-')
+    {
+        if(strcmp(argv[arg], "-c") == 0)
+        {
+            kind = PROGRAM_CODE;
+            arg++;
+            continue;
+        }
+        if(arg + 1 >= argc)
+            break;
+        if(strcmp(argv[arg], "-s") == 0)
+            path = argv[arg + 1];
+        else if(strcmp(argv[arg], "-t") == 0)
+            threads = atoi(argv[arg + 1]);
+        else if(strcmp(argv[arg], "-n") == 0)
+            requests = atoi(argv[arg + 1]);
+        else
+            break;
+        arg += 2;
+    }
+    if(argc - arg < 1 || argc - arg > 2 || argv[arg][0] == '-' || threads < 1 || requests < 1)
+    {
+        fprintf(stderr, "Usage: %s [-s socket] [-c] [-t threads] [-n requests] <program file> [input file]\n", argv[0]);
+        return 1;
+    }
+
+    uint32_t programSize, inputSize = 0;
+    char* program = readFile(argv[arg], &programSize);
+    char* input = argc - arg > 1 ? readFile(argv[arg + 1], &inputSize) : calloc(1, 1);
+    if(!program || !input)
+        return 1;
+
+    Client* clients = calloc(threads, sizeof(Client));
+    pthread_t* ids = malloc(threads * sizeof(pthread_t));
+    int i;
+    for(i = 0; i < threads; i++)
+    {
+        Client* client = &clients[i];
+        client->path = path;
+        client->kind = kind;
+        client->program = program;
+        client->programSize = programSize;
+        client->input = input;
+        client->inputSize = inputSize;
+        client->requests = requests / threads + (i < requests % threads);
+        client->latencies = malloc((client->requests + 1) * sizeof(double));
+    }
+
+    double started = now();
+    for(i = 0; i < threads; i++)
+        pthread_create(&ids[i], NULL, clientMain, &clients[i]);
+    for(i = 0; i < threads; i++)
+        pthread_join(ids[i], NULL);
+    double seconds = now() - started;
+
+    // Merge the latencies of all clients
+    double* latencies = malloc(requests * sizeof(double));
+    int completed = 0, failed = 0;
+    unsigned long long instructions = 0;
+    for(i = 0; i < threads; i++)
+    {
+        memcpy(latencies + completed, clients[i].latencies, clients[i].completed * sizeof(double));
+        completed += clients[i].completed;
+        failed += clients[i].failed;
+        instructions += clients[i].instructions;
+        free(clients[i].latencies);
+    }
+    qsort(latencies, completed, sizeof(double), compareSeconds);
+
+    printf("***Load***\n");
+    printf("%-16s %12d \n", "requests", completed);
+    printf("%-16s %12d \n", "not halted", failed);
+    printf("%-16s %12d \n", "connections", threads);
+    printf("%-16s %12.6f \n", "seconds", seconds);
+    printf("%-16s %12.1f \n", "requests/s", seconds > 0 ? completed / seconds : 0);
+    printf("%-16s %12.0f \n", "instructions/s", seconds > 0 ? instructions / seconds : 0);
+
+    // Nearest-rank percentiles of the request round trips
+    static const double percentiles[] = { 50, 90, 99, 99.9, 100 };
+    for(i = 0; completed > 0 && i < (int)(sizeof(percentiles) / sizeof(percentiles[0])); i++)
+    {
+        int rank = (int)(percentiles[i] / 100 * completed + 0.999999);
+        if(rank < 1)
+            rank = 1;
+        char name[24];
+        snprintf(name, sizeof(name), "p%g ms", percentiles[i]);
+        printf("%-16s %12.3f \n", name, latencies[rank - 1] * 1000);
+    }
+
+    free(latencies);
+    free(clients);
+    free(ids);
+    free(program);
+    free(input);
+    return completed == requests ? 0 : 1;
+}
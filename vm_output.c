@@ -0,0 +1,43 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program buffers the output of the SIO write instruction
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "vm_output.h"
+
+OutputSink* openOutputSink(FILE* out)
+{
+    OutputSink* sink = malloc(sizeof(OutputSink));
+    if(!sink)
+    {
+        fprintf(stderr, "Cannot allocate output buffer.\n");
+        return NULL;
+    }
+    sink->out = out;
+    sink->used = 0;
+    sink->unbuffered = 0;
+    return sink;
+}
+
+int flushOutputSink(OutputSink* sink)
+{
+    if(sink->used && fwrite(sink->buffer, 1, sink->used, sink->out) != sink->used)
+    {
+        sink->used = 0;
+        return -1;
+    }
+    sink->used = 0;
+    return 0;
+}
+
+int closeOutputSink(OutputSink* sink)
+{
+    if(!sink)
+        return 0;
+    int status = flushOutputSink(sink);
+    free(sink);
+    return status;
+}
@@ -0,0 +1,76 @@
+#ifndef __VM_OUTPUT_H__
+#define __VM_OUTPUT_H__
+
+#include <stdio.h>
+
+/**
+ * Output channel of the SIO write instruction.
+ *
+ * Numbers are converted to decimal by hand and collected in a large buffer,
+ * which is handed to the output file only when it is full, when the machine
+ * halts, and before anything else is printed or read (SIO read, the illegal
+ * instruction message). The bytes written are the same as with
+ * fprintf(out, "%d ", value).
+ * */
+
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+
+// Longest text of one number: sign, 10 digits and the separating space
+#define OUTPUT_MAX_NUMBER 12
+
+typedef struct
+{
+    FILE* out;
+    size_t used;
+    int unbuffered;     // 1 to pass every number to the file at once
+    char buffer[OUTPUT_BUFFER_SIZE];
+} OutputSink;
+
+/**
+ * Creates a sink on the given file.
+ * Returns NULL if the sink cannot be allocated.
+ * */
+OutputSink* openOutputSink(FILE* out);
+
+/**
+ * Hands the buffered text to the output file.
+ * Returns 0 on success, -1 if writing to the file failed.
+ * */
+int flushOutputSink(OutputSink*);
+
+/**
+ * Flushes the sink and frees it.
+ * Returns 0 on success, -1 if writing to the file failed.
+ * */
+int closeOutputSink(OutputSink*);
+
+// Appends the value followed by a space, like fprintf(out, "%d ", value)
+static inline void writeOutputNumber(OutputSink* sink, int value)
+{
+    if(sink->used + OUTPUT_MAX_NUMBER > OUTPUT_BUFFER_SIZE)
+        flushOutputSink(sink);
+
+    // Digits are produced backwards; the magnitude is taken as unsigned so
+    // .. that INT_MIN converts too
+    char digits[OUTPUT_MAX_NUMBER];
+    int n = 0;
+    unsigned magnitude = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+    do
+    {
+        digits[n++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while(magnitude);
+
+    char* text = sink->buffer + sink->used;
+    if(value < 0)
+        *text++ = '-';
+    while(n > 0)
+        *text++ = digits[--n];
+    *text++ = ' ';
+    sink->used = text - sink->buffer;
+
+    if(sink->unbuffered)
+        flushOutputSink(sink);
+}
+
+#endif
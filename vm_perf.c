@@ -0,0 +1,177 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program reads the hardware performance counters around a run
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "vm_perf.h"
+
+#ifdef __linux__
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+// Names of the events in the report, indexed by PerfEvent
+static const char* eventNames[PERF_EVENTS] =
+{
+    "cycles", "instructions", "branches", "branch-misses", "L1d-misses", "LLC-misses"
+};
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+#ifdef __linux__
+
+// perf_event_open type and config of every PerfEvent
+static const struct
+{
+    uint32_t type;
+    uint64_t config;
+} events[PERF_EVENTS] =
+{
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+};
+
+int openPerfCounters(PerfCounters* counters)
+{
+    memset(counters, 0, sizeof(PerfCounters));
+    int available = 0;
+    int i;
+    for(i = 0; i < PERF_EVENTS; i++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        // This thread, on any CPU
+        counters->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        available += counters->fds[i] >= 0;
+    }
+    return available;
+}
+
+void startPerfCounters(PerfCounters* counters)
+{
+    int i;
+    for(i = 0; i < PERF_EVENTS; i++)
+    {
+        if(counters->fds[i] < 0)
+            continue;
+        ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    counters->started = now();
+}
+
+void stopPerfCounters(PerfCounters* counters)
+{
+    counters->seconds += now() - counters->started;
+    int i;
+    for(i = 0; i < PERF_EVENTS; i++)
+        if(counters->fds[i] >= 0)
+            ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+    for(i = 0; i < PERF_EVENTS; i++)
+    {
+        // value, time enabled, time running
+        uint64_t values[3];
+        if(counters->fds[i] < 0 || read(counters->fds[i], values, sizeof(values)) != sizeof(values))
+            continue;
+        if(values[2] > 0)
+            counters->counts[i] += (double)values[0] * values[1] / values[2];
+    }
+}
+
+void closePerfCounters(PerfCounters* counters)
+{
+    int i;
+    for(i = 0; i < PERF_EVENTS; i++)
+    {
+        if(counters->fds[i] >= 0)
+            close(counters->fds[i]);
+        counters->fds[i] = -1;
+    }
+}
+
+#else
+
+int openPerfCounters(PerfCounters* counters)
+{
+    memset(counters, 0, sizeof(PerfCounters));
+    int i;
+    for(i = 0; i < PERF_EVENTS; i++)
+        counters->fds[i] = -1;
+    return 0;
+}
+
+void startPerfCounters(PerfCounters* counters)
+{
+    counters->started = now();
+}
+
+void stopPerfCounters(PerfCounters* counters)
+{
+    counters->seconds += now() - counters->started;
+}
+
+void closePerfCounters(PerfCounters* counters)
+{
+}
+
+#endif
+
+void clearPerfCounters(PerfCounters* counters)
+{
+    memset(counters->counts, 0, sizeof(counters->counts));
+    counters->seconds = 0;
+}
+
+void printPerfReport(FILE* out, const char* phase, const PerfCounters* counters, long vmInstructions)
+{
+    fprintf(out, "***Counters: %s***\n", phase);
+    fprintf(out, "%-16s %16s %12s \n", "EVENT", "COUNT", "PER VM INS");
+    if(vmInstructions > 0)
+        fprintf(out, "%-16s %16ld %12s \n", "VM instructions", vmInstructions, "");
+
+    int i;
+    for(i = 0; i < PERF_EVENTS; i++)
+    {
+        fprintf(out, "%-16s ", eventNames[i]);
+        if(counters->fds[i] < 0)
+            fprintf(out, "%16s %12s \n", "n/a", "");
+        else if(vmInstructions > 0)
+            fprintf(out, "%16.0f %12.3f \n", counters->counts[i], counters->counts[i] / vmInstructions);
+        else
+            fprintf(out, "%16.0f %12s \n", counters->counts[i], "-");
+    }
+
+    const double* c = counters->counts;
+    if(counters->fds[PERF_BRANCHES] >= 0 && counters->fds[PERF_BRANCH_MISSES] >= 0 && c[PERF_BRANCHES] > 0)
+        fprintf(out, "%-16s %15.2f%% \n", "branch miss rate", c[PERF_BRANCH_MISSES] * 100 / c[PERF_BRANCHES]);
+    if(counters->fds[PERF_CYCLES] >= 0 && counters->fds[PERF_INSTRUCTIONS] >= 0 && c[PERF_CYCLES] > 0)
+        fprintf(out, "%-16s %16.2f \n", "host IPC", c[PERF_INSTRUCTIONS] / c[PERF_CYCLES]);
+    fprintf(out, "%-16s %16.6f \n", "seconds", counters->seconds);
+}
@@ -0,0 +1,68 @@
+#ifndef __VM_PERF_H__
+#define __VM_PERF_H__
+
+#include <stdio.h>
+
+/**
+ * Hardware performance counters of the calling thread (Linux perf_event_open).
+ *
+ * Only user-space events of the thread that opened the counters are counted.
+ * Events the host does not have, or is not allowed to count (see
+ * /proc/sys/kernel/perf_event_paranoid), are left out; on other systems none
+ * are available. When the kernel has to share the hardware counters between
+ * events, each count is scaled by the share of the time it was counting.
+ * */
+
+typedef enum
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,      // host instructions, not VM instructions
+    PERF_BRANCHES,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES,        // L1 data cache read misses
+    PERF_LLC_MISSES,        // last level cache read misses
+    PERF_EVENTS             // number of events
+} PerfEvent;
+
+typedef struct
+{
+    int fds[PERF_EVENTS];           // -1 for events that are not available
+    double counts[PERF_EVENTS];     // totals of the measured intervals
+    double seconds;                 // wall time of the measured intervals
+    double started;                 // monotonic clock at startPerfCounters()
+} PerfCounters;
+
+/**
+ * Opens the counters, stopped and with zero totals.
+ * Returns the number of events available.
+ * */
+int openPerfCounters(PerfCounters*);
+
+/**
+ * Starts counting a measured interval.
+ * */
+void startPerfCounters(PerfCounters*);
+
+/**
+ * Stops counting and adds the interval to the totals.
+ * */
+void stopPerfCounters(PerfCounters*);
+
+/**
+ * Sets the totals back to zero.
+ * */
+void clearPerfCounters(PerfCounters*);
+
+/**
+ * Closes the counters.
+ * */
+void closePerfCounters(PerfCounters*);
+
+/**
+ * Prints the totals of a phase, each also divided by vmInstructions (the VM
+ * instructions executed in the phase) unless it is 0, with the branch miss
+ * rate and the host instructions per cycle.
+ * */
+void printPerfReport(FILE* out, const char* phase, const PerfCounters*, long vmInstructions);
+
+#endif
@@ -0,0 +1,134 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program implements the socket protocol of vm_daemon
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "vm_protocol.h"
+
+int writeAll(int fd, const void* data, size_t size)
+{
+    const char* bytes = data;
+    while(size > 0)
+    {
+        ssize_t n = write(fd, bytes, size);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        bytes += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int readAll(int fd, void* data, size_t size)
+{
+    char* bytes = data;
+    while(size > 0)
+    {
+        ssize_t n = read(fd, bytes, size);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        bytes += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int connectDaemon(const char* path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path %s is too long.\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+    {
+        fprintf(stderr, "Cannot connect to %s.\n", path);
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int callDaemon(int fd, uint32_t kind, const void* program, uint32_t programSize,
+               const void* input, uint32_t inputSize,
+               ResponseHeader* response, char** output)
+{
+    RequestHeader request = { REQUEST_MAGIC, kind, programSize, inputSize };
+    if(writeAll(fd, &request, sizeof(request)) != 0 ||
+       writeAll(fd, program, programSize) != 0 ||
+       writeAll(fd, input, inputSize) != 0)
+        return -1;
+
+    if(readAll(fd, response, sizeof(*response)) != 0 || response->magic != RESPONSE_MAGIC ||
+       response->outputSize > MAX_MESSAGE_SIZE)
+        return -1;
+
+    *output = malloc(response->outputSize + 1);
+    if(!*output || readAll(fd, *output, response->outputSize) != 0)
+    {
+        free(*output);
+        return -1;
+    }
+    (*output)[response->outputSize] = '\0';
+    return 0;
+}
+
+char* readFile(const char* path, uint32_t* size)
+{
+    FILE* in = fopen(path, "rb");
+    if(!in)
+    {
+        fprintf(stderr, "Cannot open %s.\n", path);
+        return NULL;
+    }
+
+    size_t capacity = 4096;
+    size_t used = 0;
+    char* buffer = malloc(capacity);
+    size_t n;
+    while(buffer && (n = fread(buffer + used, 1, capacity - used, in)) > 0)
+    {
+        used += n;
+        if(used == capacity)
+        {
+            char* bigger = realloc(buffer, capacity * 2);
+            if(!bigger)
+            {
+                free(buffer);
+                buffer = NULL;
+                break;
+            }
+            buffer = bigger;
+            capacity *= 2;
+        }
+    }
+    fclose(in);
+
+    if(!buffer || used > MAX_MESSAGE_SIZE)
+    {
+        fprintf(stderr, "Cannot read %s.\n", path);
+        free(buffer);
+        return NULL;
+    }
+    *size = used;
+    return buffer;
+}
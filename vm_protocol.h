@@ -0,0 +1,89 @@
+#ifndef __VM_PROTOCOL_H__
+#define __VM_PROTOCOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Messages between vm_daemon and its clients (vm_client, vm_loadgen) over a
+ * Unix domain stream socket. A connection carries any number of requests,
+ * each answered by one response:
+ *
+ *   RequestHeader,  programSize bytes of program, inputSize bytes of input
+ *   ResponseHeader, outputSize bytes of SIO output
+ *
+ * The program is PL/0 source or VM code (a text code file or a bytecode
+ * file). The input is what SIO read consumes. Both ends run on the same
+ * machine, so values are in its byte order.
+ * */
+
+#define VM_SOCKET_PATH "/tmp/vm_daemon.sock"
+
+// "VMRQ" and "VMRS" when read as little-endian bytes
+#define REQUEST_MAGIC  0x51524d56
+#define RESPONSE_MAGIC 0x53524d56
+
+// Largest program, input or output accepted in one message
+#define MAX_MESSAGE_SIZE (64 << 20)
+
+// Kind of program in a request
+enum { PROGRAM_SOURCE, PROGRAM_CODE };
+
+// Status of a response
+enum
+{
+    RUN_HALTED,         // halted by SIO halt
+    RUN_ILLEGAL,        // halted by an illegal instruction
+    RUN_COMPILE_ERROR,  // the source or code file was rejected
+    RUN_BAD_REQUEST,    // malformed request or output too large
+    RUN_OUT_OF_BUDGET   // stopped by the daemon's instruction or time limit
+};
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t kind;          // PROGRAM_SOURCE or PROGRAM_CODE
+    uint32_t programSize;
+    uint32_t inputSize;
+} RequestHeader;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t status;
+    uint32_t cacheHit;      // 1 if the program was already loaded
+    uint32_t outputSize;
+    uint64_t instructions;  // instructions executed
+    uint64_t compileMicros; // compiling and decoding, 0 on a cache hit
+    uint64_t runMicros;
+} ResponseHeader;
+
+/**
+ * Writes or reads exactly size bytes, retrying on short transfers.
+ * Returns 0 on success, -1 on error or end of stream.
+ * */
+int writeAll(int fd, const void* data, size_t size);
+int readAll(int fd, void* data, size_t size);
+
+/**
+ * Connects to the daemon listening on path.
+ * Returns the socket, or -1 and prints the reason on stderr.
+ * */
+int connectDaemon(const char* path);
+
+/**
+ * Sends a request and reads its response. *output is a heap buffer of
+ * response->outputSize bytes that the caller frees.
+ * Returns 0 on success, -1 if the connection failed.
+ * */
+int callDaemon(int fd, uint32_t kind, const void* program, uint32_t programSize,
+               const void* input, uint32_t inputSize,
+               ResponseHeader* response, char** output);
+
+/**
+ * Reads a whole file into a heap buffer and stores its size.
+ * Returns NULL and prints the reason on stderr if it cannot be read.
+ * */
+char* readFile(const char* path, uint32_t* size);
+
+#endif
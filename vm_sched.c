@@ -0,0 +1,332 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program multiplexes virtual machine sessions on a few threads
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "vm_sched.h"
+
+// Instructions a session runs before its worker moves on, if not given
+#define DEFAULT_SLICE_FUEL 100000
+
+// Where a session is
+enum
+{
+    SESSION_QUEUED,     // in the run queue
+    SESSION_RUNNING,    // taken by a worker
+    SESSION_WAITING,    // its SIO read waits for input
+    SESSION_DONE        // the program has stopped
+};
+
+struct VmSession
+{
+    Scheduler* scheduler;
+    const VmProgram* program;
+    VirtualMachine* vm;
+    FILE* out;
+    SessionExit onExit;
+    void* context;
+
+    // Guarded by the scheduler's lock
+    int state;
+    int released;           // 1 once the owner gave the session up
+    int inputClosed;
+    char* pending;          // input fed since the session was last taken
+    size_t pendingSize;
+    size_t pendingCapacity;
+    long instructions;
+    VmSession* next;        // in the run queue
+
+    // Owned by the worker running the session
+    char* input;            // input the machine has not read yet starts at consumed
+    size_t inputSize;
+    size_t inputCapacity;
+    size_t consumed;
+};
+
+struct Scheduler
+{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;   // signaled when a session is queued or on stop
+    VmSession* head;        // run queue
+    VmSession* tail;
+    int stopping;
+    long sliceFuel;
+    pthread_t* threads;
+    int numOfThreads;
+};
+
+// Append the session to the run queue; the lock is held
+static void enqueueSession(Scheduler* scheduler, VmSession* session)
+{
+    session->state = SESSION_QUEUED;
+    session->next = NULL;
+    if(scheduler->tail)
+        scheduler->tail->next = session;
+    else
+        scheduler->head = session;
+    scheduler->tail = session;
+    pthread_cond_signal(&scheduler->ready);
+}
+
+// Take the session at the front of the run queue, waiting for one; the lock
+// .. is held. Returns NULL when the scheduler stops.
+static VmSession* dequeueSession(Scheduler* scheduler)
+{
+    while(!scheduler->head && !scheduler->stopping)
+        pthread_cond_wait(&scheduler->ready, &scheduler->lock);
+    if(scheduler->stopping)
+        return NULL;
+    VmSession* session = scheduler->head;
+    scheduler->head = session->next;
+    if(!scheduler->head)
+        scheduler->tail = NULL;
+    return session;
+}
+
+static void freeSession(VmSession* session)
+{
+    freeVM(session->vm);
+    free(session->pending);
+    free(session->input);
+    free(session);
+}
+
+// Grow the buffer to hold at least size bytes.
+// Returns 0 on success, -1 if it cannot be grown.
+static int reserve(char** buffer, size_t* capacity, size_t size)
+{
+    if(size <= *capacity)
+        return 0;
+    size_t bigger = *capacity ? *capacity : 256;
+    while(bigger < size)
+        bigger *= 2;
+    char* grown = realloc(*buffer, bigger);
+    if(!grown)
+        return -1;
+    *buffer = grown;
+    *capacity = bigger;
+    return 0;
+}
+
+// Move the input fed meanwhile behind the unread input; the lock is held
+static void takePendingInput(VmSession* session)
+{
+    if(session->pendingSize == 0)
+        return;
+    size_t unread = session->inputSize - session->consumed;
+    memmove(session->input, session->input + session->consumed, unread);
+    session->inputSize = unread;
+    session->consumed = 0;
+    if(reserve(&session->input, &session->inputCapacity, unread + session->pendingSize) != 0)
+        return;
+    memcpy(session->input + unread, session->pending, session->pendingSize);
+    session->inputSize += session->pendingSize;
+    session->pendingSize = 0;
+}
+
+static void* workerMain(void* argument)
+{
+    Scheduler* scheduler = argument;
+
+    // One output buffer per worker, pointed at the file of the session it runs
+    OutputSink* sink = openOutputSink(NULL);
+    if(!sink)
+        return NULL;
+
+    pthread_mutex_lock(&scheduler->lock);
+    VmSession* session;
+    while((session = dequeueSession(scheduler)))
+    {
+        if(session->released)
+        {
+            freeSession(session);
+            continue;
+        }
+        session->state = SESSION_RUNNING;
+        takePendingInput(session);
+        int more = !session->inputClosed;
+        pthread_mutex_unlock(&scheduler->lock);
+
+        // Run one slice
+        InputSource in;
+        initInputBuffer(&in, session->input + session->consumed, session->inputSize - session->consumed, more);
+        sink->out = session->out;
+        long instructions = 0;
+        RunOptions options = { .instructions = &instructions, .fuel = scheduler->sliceFuel };
+        int flag = runLoadedProgramWithChannels(session->program, session->vm, &in, sink, &options);
+        flushOutputSink(sink);
+        fflush(session->out);
+        session->consumed += in.next - in.base;
+
+        int halted = 0;
+        if(flag == HALT)
+        {
+            // Only SIO halt (opcode 11) ends a run normally
+            int numOfIns;
+            const PackedInstruction* ins = programCode(session->program, &numOfIns);
+            VirtualMachine* vm = session->vm;
+            halted = vm->IR >= 0 && vm->IR < numOfIns && packedOp(ins[vm->IR]) == 11;
+        }
+
+        pthread_mutex_lock(&scheduler->lock);
+        session->instructions += instructions;
+        if(flag == HALT && !session->released)
+        {
+            // The owner may release the session from the callback, or from
+            // .. another thread meanwhile; it is freed below in that case
+            pthread_mutex_unlock(&scheduler->lock);
+            if(session->onExit)
+                session->onExit(session, halted, session->context);
+            pthread_mutex_lock(&scheduler->lock);
+        }
+
+        if(session->released)
+            freeSession(session);
+        else if(flag == HALT)
+            session->state = SESSION_DONE;
+        else if(flag == BLOCKED && session->pendingSize == 0 && !session->inputClosed)
+            session->state = SESSION_WAITING;
+        else
+            enqueueSession(scheduler, session);
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+
+    closeOutputSink(sink);
+    return NULL;
+}
+
+Scheduler* createScheduler(int workers, long sliceFuel)
+{
+    Scheduler* scheduler = calloc(1, sizeof(Scheduler));
+    if(!scheduler)
+        return NULL;
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->ready, NULL);
+    scheduler->sliceFuel = sliceFuel > 0 ? sliceFuel : DEFAULT_SLICE_FUEL;
+    scheduler->threads = malloc(workers * sizeof(pthread_t));
+    if(!scheduler->threads)
+    {
+        destroyScheduler(scheduler);
+        return NULL;
+    }
+
+    int i;
+    for(i = 0; i < workers; i++)
+    {
+        if(pthread_create(&scheduler->threads[i], NULL, workerMain, scheduler) != 0)
+        {
+            destroyScheduler(scheduler);
+            return NULL;
+        }
+        scheduler->numOfThreads++;
+    }
+    return scheduler;
+}
+
+void destroyScheduler(Scheduler* scheduler)
+{
+    if(!scheduler)
+        return;
+
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->stopping = 1;
+    pthread_cond_broadcast(&scheduler->ready);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    int i;
+    for(i = 0; i < scheduler->numOfThreads; i++)
+        pthread_join(scheduler->threads[i], NULL);
+
+    // Released sessions no worker got to
+    while(scheduler->head)
+    {
+        VmSession* session = scheduler->head;
+        scheduler->head = session->next;
+        freeSession(session);
+    }
+
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_cond_destroy(&scheduler->ready);
+    free(scheduler->threads);
+    free(scheduler);
+}
+
+VmSession* startSession(Scheduler* scheduler, const VmProgram* program, FILE* out, SessionExit onExit, void* context)
+{
+    VmSession* session = calloc(1, sizeof(VmSession));
+    if(!session)
+        return NULL;
+    session->vm = createVM();
+    if(!session->vm)
+    {
+        free(session);
+        return NULL;
+    }
+    session->scheduler = scheduler;
+    session->program = program;
+    session->out = out;
+    session->onExit = onExit;
+    session->context = context;
+
+    pthread_mutex_lock(&scheduler->lock);
+    enqueueSession(scheduler, session);
+    pthread_mutex_unlock(&scheduler->lock);
+    return session;
+}
+
+int feedSession(VmSession* session, const void* bytes, size_t size)
+{
+    Scheduler* scheduler = session->scheduler;
+    int err = 0;
+    pthread_mutex_lock(&scheduler->lock);
+    if(session->state != SESSION_DONE && !session->inputClosed)
+    {
+        err = reserve(&session->pending, &session->pendingCapacity, session->pendingSize + size);
+        if(err == 0)
+        {
+            memcpy(session->pending + session->pendingSize, bytes, size);
+            session->pendingSize += size;
+            if(session->state == SESSION_WAITING)
+                enqueueSession(scheduler, session);
+        }
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    return err;
+}
+
+void closeSessionInput(VmSession* session)
+{
+    Scheduler* scheduler = session->scheduler;
+    pthread_mutex_lock(&scheduler->lock);
+    session->inputClosed = 1;
+    if(session->state == SESSION_WAITING)
+        enqueueSession(scheduler, session);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+long sessionInstructions(VmSession* session)
+{
+    Scheduler* scheduler = session->scheduler;
+    pthread_mutex_lock(&scheduler->lock);
+    long instructions = session->instructions;
+    pthread_mutex_unlock(&scheduler->lock);
+    return instructions;
+}
+
+void releaseSession(VmSession* session)
+{
+    Scheduler* scheduler = session->scheduler;
+    pthread_mutex_lock(&scheduler->lock);
+    session->released = 1;
+
+    // Queued and running sessions are freed by the worker that takes them next
+    int unused = session->state == SESSION_WAITING || session->state == SESSION_DONE;
+    pthread_mutex_unlock(&scheduler->lock);
+    if(unused)
+        freeSession(session);
+}
@@ -0,0 +1,75 @@
+#ifndef __VM_SCHED_H__
+#define __VM_SCHED_H__
+
+#include <stdio.h>
+#include "vm_engine.h"
+
+/**
+ * Cooperative scheduler running many virtual machines on a few worker threads.
+ *
+ * Every session is a program running on its own VirtualMachine. A worker runs
+ * a session for one time slice (a number of instructions, see RunOptions.fuel)
+ * and moves on to the next one; the session goes back to the end of the run
+ * queue. A session whose SIO read has to wait for input is set aside until
+ * feedSession() or closeSessionInput() is called for it, so no worker ever
+ * blocks on input. The whole state of a stopped session is its machine and the
+ * input it has not read yet.
+ *
+ * SIO output is written to the session's file at the end of every slice.
+ * */
+
+typedef struct Scheduler Scheduler;
+typedef struct VmSession VmSession;
+
+/**
+ * Called by a worker when the program of a session stops for good: halted is
+ * 1 after SIO halt, 0 after an illegal instruction. The session may be
+ * released from the callback.
+ * */
+typedef void (*SessionExit)(VmSession* session, int halted, void* context);
+
+/**
+ * Starts the worker threads. sliceFuel is the number of instructions a session
+ * runs before the worker moves on, or 0 for the default.
+ * Returns NULL if the scheduler cannot be started.
+ * */
+Scheduler* createScheduler(int workers, long sliceFuel);
+
+/**
+ * Stops the worker threads and frees the scheduler. Every session must have
+ * been released.
+ * */
+void destroyScheduler(Scheduler*);
+
+/**
+ * Starts running the program on a new machine. SIO output goes to out, which
+ * the caller keeps open until the session is released. The program must stay
+ * loaded until then as well. onExit may be NULL.
+ * Returns NULL if the session cannot be allocated.
+ * */
+VmSession* startSession(Scheduler*, const VmProgram* program, FILE* out, SessionExit onExit, void* context);
+
+/**
+ * Appends bytes to the input of the session's SIO reads.
+ * Returns 0 on success, -1 if the input cannot be stored.
+ * */
+int feedSession(VmSession*, const void* bytes, size_t size);
+
+/**
+ * Marks the end of the session's input: reads past it yield 0 (see vm_input.h).
+ * */
+void closeSessionInput(VmSession*);
+
+/**
+ * Returns the number of instructions the session has executed so far.
+ * */
+long sessionInstructions(VmSession*);
+
+/**
+ * Gives up the session. A program that has not stopped yet is not run any
+ * more and its exit callback is not called. The session is freed as soon as
+ * no worker uses it.
+ * */
+void releaseSession(VmSession*);
+
+#endif
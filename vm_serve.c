@@ -0,0 +1,75 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program runs a loaded program once per input record
+*
+* Usage: vm_serve <code file>
+* Build: link with vm.c, vm_trace.c, vm_output.c, vm_input.c, bytecode.c, jit.c,
+*        verify.c, snapshot.c and vm_perf.c
+*
+* Every line of stdin is one record: the integers read by SIO read during one
+* .. run of the program. After the run halts, everything written by SIO write
+* .. is printed on stdout as one line and stdout is flushed, so that the tool
+* .. can sit behind a pipe and answer records one at a time.
+*
+* The program is loaded and decoded once. Between records only the
+* .. registers and the stack cells written by the previous run are cleared.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "vm_engine.h"
+
+int main(int argc, char** argv)
+{
+    if(argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <code file>\n", argv[0]);
+        return 1;
+    }
+
+    FILE* code = fopen(argv[1], "rb");
+    if(!code)
+    {
+        fprintf(stderr, "Cannot open %s.\n", argv[1]);
+        return 1;
+    }
+    VmProgram* program = loadProgram(code, 0);
+    fclose(code);
+    if(!program)
+        return 1;
+
+    VirtualMachine* vm = createVM();
+    if(!vm)
+    {
+        freeProgram(program);
+        return 1;
+    }
+
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int stackMark = 0;
+    RunOptions options = { .stackMark = &stackMark };
+    while((length = getline(&line, &capacity, stdin)) > 0)
+    {
+        // The record is the input stream of this run
+        FILE* record = fmemopen(line, length, "r");
+        if(!record)
+            break;
+
+        runLoadedProgram(program, vm, record, stdout, &options);
+        fclose(record);
+
+        fputc('\n', stdout);
+        fflush(stdout);
+
+        resetVMUsed(vm, stackMark);
+        stackMark = 0;
+    }
+
+    free(line);
+    freeVM(vm);
+    freeProgram(program);
+    return 0;
+}
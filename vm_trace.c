@@ -0,0 +1,302 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program writes and reads binary execution traces of the virtual machine
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm_trace.h"
+
+// Write the buffered bytes to the trace file. The buffer is emptied even if
+// .. writing fails, which is remembered for closeTraceWriter().
+static int flushTraceWriter(TraceWriter* writer)
+{
+    if(writer->used && fwrite(writer->buffer, 1, writer->used, writer->out) != writer->used)
+    {
+        writer->used = 0;
+        writer->failed = 1;
+        return -1;
+    }
+    writer->used = 0;
+    return 0;
+}
+
+// Append size bytes to the buffer, flushing it first if they do not fit
+static void appendTrace(TraceWriter* writer, const void* data, size_t size)
+{
+    if(writer->used + size > TRACE_BUFFER_SIZE)
+        flushTraceWriter(writer);
+    memcpy(writer->buffer + writer->used, data, size);
+    writer->used += size;
+}
+
+TraceWriter* openTraceWriter(FILE* out)
+{
+    TraceWriter* writer = malloc(sizeof(TraceWriter));
+    if(!writer)
+    {
+        fprintf(stderr, "Cannot allocate trace buffer.\n");
+        return NULL;
+    }
+    writer->out = out;
+    writer->used = 0;
+    writer->failed = 0;
+
+    TraceFileHeader header = { TRACE_MAGIC, TRACE_VERSION, sizeof(TraceRecord) };
+    appendTrace(writer, &header, sizeof(header));
+    return writer;
+}
+
+void writeTraceStep(TraceWriter* writer, VirtualMachine* vm, Instruction insi)
+{
+    int cells[TRACE_MAX_DELTAS];
+    int nDeltas = stackWrites(vm, insi, cells);
+
+    TraceRecord record;
+    record.ir = vm->IR;
+    record.m = insi.m;
+    record.pc = vm->PC;
+    record.bp = vm->BP;
+    record.sp = vm->SP;
+    record.op = insi.op;
+    record.r = insi.r;
+    record.l = insi.l;
+    record.nDeltas = nDeltas;
+    appendTrace(writer, &record, sizeof(record));
+
+    int i;
+    for(i = 0; i < nDeltas; i++)
+    {
+        TraceDelta delta = { cells[i], vm->stack[cells[i]] };
+        appendTrace(writer, &delta, sizeof(delta));
+    }
+}
+
+int closeTraceWriter(TraceWriter* writer)
+{
+    int err = flushTraceWriter(writer);
+    if(!err && fflush(writer->out) != 0)
+        err = -1;
+    if(writer->failed)
+        err = -1;
+    free(writer);
+    return err;
+}
+
+int readTraceHeader(FILE* in)
+{
+    TraceFileHeader header;
+    if(fread(&header, sizeof(header), 1, in) != 1)
+        return -1;
+    if(header.magic != TRACE_MAGIC || header.version != TRACE_VERSION || header.recordSize != sizeof(TraceRecord))
+        return -1;
+    return 0;
+}
+
+int readTraceStep(FILE* in, TraceRecord* record, TraceDelta deltas[TRACE_MAX_DELTAS])
+{
+    size_t n = fread(record, 1, sizeof(TraceRecord), in);
+    if(n == 0)
+        return 0;
+    if(n != sizeof(TraceRecord) || record->nDeltas > TRACE_MAX_DELTAS)
+        return -1;
+    if(record->nDeltas && fread(deltas, sizeof(TraceDelta), record->nDeltas, in) != record->nDeltas)
+        return -1;
+    return 1;
+}
+
+// Cells of the stack of a virtual machine
+#define VIEW_CELLS ((int)(sizeof(((VirtualMachine*)0)->stack) / sizeof(int)))
+
+// Longest text of a cell: "| ", a formatted int and a space
+#define VIEW_CELL_TEXT 16
+
+struct StackView
+{
+    int valid;                          // 0 when the next step renders everything
+    int sp;                             // SP the text was rendered for
+    int frames[VIEW_CELLS];             // base pointers of the records, bottom-most first
+    int numOfFrames;
+    unsigned char isBase[VIEW_CELLS];   // 1 for the cells in frames
+    int offsets[VIEW_CELLS + 1];        // text of cell i starts at offsets[i - 1], ends at offsets[i]
+    char text[VIEW_CELLS * VIEW_CELL_TEXT];
+};
+
+StackView* openStackView(void)
+{
+    StackView* view = malloc(sizeof(StackView));
+    if(!view)
+        return NULL;
+    view->valid = 0;
+    view->numOfFrames = 0;
+    memset(view->isBase, 0, sizeof(view->isBase));
+    return view;
+}
+
+void closeStackView(StackView* view)
+{
+    free(view);
+}
+
+// Format cell i into buffer, as dumpStack() prints it.
+// Returns the length of the text.
+static int formatCell(const StackView* view, const int* stack, int i, char* buffer)
+{
+    return snprintf(buffer, VIEW_CELL_TEXT, "%s%3d ", view->isBase[i] ? "| " : "", stack[i]);
+}
+
+// Format cell i again, which is at most SP, moving the text above it if its
+// .. length changed
+static void updateCell(StackView* view, const int* stack, int i)
+{
+    char buffer[VIEW_CELL_TEXT];
+    int length = formatCell(view, stack, i, buffer);
+    int start = view->offsets[i - 1];
+    int shift = length - (view->offsets[i] - start);
+    if(shift != 0)
+    {
+        memmove(view->text + view->offsets[i] + shift, view->text + view->offsets[i],
+                view->offsets[view->sp] - view->offsets[i]);
+        int j;
+        for(j = i; j <= view->sp; j++)
+            view->offsets[j] += shift;
+    }
+    memcpy(view->text + start, buffer, length);
+}
+
+// Append the cells above SP up to sp
+static void growView(StackView* view, const int* stack, int sp)
+{
+    int i;
+    for(i = view->sp + 1; i <= sp; i++)
+        view->offsets[i] = view->offsets[i - 1] +
+                           formatCell(view, stack, i, view->text + view->offsets[i - 1]);
+    view->sp = sp;
+}
+
+// Rebuild the frames by walking the dynamic links down from bp.
+// Returns 0, or -1 if they do not lead down to the bottom-most record (BP 1),
+// .. which leaves the view invalid.
+static int findFrames(StackView* view, const int* stack, int bp)
+{
+    int i;
+    for(i = 0; i < view->numOfFrames; i++)
+        view->isBase[view->frames[i]] = 0;
+    view->numOfFrames = 0;
+
+    while(bp != 1)
+    {
+        if(bp < 1 || bp + 2 >= VIEW_CELLS || stack[bp + 2] >= bp)
+        {
+            view->numOfFrames = 0;
+            view->valid = 0;
+            return -1;
+        }
+        view->frames[view->numOfFrames++] = bp;
+        bp = stack[bp + 2];
+    }
+    view->frames[view->numOfFrames++] = 1;
+
+    // The walk found them top first
+    for(i = 0; i < view->numOfFrames / 2; i++)
+    {
+        int top = view->frames[i];
+        view->frames[i] = view->frames[view->numOfFrames - 1 - i];
+        view->frames[view->numOfFrames - 1 - i] = top;
+    }
+    for(i = 0; i < view->numOfFrames; i++)
+        view->isBase[view->frames[i]] = 1;
+    return 0;
+}
+
+// Render every cell of the machine again.
+// Returns 0, or -1 if the view cannot follow the machine.
+static int renderView(StackView* view, const VirtualMachine* vm)
+{
+    if(findFrames(view, vm->stack, vm->BP) != 0)
+        return -1;
+    view->offsets[0] = 0;
+    view->sp = 0;
+    growView(view, vm->stack, vm->SP);
+    view->valid = 1;
+    return 0;
+}
+
+// Bring the view to the machine after executing (insi).
+// Returns 0, or -1 if the view cannot follow the machine.
+static int updateView(StackView* view, VirtualMachine* vm, Instruction insi)
+{
+    const int* stack = vm->stack;
+
+    // Every record below the current one ends right below the next base, so
+    // .. the text is the cells 1..SP only as long as SP does not drop under BP
+    if(vm->BP < 1 || vm->SP < vm->BP - 1 || vm->SP >= VIEW_CELLS)
+    {
+        view->valid = 0;
+        return -1;
+    }
+    if(!view->valid)
+        return renderView(view, vm);
+
+    int cells[TRACE_MAX_DELTAS];
+    int n = stackWrites(vm, insi, cells);
+    int i;
+    for(i = 0; i < n; i++)
+    {
+        // A cell out of the stack, a STO that did not store its R field where
+        // .. stackWrites() expects it, or an overwritten dynamic link all call
+        // .. for a full render
+        if(cells[i] < 1 || cells[i] >= VIEW_CELLS || (insi.op == 4 && stack[cells[i]] != insi.r) ||
+           (cells[i] >= 2 && view->isBase[cells[i] - 2]))
+            return renderView(view, vm);
+    }
+
+    // Cells above the new SP are no longer printed
+    if(vm->SP < view->sp)
+        view->sp = vm->SP;
+
+    // Frame boundaries: CAL pushes one, RTN pops one
+    int top = view->frames[view->numOfFrames - 1];
+    if(vm->BP != top)
+    {
+        if(vm->BP > top && vm->BP + 2 < VIEW_CELLS && stack[vm->BP + 2] == top)
+        {
+            view->frames[view->numOfFrames++] = vm->BP;
+            view->isBase[vm->BP] = 1;
+            if(vm->BP <= view->sp)
+                updateCell(view, stack, vm->BP);
+        }
+        else if(view->numOfFrames > 1 && view->frames[view->numOfFrames - 2] == vm->BP)
+        {
+            view->numOfFrames--;
+            view->isBase[top] = 0;
+            if(top <= view->sp)
+                updateCell(view, stack, top);
+        }
+        else
+            return renderView(view, vm);
+    }
+
+    // Cells written below the old SP; the ones above are formatted by growView()
+    for(i = 0; i < n; i++)
+        if(cells[i] <= view->sp)
+            updateCell(view, stack, cells[i]);
+
+    growView(view, stack, vm->SP);
+    return 0;
+}
+
+void writeStackView(FILE* out, StackView* view, VirtualMachine* vm, Instruction insi)
+{
+    if(updateView(view, vm, insi) != 0)
+    {
+        dumpStack(out, vm->stack, vm->SP, vm->BP);
+        return;
+    }
+
+    // The bottom-most record starts with a single zero, see dumpStack()
+    fputs("  0 ", out);
+    fwrite(view->text, 1, view->offsets[view->sp], out);
+}
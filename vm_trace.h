@@ -0,0 +1,149 @@
+#ifndef __VM_TRACE_H__
+#define __VM_TRACE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "vm.h"
+
+/**
+ * Binary execution trace.
+ *
+ * A trace file starts with a TraceFileHeader, followed by one TraceRecord per
+ * executed instruction. Every record is directly followed by record.nDeltas
+ * TraceDelta entries, which are the stack cells written by that instruction.
+ * The stack is all zeros when the run starts, so replaying the deltas gives
+ * back the full stack at every step.
+ *
+ * Values are stored in the byte order of the machine that recorded the trace.
+ * */
+
+// "VMTR" when read as little-endian bytes
+#define TRACE_MAGIC 0x52544d56
+
+#define TRACE_VERSION 1
+
+// Size of the buffer the writer fills before each fwrite()
+#define TRACE_BUFFER_SIZE (1 << 20)
+
+// Most stack cells a single instruction can write (CAL)
+#define TRACE_MAX_DELTAS 4
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t recordSize; // sizeof(TraceRecord)
+} TraceFileHeader;
+
+typedef struct
+{
+    int32_t ir;      // address of the executed instruction
+    int32_t m;
+    int32_t pc;      // registers after executing the instruction
+    int32_t bp;
+    int32_t sp;
+    uint8_t op;
+    uint8_t r;
+    uint8_t l;
+    uint8_t nDeltas; // number of TraceDelta entries that follow
+} TraceRecord;
+
+typedef struct
+{
+    int32_t index;
+    int32_t value;
+} TraceDelta;
+
+typedef struct
+{
+    FILE* out;
+    size_t used;
+    int failed;     // 1 once writing to out failed
+    unsigned char buffer[TRACE_BUFFER_SIZE];
+} TraceWriter;
+
+/**
+ * Creates a writer on the given file and writes the trace file header.
+ * Returns NULL if the writer cannot be allocated.
+ * */
+TraceWriter* openTraceWriter(FILE* out);
+
+/**
+ * Appends the record of the instruction that was just executed on the virtual
+ * machine, together with the stack cells it wrote.
+ * */
+void writeTraceStep(TraceWriter*, VirtualMachine* vm, Instruction insi);
+
+/**
+ * Flushes the buffered records and frees the writer.
+ * Returns 0 on success, -1 if writing to the file failed.
+ * */
+int closeTraceWriter(TraceWriter*);
+
+/**
+ * Reads and checks the trace file header.
+ * Returns 0 on success, -1 if the file is not a trace of this version.
+ * */
+int readTraceHeader(FILE* in);
+
+/**
+ * Reads the next record and its deltas.
+ * Returns 1 if a record was read, 0 at the end of the trace and -1 if the
+ * trace is truncated or corrupt.
+ * */
+int readTraceStep(FILE* in, TraceRecord* record, TraceDelta deltas[TRACE_MAX_DELTAS]);
+
+/**
+ * Stack column of the text execution history, kept from one step to the next.
+ *
+ * dumpStack() prints every activation record again after every step, walking
+ * the dynamic links from BP down, which makes deep recursion quadratic. A view
+ * keeps the base pointers of the frames in a side array and the text of the
+ * column with the offset of every cell. After a step only the cells the
+ * instruction wrote (see stackWrites()) are formatted again, a CAL or RTN
+ * pushes or pops one frame boundary, and INC appends or cuts cells; the
+ * column is then written with a single fwrite(). The text is the same as
+ * dumpStack()'s, which is still used for the steps the view cannot follow
+ * (links that do not lead down the stack, SP below the current frame).
+ * */
+typedef struct StackView StackView;
+
+/**
+ * Creates a view that renders everything at its first step.
+ * Returns NULL if it cannot be allocated; traceStep() then uses dumpStack().
+ * */
+StackView* openStackView(void);
+
+/**
+ * Frees the view.
+ * */
+void closeStackView(StackView*);
+
+/**
+ * Updates the view to the machine after executing insi, which must follow the
+ * state of the previous call, and prints the stack column like dumpStack().
+ * */
+void writeStackView(FILE* out, StackView*, VirtualMachine* vm, Instruction insi);
+
+/**
+ * Defined in vm.c
+ * */
+
+// Prints the ***Execution*** title and column names
+void dumpExecutionHeader(FILE*);
+
+// Prints one row of the execution history, with the stack column of the
+// .. view, or of dumpStack() if view is NULL
+void traceStep(FILE*, StackView* view, VirtualMachine* vm, Instruction insi);
+
+// Prints the stack, one activation record per '|' separated group
+void dumpStack(FILE*, int* stack, int sp, int bp);
+
+// Fills cells with the stack indices written by the instruction just executed.
+// Returns the number of cells.
+int stackWrites(VirtualMachine* vm, Instruction insi, int cells[TRACE_MAX_DELTAS]);
+
+// Runs the program, writing a binary trace to traceOut
+void recordVM(FILE* inp, FILE* traceOut, FILE* vm_inp, FILE* vm_outp);
+
+#endif
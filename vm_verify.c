@@ -0,0 +1,50 @@
+/*
+* Brian Kaine Margretta
+* Cop3402 Systems Software
+* This program tells whether a code file runs on the unchecked fast path
+*
+* Usage: vm_verify <code file>
+* Build: link with verify.c, vm.c, vm_trace.c, vm_output.c, vm_input.c,
+*        bytecode.c, jit.c, snapshot.c and vm_perf.c
+*
+* Prints the verdict of the verifier (see verify.h) and the procedures it
+* .. found. Exits with 0 if the program is verified, 2 if it runs on the
+* .. checked path and 1 if the code file is invalid.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "vm_engine.h"
+#include "verify.h"
+
+int main(int argc, char** argv)
+{
+    if(argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <code file>\n", argv[0]);
+        return 1;
+    }
+
+    FILE* in = fopen(argv[1], "rb");
+    if(!in)
+    {
+        fprintf(stderr, "Cannot open %s.\n", argv[1]);
+        return 1;
+    }
+    CodeMemory code;
+    int status = loadCodeMemory(in, &code);
+    fclose(in);
+    if(status != 0)
+    {
+        fprintf(stderr, "Invalid code file %s.\n", argv[1]);
+        return 1;
+    }
+
+    VerifyReport report;
+    int verified = verifyProgram(code.ins, code.numOfIns, &report);
+    printVerifyReport(stdout, &report);
+
+    freeVerifyReport(&report);
+    freeCodeMemory(&code);
+    return verified ? 0 : 2;
+}